@@ -40,6 +40,11 @@ extern "C" {
 //
 //      zstr_sendx (zm_asset, "STOP", NULL);
 //
+//  Get statistics of actor as ZPL string.
+//
+//      zstr_sendx (zm_asset, "STATS", NULL);
+//      char *stats = zstr_recv (zm_asset);
+//
 //  This is the zm_asset constructor as a zactor_fn;
 ZM_ASSET_EXPORT void
     zm_asset_actor (zsock_t *pipe, void *args);
@@ -0,0 +1,111 @@
+/*  =========================================================================
+    zm_asset_client - Client of zm asset with local cache
+
+    Copyright (c) the Contributors as noted in the AUTHORS file.  This file is part
+    of zmon.it, the fast and scalable monitoring system.                           
+                                                                                   
+    This Source Code Form is subject to the terms of the Mozilla Public License, v.
+    2.0. If a copy of the MPL was not distributed with this file, You can obtain   
+    one at http://mozilla.org/MPL/2.0/.                                            
+    =========================================================================
+*/
+
+#ifndef ZM_ASSET_CLIENT_H_INCLUDED
+#define ZM_ASSET_CLIENT_H_INCLUDED
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//  @interface
+//  Create a new zm_asset_client connected to malamute endpoint with its
+//  own mailbox address. Requests are sent to zm_asset actor listening on
+//  server address. Returns NULL if client can't connect.
+ZM_ASSET_EXPORT zm_asset_client_t *
+    zm_asset_client_new (const char *endpoint, const char *address, const char *server);
+
+//  Destroy the zm_asset_client
+ZM_ASSET_EXPORT void
+    zm_asset_client_destroy (zm_asset_client_t **self_p);
+
+//  Keep devices looked up in local cache of at most size devices, 0 means
+//  unlimited. Cache is kept coherent by consuming INSERT and DELETE from
+//  stream server publishes to, usually ZM_PROTO_DEVICE_STREAM, including
+//  ones of namespaces with prefixed subjects. Namespace whose changes are
+//  not published (publish = 0 on server) would be cached stale forever,
+//  disable cache of it by zm_asset_client_set_cache_namespace. Returns 0
+//  if successful, otherwise -1.
+ZM_ASSET_EXPORT int
+    zm_asset_client_set_cache (zm_asset_client_t *self, const char *stream, size_t size);
+
+//  Enable or disable cache of devices of namespace ns, "" is the default
+//  namespace. Cache is enabled for all namespaces by default. Disabling it
+//  drops devices of namespace already cached.
+ZM_ASSET_EXPORT void
+    zm_asset_client_set_cache_namespace (zm_asset_client_t *self, const char *ns, bool enabled);
+
+//  Set how long synchronous calls wait for reply, msec, default is 5000
+ZM_ASSET_EXPORT void
+    zm_asset_client_set_timeout (zm_asset_client_t *self, int timeout);
+
+//  Return device of name, from cache if it is there. Returns NULL if device
+//  does not exist or server did not reply, see zm_asset_client_reply. Device
+//  is owned by client and valid until the next call.
+ZM_ASSET_EXPORT zm_proto_t *
+    zm_asset_client_lookup (zm_asset_client_t *self, const char *name);
+
+//  Insert or update device. Returns 0 if server accepted it, otherwise -1.
+ZM_ASSET_EXPORT int
+    zm_asset_client_insert (zm_asset_client_t *self, zm_proto_t *device);
+
+//  Delete device of name. Returns 0 if server accepted it, otherwise -1.
+ZM_ASSET_EXPORT int
+    zm_asset_client_delete (zm_asset_client_t *self, const char *name);
+
+//  Return the last reply, with error code when a call failed. NULL when
+//  server did not reply in time, the late reply is discarded.
+ZM_ASSET_EXPORT zm_proto_t *
+    zm_asset_client_reply (zm_asset_client_t *self);
+
+//  Send request with subject LOOKUP, INSERT or DELETE, optionally prefixed
+//  by namespace like tenant1/LOOKUP, without waiting for reply. Returns
+//  tracker reply will have, or 0 if request could not be sent. LOOKUP of
+//  cached device is not sent, its reply is returned by the next
+//  zm_asset_client_recv.
+ZM_ASSET_EXPORT uint64_t
+    zm_asset_client_send (zm_asset_client_t *self, const char *subject, zm_proto_t *request);
+
+//  Wait for reply of request sent by zm_asset_client_send, up to timeout
+//  msec, -1 means forever. Replies can come in other order than requests
+//  were sent. Returns reply, owned by client and valid until the next call,
+//  or NULL on timeout or interrupt.
+ZM_ASSET_EXPORT zm_proto_t *
+    zm_asset_client_recv (zm_asset_client_t *self, int timeout);
+
+//  Return tracker of reply returned by the last zm_asset_client_recv
+ZM_ASSET_EXPORT uint64_t
+    zm_asset_client_tracker (zm_asset_client_t *self);
+
+//  Return number of lookups answered from cache
+ZM_ASSET_EXPORT uint64_t
+    zm_asset_client_hits (zm_asset_client_t *self);
+
+//  Return number of lookups sent to server
+ZM_ASSET_EXPORT uint64_t
+    zm_asset_client_misses (zm_asset_client_t *self);
+
+//  Return number of devices in cache
+ZM_ASSET_EXPORT size_t
+    zm_asset_client_cached (zm_asset_client_t *self);
+
+//  Self test of this class
+ZM_ASSET_EXPORT void
+    zm_asset_client_test (bool verbose);
+
+//  @end
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -69,12 +69,15 @@
 #ifdef ZM_ASSET_BUILD_DRAFT_API
 typedef struct _zm_asset_t zm_asset_t;
 #define ZM_ASSET_T_DEFINED
+typedef struct _zm_asset_client_t zm_asset_client_t;
+#define ZM_ASSET_CLIENT_T_DEFINED
 #endif // ZM_ASSET_BUILD_DRAFT_API
 
 
 //  Public classes, each with its own header file
 #ifdef ZM_ASSET_BUILD_DRAFT_API
 #include "zm_asset.h"
+#include "zm_asset_client.h"
 #endif // ZM_ASSET_BUILD_DRAFT_API
 
 #ifdef ZM_ASSET_BUILD_DRAFT_API
@@ -68,6 +68,7 @@ find %{buildroot} -name '*.la' | xargs rm -f
 %files
 %defattr(-,root,root)
 %{_bindir}/zmasset
+%{_bindir}/zm_asset_replay
 %config(noreplace) %{_sysconfdir}/zm-asset/zmasset.cfg
 /usr/lib/systemd/system/zmasset.service
 %dir %{_sysconfdir}/zm-asset
@@ -0,0 +1,211 @@
+/*  =========================================================================
+    zm_aggregate - Device counts grouped by attributes
+
+    Copyright (c) the Contributors as noted in the AUTHORS file.  This file is part
+    of zmon.it, the fast and scalable monitoring system.                           
+                                                                                   
+    This Source Code Form is subject to the terms of the Mozilla Public License, v.
+    2.0. If a copy of the MPL was not distributed with this file, You can obtain   
+    one at http://mozilla.org/MPL/2.0/.                                            
+    =========================================================================
+*/
+
+/*
+@header
+    zm_aggregate - Device counts grouped by attributes
+@discuss
+    For every configured ext attribute, aggregate keeps number of devices
+    per value of the attribute. Store reports each change of device as old
+    and new state, so counts are kept up to date incrementally and groups
+    are read in time proportional to their number, without visiting any
+    device. Values without devices are forgotten.
+@end
+*/
+
+#include "zm_asset_classes.h"
+
+//  Structure of our class
+
+struct _zm_aggregate_t {
+    char *attributes;           //  Attributes as configured
+    zhashx_t *groups;           //  Attribute -> zhashx_t of value -> count
+};
+
+//  Add delta to count of value, counts are kept as item pointers
+static void
+s_aggregate_add (zhashx_t *counts, const char *value, int delta)
+{
+    size_t count = (size_t) (uintptr_t) zhashx_lookup (counts, value) + delta;
+    if (count)
+        zhashx_update (counts, value, (void *) (uintptr_t) count);
+    else
+        zhashx_delete (counts, value);
+}
+
+
+//  --------------------------------------------------------------------------
+//  Create a new zm_aggregate
+
+zm_aggregate_t *
+zm_aggregate_new (const char *attributes)
+{
+    zm_aggregate_t *self = (zm_aggregate_t *) zmalloc (sizeof (zm_aggregate_t));
+    assert (self);
+    self->attributes = strdup (attributes? attributes: "");
+    self->groups = zhashx_new ();
+    assert (self->groups);
+    zhashx_set_destructor (self->groups, (zhashx_destructor_fn *) zhashx_destroy);
+
+    char *list = strdup (self->attributes);
+    char *state = NULL;
+    char *attribute = strtok_r (list, ", \t", &state);
+    while (attribute) {
+        zhashx_t *counts = zhashx_new ();
+        assert (counts);
+        if (zhashx_insert (self->groups, attribute, counts) == -1)
+            zhashx_destroy (&counts);
+        attribute = strtok_r (NULL, ", \t", &state);
+    }
+    free (list);
+    return self;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Destroy the zm_aggregate
+
+void
+zm_aggregate_destroy (zm_aggregate_t **self_p)
+{
+    assert (self_p);
+    if (*self_p) {
+        zm_aggregate_t *self = *self_p;
+        zhashx_destroy (&self->groups);
+        zstr_free (&self->attributes);
+        free (self);
+        *self_p = NULL;
+    }
+}
+
+const char *
+zm_aggregate_attributes (zm_aggregate_t *self)
+{
+    assert (self);
+    return self->attributes;
+}
+
+void
+zm_aggregate_update (zm_aggregate_t *self, zm_proto_t *old_device, zm_proto_t *new_device)
+{
+    assert (self);
+    zhash_t *old_ext = old_device? zm_proto_ext (old_device): NULL;
+    zhash_t *new_ext = new_device? zm_proto_ext (new_device): NULL;
+    if (!old_ext && !new_ext)
+        return;
+
+    zhashx_t *counts = (zhashx_t *) zhashx_first (self->groups);
+    while (counts) {
+        const char *attribute = (const char *) zhashx_cursor (self->groups);
+        const char *old_value = old_ext? (const char *) zhash_lookup (old_ext, attribute): NULL;
+        const char *new_value = new_ext? (const char *) zhash_lookup (new_ext, attribute): NULL;
+        if (!old_value || !new_value || !streq (old_value, new_value)) {
+            if (old_value)
+                s_aggregate_add (counts, old_value, -1);
+            if (new_value)
+                s_aggregate_add (counts, new_value, 1);
+        }
+        counts = (zhashx_t *) zhashx_next (self->groups);
+    }
+}
+
+size_t
+zm_aggregate_count (zm_aggregate_t *self, const char *attribute, const char *value)
+{
+    assert (self);
+    assert (attribute);
+    assert (value);
+    zhashx_t *counts = (zhashx_t *) zhashx_lookup (self->groups, attribute);
+    return counts? (size_t) (uintptr_t) zhashx_lookup (counts, value): 0;
+}
+
+zhash_t *
+zm_aggregate_groups (zm_aggregate_t *self, const char *attribute)
+{
+    assert (self);
+    assert (attribute);
+    zhashx_t *counts = (zhashx_t *) zhashx_lookup (self->groups, attribute);
+    if (!counts)
+        return NULL;
+    zhash_t *groups = zhash_new ();
+    assert (groups);
+    zhash_autofree (groups);
+    char value [32];
+    void *count = zhashx_first (counts);
+    while (count) {
+        snprintf (value, sizeof (value), "%zu", (size_t) (uintptr_t) count);
+        zhash_insert (groups, (const char *) zhashx_cursor (counts), value);
+        count = zhashx_next (counts);
+    }
+    return groups;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Self test of this class
+
+void
+zm_aggregate_test (bool verbose)
+{
+    printf (" * zm_aggregate: ");
+
+    //  @selftest
+    zm_aggregate_t *self = zm_aggregate_new ("site, model,site");
+    assert (self);
+    assert (streq (zm_aggregate_attributes (self), "site, model,site"));
+    assert (!zm_aggregate_groups (self, "state"));
+
+    zm_proto_t *device = zm_proto_new ();
+    zm_proto_t *other = zm_proto_new ();
+    zhash_t *ext = zhash_new ();
+    zhash_insert (ext, "site", "prague");
+    zhash_insert (ext, "model", "X1");
+    zm_proto_encode_device (device, "device1", 1, 1000, ext);
+    zm_aggregate_update (self, NULL, device);
+    zm_proto_encode_device (device, "device2", 1, 1000, ext);
+    zm_aggregate_update (self, NULL, device);
+    zhash_update (ext, "site", "brno");
+    zm_proto_encode_device (other, "device3", 1, 1000, ext);
+    zm_aggregate_update (self, NULL, other);
+    zm_proto_encode_device (device, "device4", 1, 1000, NULL);
+    zm_aggregate_update (self, NULL, device);
+    assert (zm_aggregate_count (self, "site", "prague") == 2);
+    assert (zm_aggregate_count (self, "site", "brno") == 1);
+    assert (zm_aggregate_count (self, "model", "X1") == 3);
+
+    //  Change of model moves device between groups of model only
+    zhash_update (ext, "model", "X2");
+    zm_proto_encode_device (device, "device3", 2, 1000, ext);
+    zm_aggregate_update (self, other, device);
+    assert (zm_aggregate_count (self, "site", "brno") == 1);
+    assert (zm_aggregate_count (self, "model", "X1") == 2);
+    assert (zm_aggregate_count (self, "model", "X2") == 1);
+    zhash_t *groups = zm_aggregate_groups (self, "model");
+    assert (zhash_size (groups) == 2);
+    assert (streq ((char *) zhash_lookup (groups, "X1"), "2"));
+    zhash_destroy (&groups);
+
+    //  Removed device is not counted and empty group disappears
+    zm_aggregate_update (self, device, NULL);
+    assert (zm_aggregate_count (self, "model", "X2") == 0);
+    groups = zm_aggregate_groups (self, "site");
+    assert (zhash_size (groups) == 1);
+    assert (streq ((char *) zhash_lookup (groups, "prague"), "2"));
+    zhash_destroy (&groups);
+
+    zhash_destroy (&ext);
+    zm_proto_destroy (&other);
+    zm_proto_destroy (&device);
+    zm_aggregate_destroy (&self);
+    //  @end
+    printf ("OK\n");
+}
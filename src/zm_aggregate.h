@@ -0,0 +1,60 @@
+/*  =========================================================================
+    zm_aggregate - Device counts grouped by attributes
+
+    Copyright (c) the Contributors as noted in the AUTHORS file.  This file is part
+    of zmon.it, the fast and scalable monitoring system.                           
+                                                                                   
+    This Source Code Form is subject to the terms of the Mozilla Public License, v.
+    2.0. If a copy of the MPL was not distributed with this file, You can obtain   
+    one at http://mozilla.org/MPL/2.0/.                                            
+    =========================================================================
+*/
+
+#ifndef ZM_AGGREGATE_H_INCLUDED
+#define ZM_AGGREGATE_H_INCLUDED
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//  @interface
+//  Create a new zm_aggregate counting devices by comma separated list of
+//  ext attributes, e.g. "site,model,state"
+ZM_ASSET_PRIVATE zm_aggregate_t *
+    zm_aggregate_new (const char *attributes);
+
+//  Destroy the zm_aggregate
+ZM_ASSET_PRIVATE void
+    zm_aggregate_destroy (zm_aggregate_t **self_p);
+
+//  Return list of attributes aggregate was created with
+ZM_ASSET_PRIVATE const char *
+    zm_aggregate_attributes (zm_aggregate_t *self);
+
+//  Replace old state of device by new one, NULL old means device was added,
+//  NULL new means device was removed. Only attributes which differ change
+//  counts.
+ZM_ASSET_PRIVATE void
+    zm_aggregate_update (zm_aggregate_t *self, zm_proto_t *old_device, zm_proto_t *new_device);
+
+//  Return number of devices with attribute of value
+ZM_ASSET_PRIVATE size_t
+    zm_aggregate_count (zm_aggregate_t *self, const char *attribute, const char *value);
+
+//  Return counts of devices by values of attribute as strings, devices
+//  without the attribute are not counted. Returns NULL if attribute is not
+//  aggregated. Caller destroys the hash.
+ZM_ASSET_PRIVATE zhash_t *
+    zm_aggregate_groups (zm_aggregate_t *self, const char *attribute);
+
+//  Self test of this class
+ZM_ASSET_PRIVATE void
+    zm_aggregate_test (bool verbose);
+
+//  @end
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -23,25 +23,524 @@ In this mode actor simple publish information about devices with subjects
 INSERT and DELETE. INSERT means that new device has been added. DELETE means
 device is gone.
 
+When malamute/batch/size is set, changes are not published one by one, but
+collected for up to malamute/batch/window msec or until there is size of
+them and published as one message with subject BATCH. Each record of BATCH
+consists of two frames, subject (INSERT or DELETE) and zm_proto message
+encoded into single frame (see zmsg_addmsg). Records keep order of changes.
+
+With malamute/conflate set, changes are not queued one by one when
+malamute client can't take more of them, that is when pipe to its actor,
+which sends them to malamute, is full. Actor keeps
+just the last not yet published change of each device and publishes it
+when client is writable again, so intermediate states of flapping device
+are skipped and memory held is bounded by number of devices. DELETE is
+never skipped, DELETE followed by INSERT publishes both. Devices are
+published in order of their first held change. Actor command PAUSE holds
+publishing the same way until RESUME, both signal when done.
+
 # CONSUME (not implemented - what will be the use-case? inventory stream can be done via special MAILBOX command)
 
+# STANDBY
+
+With server/mode = standby, actor keeps warm copy of devices of primary
+instance. It consumes the stream primary publishes to (configure it in
+malamute/consumer) and applies INSERT, DELETE and BATCH messages sent by
+server/standby/primary address. Standby answers LOOKUPs on its own address,
+other requests are refused with code 503.
+
+Primary publishes HEARTBEAT every server/heartbeat msec, DEVICE message
+with its address and wall clock time. When standby does not hear from
+primary for server/standby/timeout msec, it reconnects to malamute with
+address of primary and serves as primary from then on. Mailbox requests
+malamute kept for primary address meanwhile are delivered to it. Watches
+registered on primary are not replicated, watchers must renew them.
+
 # MAILBOX
 
-In this mode actor provide three commands (subjects)
+In this mode actor answers requests sent to its mailbox, subject of
+request is the command, content is ZM_PROTO message. Commands are
 
     * INSERT - adds or update device in internal cache, PUBLISH it on STREAM
         returns ZM_PROTO_OK
     * DELETE - delete device from cache and PUBLISH it on stream
         returns ZM_PROTO_OK
     * LOOKUP - search by device name
-        returns ZM_PROTO_DEVICE if found
+        returns ZM_PROTO_DEVICE if found, it is encoded once by the store
+            and shared by replies until device changes
         returns ZM_PROTO_ERROR if not found
+    * WATCH - sender wants to be notified about changes of device, device
+        field is name of device or its prefix followed by '*', ttl is lease
+        in msec (0 means server/watch/lease). Watch must be renewed before
+        lease expires, it is the only way watchers which are gone are
+        forgotten. Changes are sent to sender mailbox as ZM_PROTO_DEVICE
+        with subject INSERT or DELETE.
+        returns ZM_PROTO_OK
+        returns ZM_PROTO_ERROR if name or prefix is invalid
+    * UNWATCH - stop watching device name or prefix
+        returns ZM_PROTO_OK
+    * DIGEST - hash tree over devices (see zm_digest), device field is the
+        level of tree to return, 0 is root
+        returns ZM_PROTO_DEVICE named DIGEST, ext has depth of tree, level
+            and hex hash of every non-empty node of level keyed by its index
+        returns ZM_PROTO_ERROR if level is deeper than tree
+    * BUCKET - devices of one leaf of hash tree, device field is its index
+        returns ZM_PROTO_DEVICE named BUCKET with ext bucket and count,
+            followed by count frames, each with encoded ZM_PROTO_DEVICE
+        returns ZM_PROTO_ERROR if there is no such bucket
+    * STALE - devices last updated before time field, oldest first, ttl is
+        size of page (0 or more than 1000 means 1000), device field is empty
+        for the first page or cursor returned with previous page
+        returns ZM_PROTO_DEVICE named STALE with ext count and cursor, when
+            there can be more devices, followed by count frames, each with
+            encoded ZM_PROTO_DEVICE
+        returns ZM_PROTO_ERROR if cursor is invalid
+    * COUNT - numbers of devices by values of ext attribute named in device
+        field, attribute must be listed in server/aggregate/attributes
+        returns ZM_PROTO_DEVICE named COUNT, ext has count of devices keyed
+            by value of attribute, devices without attribute are not counted
+        returns ZM_PROTO_ERROR if attribute is not counted
+
+Reply has the same subject as request and tracker request was sent with
+(see mlm_client_sendto), so client can keep many requests in flight and
+match replies by tracker. Requests of one sender are not always answered
+in order, reads can overtake writes.
+
+Stored device has its version in ext x-zm-version (see zm_devices), it
+changes when device is created or its ext changes. INSERT or DELETE
+with x-zm-version in ext is done only if device is at that version, 0
+means device must not exist. Otherwise ZM_PROTO_ERROR with code 409 is
+returned and its description is the current version, so client can do
+read-modify-write without LOOKUP before every change.
+
+# DIGEST
+
+Consumer checks its copy of devices by comparing root of DIGEST with its
+own tree built the same way (see zm_digest) and descends only into
+differing nodes. Devices of differing leaves are fetched by BUCKET.
+
+# TRACE
+
+With server/trace/sample set to N, every N-th mailbox request is traced.
+Time of each stage of its processing is measured by monotonic clock and
+written to a ring buffer of server/trace/size records. Stages are queued
+(request waited for scheduling), decoded (zm_proto_recv), stored
+(operation on devices), published (zm_asset_publish), notified (watchers)
+and replied (mlm_client_sendto), each is time since arrival in usec at its
+end. Stages request did not go through are missing. Requests which are not
+sampled cost just a counter increment.
+
+Actor command TRACE returns traced requests as ZPL string, oldest first.
+Optional argument is name of file to save them to as well.
+
+# BOOTSTRAP
+
+With server/bootstrap/peer set, actor fills its default namespace from
+running peer zm-asset when it starts. It asks peer for all devices by
+STALE requests with the highest time, server/bootstrap/chunk devices at
+once, each following the cursor of previous one. Device is inserted if it
+is not known yet or peer has newer time of it, changes from agents made
+meanwhile are never overwritten by older copies. Bootstrapped devices are
+not published. LOOKUPs and other requests, including those of peer, are
+served as usual while the transfer runs. Chunk not answered in
+server/bootstrap/timeout msec is requested again, three times at most.
+
+# CAPTURE
+
+With server/capture/file set, or after actor command CAPTURE with name of
+file, every mailbox request is appended to the file as it arrives, before
+admission and scheduling. CAPTURE without file stops capturing, actor
+signals when file is closed. File starts with "ZMCAP1\n" followed by
+records, numbers are big endian:
+
+    time        8 bytes, monotonic clock of arrival, usec
+    sender      1 byte length + sender address
+    subject     1 byte length + subject
+    content     4 bytes length + zmsg_encode of request
+
+zm_asset_replay sends captured requests to actor again with the original
+senders, subjects and pacing.
+
+# NAMESPACES
+
+Devices can be split to isolated namespaces configured in namespaces
+section. Request for namespace has subject prefixed by its name and slash,
+e.g. tenant1/INSERT, requests without prefix go to default namespace.
+Each namespace has its own devices, persistence file and watches. Changes
+are published on the producer stream with prefixed subject, unless publish
+is disabled for namespace. Request for unknown namespace returns
+ZM_PROTO_ERROR with code 404.
+
+# SCHEDULING
+
+Incoming mailbox traffic is drained into read (LOOKUP, DIGEST, BUCKET,
+STALE, COUNT) and write queues. Each scheduling round processes up to
+server/schedule/reads reads and server/schedule/writes other requests, so
+interactive LOOKUPs do not wait behind bulk INSERTs while writes are never
+starved.
+
+Each sender is admitted by token bucket (see server/ratelimit), request
+exceeding the limit is not processed and ZM_PROTO_ERROR with code 429 is
+returned.
+
+# CONFIGURATION
+
+    malamute
+        endpoint = ipc://@/malamute
+        address = it.zmon.asset
+        producer = DEVICES      #   Stream to publish changes on
+        batch
+            size = 0            #   Records in BATCH, 0 = publish one by one
+            window = 10         #   Longest delay of change in BATCH, msec
+        conflate = 0            #   Publish just last change of device under backpressure
+    namespaces
+        <name>
+            file = <name>.zpl   #   Persistence file for devices of namespace
+            publish = 1         #   Publish changes of namespace on stream
+    server
+        file = devices.zpl      #   Persistence file for devices
+        load_workers = 1        #   Threads used to parse large persistence file, 1..64
+        shards = 0              #   Split persistence file to N files by device name
+        store_workers = 4       #   Threads writing changed shards
+        fsync = 0               #   fsync persistence file on store
+        journal
+            level = none        #   none, async, fsync or sync, see zm_journal
+            ring = 4096         #   Changes waiting for persistence thread
+            compact = 100000    #   Store snapshot when journal has N changes, 0 = never
+        digest
+            depth = 10          #   Levels of DIGEST tree, 2^depth buckets
+        aggregate
+            attributes =        #   Ext attributes counted for COUNT, e.g. site,model
+        bootstrap
+            peer =              #   Address of zm-asset to copy devices from
+            chunk = 1000        #   Devices in one transfer request
+            timeout = 5000      #   Time to wait for chunk, msec
+        capture
+            file =              #   Capture mailbox requests to file
+        trace
+            sample = 0          #   Trace every N-th request, 0 = disabled
+            size = 1024         #   Requests kept in trace ring buffer
+        mode = primary          #   primary or standby
+        heartbeat = 0           #   HEARTBEAT interval of primary, msec, 0 = none
+        standby
+            primary = it.zmon.asset #   Address of primary to follow and take over
+            timeout = 3000      #   Silence of primary before takeover, msec
+        budget
+            entries = 0         #   Devices kept in memory, 0 = unlimited
+            memory = 0          #   Estimated bytes of devices, 0 = unlimited
+            persisted_only = 1  #   Evict only devices stored in file
+        ratelimit
+            rate = 0            #   Requests per second per sender, 0 = unlimited
+            burst = 100         #   Requests sender can do at once
+            pending = 0         #   Requests sender can have queued, 0 = unlimited
+            idle = 60000        #   Forget state of sender idle this long, msec
+            senders
+                <address> = 10  #   Rate for particular sender
+        watch
+            lease = 60000       #   Default lease of WATCH, msec
+        schedule
+            reads = 8           #   LOOKUPs processed in one scheduling round
+            writes = 1          #   Other requests processed in one round
+
+# STATS
+
+Actor command STATS returns ZPL string with counters of accepted and
+throttled requests per sender, senders idle for server/ratelimit/idle
+are forgotten. It reports histograms of time requests spent in read and
+write queues, number of watches and notifications and lookup counters of
+devices. For BATCH publishing it reports histogram of
+batch sizes and average and maximal delay records spent in batch (usec).
+Conflation reports devices with held changes, the most of them at once,
+changes held, changes replaced by newer ones and held changes published.
+
+Lookups of devices which were never inserted are answered by Bloom filter,
+its hit rate and estimated false positive rate are reported too. With a
+budget set, number of resident devices, their estimated memory, evictions
+and reloads from file are reported. With journal, changes appended and
+committed, size of journal, batches, fsyncs and how many times actor
+waited for full ring are reported. Snapshots stored to compact journal
+are counted in compactions. Device counters of namespaces are reported in
+namespaces/<name>.
+
+Replication reports mode, number of changes applied from primary, lag
+measured by last HEARTBEAT and time since primary was heard of (msec).
+Number of captured requests is in capture/requests, changes refused for
+version conflict are counted in conflicts. Bootstrap reports state
+(running, done or failed), chunks, devices received and inserted, bytes,
+duration of transfer (msec) and its rate (devices/s).
 
 @end
 */
 
 #include "zm_asset_classes.h"
 
+//  Admission state of one mailbox sender, token bucket refilled by rate
+//  tokens per second up to burst
+
+typedef struct {
+    double rate;                //  Tokens per second, 0 = unlimited
+    double burst;               //  Bucket size
+    double tokens;              //  Tokens available
+    int64_t refilled;           //  Time of last refill, msec
+    int64_t seen;               //  Time of last request, msec
+    size_t pending;             //  Requests waiting in queues
+    size_t max_pending;         //  Limit of pending requests, 0 = unlimited
+    uint64_t accepted;          //  Requests processed
+    uint64_t throttled;         //  Requests refused
+} s_sender_t;
+
+static void
+s_sender_destroy (s_sender_t **self_p)
+{
+    assert (self_p);
+    if (*self_p) {
+        free (*self_p);
+        *self_p = NULL;
+    }
+}
+
+//  Mailbox request waiting for processing
+
+typedef struct {
+    zmsg_t *content;            //  Encoded zm_proto message
+    char *sender;               //  Address of sender
+    char *subject;              //  Subject of request
+    char *tracker;              //  Tracker of request, returned in reply
+    int64_t queued;             //  Time of arrival, usec
+    bool traced;                //  Sampled for tracing
+} s_request_t;
+
+//  Return monotonic time in microseconds
+static int64_t
+s_mono_usecs (void)
+{
+    struct timespec ts;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static s_request_t *
+s_request_new (zmsg_t **content_p, const char *sender, const char *subject, const char *tracker)
+{
+    s_request_t *self = (s_request_t *) zmalloc (sizeof (s_request_t));
+    assert (self);
+    self->content = *content_p;
+    *content_p = NULL;
+    self->sender = strdup (sender);
+    self->subject = strdup (subject);
+    self->tracker = tracker? strdup (tracker): NULL;
+    self->queued = s_mono_usecs ();
+    return self;
+}
+
+static void
+s_request_destroy (s_request_t **self_p)
+{
+    assert (self_p);
+    if (*self_p) {
+        s_request_t *self = *self_p;
+        zmsg_destroy (&self->content);
+        zstr_free (&self->sender);
+        zstr_free (&self->subject);
+        zstr_free (&self->tracker);
+        free (self);
+        *self_p = NULL;
+    }
+}
+
+//  Queue of requests with histogram of time spent waiting, bucket i counts
+//  requests which waited less than 2^(i+1) usec
+
+#define ZM_ASSET_WAIT_BUCKETS 24
+
+typedef struct {
+    zlistx_t *requests;         //  Requests waiting for processing
+    size_t weight;              //  Requests processed in one round
+    uint64_t processed;         //  Requests processed so far
+    int64_t max_wait;           //  Longest wait, usec
+    uint64_t wait [ZM_ASSET_WAIT_BUCKETS];
+} s_queue_t;
+
+static void
+s_queue_init (s_queue_t *self, size_t weight)
+{
+    memset (self, 0, sizeof (s_queue_t));
+    self->requests = zlistx_new ();
+    assert (self->requests);
+    zlistx_set_destructor (self->requests, (zlistx_destructor_fn *) s_request_destroy);
+    self->weight = weight;
+}
+
+static void
+s_queue_account (s_queue_t *self, int64_t wait)
+{
+    size_t bucket = 0;
+    int64_t max_wait = wait;
+    while (wait >= 2 && bucket < ZM_ASSET_WAIT_BUCKETS - 1) {
+        wait >>= 1;
+        bucket++;
+    }
+    self->wait [bucket]++;
+    self->processed++;
+    if (max_wait > self->max_wait)
+        self->max_wait = max_wait;
+}
+
+static void
+s_queue_stats (s_queue_t *self, zconfig_t *parent)
+{
+    zconfig_putf (parent, "waiting", "%zu", zlistx_size (self->requests));
+    zconfig_putf (parent, "processed", "%" PRIu64, self->processed);
+    zconfig_putf (parent, "max_wait", "%" PRIi64, self->max_wait);
+    zconfig_t *wait = zconfig_new ("wait", parent);
+    size_t bucket;
+    for (bucket = 0; bucket != ZM_ASSET_WAIT_BUCKETS; bucket++) {
+        if (self->wait [bucket]) {
+            char name [32];
+            snprintf (name, sizeof (name), "%lu", 2ul << bucket);
+            zconfig_putf (wait, name, "%" PRIu64, self->wait [bucket]);
+        }
+    }
+}
+
+//  Changes waiting to be published as one BATCH message, histogram bucket i
+//  counts batches of less than 2^(i+1) records
+
+#define ZM_ASSET_BATCH_BUCKETS 16
+
+typedef struct {
+    size_t limit;               //  Records in batch, 0 = batching disabled
+    int64_t window;             //  Longest time record can wait, usec
+    zmsg_t *msg;                //  Records waiting for publishing
+    size_t records;             //  Records in msg
+    int64_t opened;             //  Time first record was added, usec
+    int64_t added_sum;          //  Sum of times records were added, usec
+    uint64_t batches;           //  Batches published
+    uint64_t published;         //  Records published
+    int64_t latency_sum;        //  Sum of time records waited, usec
+    int64_t latency_max;        //  Longest time record waited, usec
+    uint64_t sizes [ZM_ASSET_BATCH_BUCKETS];
+} s_batch_t;
+
+//  Last held changes of one device, DELETE goes before INSERT
+
+typedef struct {
+    char *key;                  //  Namespace prefix and name of device
+    char *prefix;               //  Namespace prefix of subjects, "" for default
+    zmsg_t *deleted;            //  Held DELETE, NULL if none
+    zmsg_t *inserted;           //  Held INSERT, NULL if none
+} s_slot_t;
+
+static void
+s_slot_destroy (s_slot_t **self_p)
+{
+    assert (self_p);
+    if (*self_p) {
+        s_slot_t *self = *self_p;
+        zstr_free (&self->key);
+        zstr_free (&self->prefix);
+        zmsg_destroy (&self->deleted);
+        zmsg_destroy (&self->inserted);
+        free (self);
+        *self_p = NULL;
+    }
+}
+
+//  Changes held while malamute client can't take them
+
+typedef struct {
+    bool enabled;               //  Hold changes when client pipe is full
+    bool paused;                //  Publishing held by PAUSE command
+    zhashx_t *slots;            //  Held changes by key of device
+    zlistx_t *order;            //  Slots in order of first held change
+    size_t max_pending;         //  Most devices held at once
+    uint64_t held;              //  Changes which were held
+    uint64_t conflated;         //  Held changes replaced by newer ones
+    uint64_t published;         //  Held changes published
+} s_conflation_t;
+
+//  How often is publishing of held changes retried, msec
+#define ZM_ASSET_RELEASE_INTERVAL 10
+
+//  Trace of one request, stage is time since arrival at end of stage, usec,
+//  0 if request did not go through it
+
+typedef enum {
+    ZM_ASSET_TRACE_QUEUED,
+    ZM_ASSET_TRACE_DECODED,
+    ZM_ASSET_TRACE_STORED,
+    ZM_ASSET_TRACE_PUBLISHED,
+    ZM_ASSET_TRACE_NOTIFIED,
+    ZM_ASSET_TRACE_REPLIED,
+    ZM_ASSET_TRACE_STAGES
+} s_trace_stage_t;
+
+static const char *s_trace_stages [ZM_ASSET_TRACE_STAGES] = {
+    "queued", "decoded", "stored", "published", "notified", "replied"
+};
+
+typedef struct {
+    int64_t arrived;            //  Time of arrival, usec
+    uint32_t stage [ZM_ASSET_TRACE_STAGES];
+    char subject [32];          //  Subject of request, truncated
+    char sender [64];           //  Sender of request, truncated
+} s_trace_t;
+
+//  Ring buffer of sampled traces
+
+typedef struct {
+    size_t sample;              //  Trace every sample-th request, 0 = none
+    uint64_t counter;           //  Requests seen
+    uint64_t sampled;           //  Requests traced
+    s_trace_t *ring;            //  Traces, oldest is overwritten
+    size_t size;                //  Size of ring
+    size_t next;                //  Slot for next trace
+    s_trace_t *current;         //  Trace of request being processed
+} s_tracer_t;
+
+//  Isolated set of devices, subjects of its requests are prefixed by name
+
+typedef struct {
+    char *name;                 //  Name of namespace, NULL for default one
+    zm_devices_t *devices;      //  Devices of namespace
+    bool publish;               //  Publish changes on stream
+} s_namespace_t;
+
+static void
+s_namespace_destroy (s_namespace_t **self_p)
+{
+    assert (self_p);
+    if (*self_p) {
+        s_namespace_t *self = *self_p;
+        zm_devices_destroy (&self->devices);
+        zstr_free (&self->name);
+        free (self);
+        *self_p = NULL;
+    }
+}
+
+//  Transfer of devices from peer at start
+
+typedef struct {
+    char *peer;                 //  Address of peer, NULL = no transfer
+    char *cursor;               //  Cursor of next chunk, NULL = first one
+    int64_t started;            //  Start of transfer, msec
+    int64_t finished;           //  End of transfer, msec, 0 = running
+    int64_t requested;          //  When was the chunk requested, msec
+    size_t retries;             //  Requests of the chunk sent again
+    bool failed;                //  Peer refused or did not answer
+    uint64_t chunks;            //  Chunks received
+    uint64_t devices;           //  Devices received
+    uint64_t inserted;          //  Devices unknown or older here
+    uint64_t bytes;             //  Size of received chunks
+} s_bootstrap_t;
+
+//  How many times is unanswered chunk requested again
+#define ZM_ASSET_BOOTSTRAP_RETRIES 3
+
+//  Tracker of chunk requests, followed by number of chunk
+#define ZM_ASSET_BOOTSTRAP_TRACKER "bootstrap-"
+
 //  Structure of our actor
 
 struct _zm_asset_t {
@@ -55,8 +554,45 @@ struct _zm_asset_t {
     zhash_t *consumers;         //  List of streams to subscribe
     zm_proto_t *msg;            //  Last received message
     zm_devices_t *devices;      //  List of devices to maintain
+    zhashx_t *namespaces;       //  Other namespaces of devices by name
+    zhashx_t *senders;          //  Admission state per mailbox sender
+    s_queue_t reads;            //  LOOKUP requests
+    s_queue_t writes;           //  Other mailbox requests
+    zm_watches_t *watches;      //  Watchers of particular devices
+    uint64_t notified;          //  Notifications sent to watchers
+    int64_t expire_at;          //  Time of next sweep of expired watches
+    s_batch_t batch;            //  Changes waiting for publishing
+    s_conflation_t conflation;  //  Last changes of devices held back
+    s_tracer_t tracer;          //  Sampled traces of requests
+    bool standby;               //  Following primary, changes are refused
+    int64_t heartbeat;          //  HEARTBEAT interval, msec, 0 = disabled
+    int64_t heartbeat_at;       //  Time of next HEARTBEAT, msec
+    int64_t primary_seen;       //  Time primary was heard of, msec
+    int64_t lag;                //  Replication lag by last HEARTBEAT, msec
+    uint64_t applied;           //  Changes applied from primary stream
+    uint64_t takeovers;         //  How many times standby became primary
+    FILE *capture;              //  File mailbox requests are captured to
+    uint64_t captured;          //  Requests captured
+    s_bootstrap_t bootstrap;    //  Transfer of devices from peer
+    uint64_t conflicts;         //  Changes refused for other version
+    uint64_t compactions;       //  Snapshots stored because journal grew
 };
 
+static void
+    zm_asset_flush (zm_asset_t *self);
+static void
+    zm_asset_release (zm_asset_t *self, bool all);
+static void
+    zm_asset_schedule (zm_asset_t *self);
+static bool
+    zm_asset_pending (zm_asset_t *self);
+
+//  How often are watches with expired lease swept, msec
+#define ZM_ASSET_EXPIRE_INTERVAL 1000
+
+//  First bytes of capture file
+#define ZM_ASSET_CAPTURE_MAGIC "ZMCAP1\n"
+
 
 //  --------------------------------------------------------------------------
 //  Create a new zm_asset instance
@@ -71,10 +607,21 @@ zm_asset_new (zsock_t *pipe, void *args)
     self->terminated = false;
     self->poller = zpoller_new (self->pipe, NULL);
     self->devices = zm_devices_new (NULL);
+    self->namespaces = zhashx_new ();
+    zhashx_set_destructor (self->namespaces, (zhashx_destructor_fn *) s_namespace_destroy);
 
     self->config = NULL;
     self->consumers = NULL;
     self->msg = zm_proto_new ();
+    self->senders = zhashx_new ();
+    zhashx_set_destructor (self->senders, (zhashx_destructor_fn *) s_sender_destroy);
+    s_queue_init (&self->reads, 8);
+    s_queue_init (&self->writes, 1);
+    self->watches = zm_watches_new ();
+    self->expire_at = zclock_mono () + ZM_ASSET_EXPIRE_INTERVAL;
+    self->conflation.slots = zhashx_new ();
+    zhashx_set_destructor (self->conflation.slots, (zhashx_destructor_fn *) s_slot_destroy);
+    self->conflation.order = zlistx_new ();
     self->client = mlm_client_new ();
     assert (self->client);
     zpoller_add (self->poller, mlm_client_msgpipe (self->client));
@@ -96,11 +643,33 @@ zm_asset_destroy (zm_asset_t **self_p)
         zconfig_destroy (&self->config);
         zhash_destroy (&self->consumers);
         zm_proto_destroy (&self->msg);
+        zhashx_destroy (&self->senders);
+        zlistx_destroy (&self->reads.requests);
+        zlistx_destroy (&self->writes.requests);
+        zm_watches_destroy (&self->watches);
+        if (self->client) {
+            zm_asset_release (self, true);
+            zm_asset_flush (self);
+        }
+        zmsg_destroy (&self->batch.msg);
+        zlistx_destroy (&self->conflation.order);
+        zhashx_destroy (&self->conflation.slots);
+        free (self->tracer.ring);
+        if (self->capture)
+            fclose (self->capture);
+        zstr_free (&self->bootstrap.peer);
+        zstr_free (&self->bootstrap.cursor);
         mlm_client_destroy (&self->client);
         zpoller_destroy (&self->poller);
 
         zm_devices_store (self->devices);
         zm_devices_destroy (&self->devices);
+        s_namespace_t *ns = (s_namespace_t *) zhashx_first (self->namespaces);
+        while (ns) {
+            zm_devices_store (ns->devices);
+            ns = (s_namespace_t *) zhashx_next (self->namespaces);
+        }
+        zhashx_destroy (&self->namespaces);
 
         //  Free object itself
         free (self);
@@ -146,6 +715,297 @@ zm_asset_cfg_file (zm_asset_t *self) {
     return NULL;
 }
 
+//  Threads parsing persistence file, 1 if value is out of range
+#define ZM_ASSET_MAX_LOAD_WORKERS 64
+
+static size_t
+zm_asset_cfg_load_workers (zm_asset_t *self) {
+    assert (self);
+    if (self->config) {
+        int workers = atoi (zconfig_resolve (self->config, "server/load_workers", "1"));
+        if (workers >= 1 && workers <= ZM_ASSET_MAX_LOAD_WORKERS)
+            return (size_t) workers;
+        zsys_warning ("zm_asset: server/load_workers must be 1..%d, using 1", ZM_ASSET_MAX_LOAD_WORKERS);
+    }
+    return 1;
+}
+
+static size_t
+zm_asset_cfg_shards (zm_asset_t *self) {
+    assert (self);
+    if (self->config) {
+        return (size_t) atoi (zconfig_resolve (self->config, "server/shards", "0"));
+    }
+    return 0;
+}
+
+static size_t
+zm_asset_cfg_store_workers (zm_asset_t *self) {
+    assert (self);
+    if (self->config) {
+        return (size_t) atoi (zconfig_resolve (self->config, "server/store_workers", "4"));
+    }
+    return 4;
+}
+
+static bool
+zm_asset_cfg_fsync (zm_asset_t *self) {
+    assert (self);
+    if (self->config) {
+        return atoi (zconfig_resolve (self->config, "server/fsync", "0")) != 0;
+    }
+    return false;
+}
+
+static size_t
+zm_asset_cfg_budget (zm_asset_t *self, const char *limit) {
+    assert (self);
+    if (self->config) {
+        char path [64];
+        snprintf (path, sizeof (path), "server/budget/%s", limit);
+        return (size_t) strtoull (zconfig_resolve (self->config, path, "0"), NULL, 10);
+    }
+    return 0;
+}
+
+//  Return durability level of journal, 0 if journal is disabled
+static int
+zm_asset_cfg_journal_level (zm_asset_t *self) {
+    assert (self);
+    if (self->config) {
+        const char *level = zconfig_resolve (self->config, "server/journal/level", "none");
+        if (streq (level, "async"))
+            return ZM_JOURNAL_ASYNC;
+        if (streq (level, "fsync"))
+            return ZM_JOURNAL_FSYNC;
+        if (streq (level, "sync"))
+            return ZM_JOURNAL_SYNC;
+        if (!streq (level, "none"))
+            zsys_warning ("zm_asset: unknown journal level %s", level);
+    }
+    return 0;
+}
+
+static size_t
+zm_asset_cfg_journal_ring (zm_asset_t *self) {
+    assert (self);
+    if (self->config) {
+        return (size_t) atoi (zconfig_resolve (self->config, "server/journal/ring", "4096"));
+    }
+    return 4096;
+}
+
+static uint64_t
+zm_asset_cfg_journal_compact (zm_asset_t *self) {
+    assert (self);
+    if (self->config) {
+        return (uint64_t) atoll (zconfig_resolve (self->config, "server/journal/compact", "100000"));
+    }
+    return 100000;
+}
+
+static bool
+zm_asset_cfg_persisted_only (zm_asset_t *self) {
+    assert (self);
+    if (self->config) {
+        return atoi (zconfig_resolve (self->config, "server/budget/persisted_only", "1")) != 0;
+    }
+    return true;
+}
+
+//  Return rate limit of sender, per sender value has a precedence
+static double
+zm_asset_cfg_rate (zm_asset_t *self, const char *sender) {
+    assert (self);
+    if (!self->config)
+        return 0;
+    zconfig_t *cfg = zconfig_locate (self->config, "server/ratelimit/senders");
+    zconfig_t *child = cfg? zconfig_child (cfg): NULL;
+    while (child) {
+        if (streq (zconfig_name (child), sender))
+            return atof (zconfig_value (child));
+        child = zconfig_next (child);
+    }
+    return atof (zconfig_resolve (self->config, "server/ratelimit/rate", "0"));
+}
+
+static double
+zm_asset_cfg_burst (zm_asset_t *self) {
+    assert (self);
+    if (self->config) {
+        return atof (zconfig_resolve (self->config, "server/ratelimit/burst", "100"));
+    }
+    return 100;
+}
+
+static size_t
+zm_asset_cfg_max_pending (zm_asset_t *self) {
+    assert (self);
+    if (self->config) {
+        return (size_t) atoi (zconfig_resolve (self->config, "server/ratelimit/pending", "0"));
+    }
+    return 0;
+}
+
+static int64_t
+zm_asset_cfg_sender_idle (zm_asset_t *self) {
+    assert (self);
+    if (self->config) {
+        return atoll (zconfig_resolve (self->config, "server/ratelimit/idle", "60000"));
+    }
+    return 60000;
+}
+
+static size_t
+zm_asset_cfg_weight (zm_asset_t *self, const char *queue, size_t weight) {
+    assert (self);
+    if (self->config) {
+        char path [64];
+        snprintf (path, sizeof (path), "server/schedule/%s", queue);
+        const char *value = zconfig_resolve (self->config, path, NULL);
+        if (value && atoi (value) > 0)
+            return (size_t) atoi (value);
+    }
+    return weight;
+}
+
+static int64_t
+zm_asset_cfg_lease (zm_asset_t *self) {
+    assert (self);
+    if (self->config) {
+        return atoll (zconfig_resolve (self->config, "server/watch/lease", "60000"));
+    }
+    return 60000;
+}
+
+static size_t
+zm_asset_cfg_batch_size (zm_asset_t *self) {
+    assert (self);
+    if (self->config) {
+        return (size_t) atoi (zconfig_resolve (self->config, "malamute/batch/size", "0"));
+    }
+    return 0;
+}
+
+static int64_t
+zm_asset_cfg_batch_window (zm_asset_t *self) {
+    assert (self);
+    if (self->config) {
+        return atoll (zconfig_resolve (self->config, "malamute/batch/window", "10"));
+    }
+    return 10;
+}
+
+static bool
+zm_asset_cfg_conflate (zm_asset_t *self) {
+    assert (self);
+    if (self->config) {
+        return atoi (zconfig_resolve (self->config, "malamute/conflate", "0")) != 0;
+    }
+    return false;
+}
+
+static size_t
+zm_asset_cfg_digest_depth (zm_asset_t *self) {
+    assert (self);
+    if (self->config) {
+        return (size_t) atoi (zconfig_resolve (self->config, "server/digest/depth", "10"));
+    }
+    return 10;
+}
+
+static const char *
+zm_asset_cfg_aggregate (zm_asset_t *self) {
+    assert (self);
+    if (self->config) {
+        return zconfig_resolve (self->config, "server/aggregate/attributes", NULL);
+    }
+    return NULL;
+}
+
+static const char *
+zm_asset_cfg_bootstrap_peer (zm_asset_t *self) {
+    assert (self);
+    if (self->config) {
+        return zconfig_resolve (self->config, "server/bootstrap/peer", NULL);
+    }
+    return NULL;
+}
+
+static size_t
+zm_asset_cfg_bootstrap_chunk (zm_asset_t *self) {
+    assert (self);
+    if (self->config) {
+        return (size_t) atoi (zconfig_resolve (self->config, "server/bootstrap/chunk", "1000"));
+    }
+    return 1000;
+}
+
+static int64_t
+zm_asset_cfg_bootstrap_timeout (zm_asset_t *self) {
+    assert (self);
+    if (self->config) {
+        return atoll (zconfig_resolve (self->config, "server/bootstrap/timeout", "5000"));
+    }
+    return 5000;
+}
+
+static const char *
+zm_asset_cfg_capture (zm_asset_t *self) {
+    assert (self);
+    if (self->config) {
+        return zconfig_resolve (self->config, "server/capture/file", NULL);
+    }
+    return NULL;
+}
+
+static size_t
+zm_asset_cfg_trace (zm_asset_t *self, const char *key, const char *def) {
+    assert (self);
+    if (self->config) {
+        char path [64];
+        snprintf (path, sizeof (path), "server/trace/%s", key);
+        return (size_t) atoi (zconfig_resolve (self->config, path, def));
+    }
+    return (size_t) atoi (def);
+}
+
+static bool
+zm_asset_cfg_standby (zm_asset_t *self) {
+    assert (self);
+    if (self->config) {
+        return streq (zconfig_resolve (self->config, "server/mode", "primary"), "standby");
+    }
+    return false;
+}
+
+static const char *
+zm_asset_cfg_primary (zm_asset_t *self) {
+    assert (self);
+    if (self->config) {
+        return zconfig_resolve (self->config, "server/standby/primary", NULL);
+    }
+    return NULL;
+}
+
+static int64_t
+zm_asset_cfg_heartbeat (zm_asset_t *self) {
+    assert (self);
+    if (self->config) {
+        return atoll (zconfig_resolve (self->config, "server/heartbeat", "0"));
+    }
+    return 0;
+}
+
+static int64_t
+zm_asset_cfg_takeover (zm_asset_t *self) {
+    assert (self);
+    if (self->config) {
+        return atoll (zconfig_resolve (self->config, "server/standby/timeout", "3000"));
+    }
+    return 3000;
+}
+
 static const char*
 zm_asset_cfg_consumer_first (zm_asset_t *self) {
     assert (self);
@@ -187,7 +1047,9 @@ zm_asset_connect_to_malamute (zm_asset_t *self)
     }
 
     const char *endpoint = zm_asset_cfg_endpoint (self);
-    const char *address = zm_asset_cfg_address (self);
+    //  Standby which took over serves on address of primary
+    const char *address = self->takeovers?
+        zm_asset_cfg_primary (self): zm_asset_cfg_address (self);
 
     if (!endpoint) {
         zsys_error ("malamute/endpoint is missing");
@@ -228,21 +1090,169 @@ zm_asset_connect_to_malamute (zm_asset_t *self)
         }
         pattern = zm_asset_cfg_consumer_next (self);
     }
+    self->primary_seen = zclock_mono ();
     return 0;
 }
 
-//  Start this actor. Return a value greater or equal to zero if initialization
-//  was successful. Otherwise -1.
+//  --------------------------------------------------------------------------
+//  Bootstrap from peer
 
-static int
-zm_asset_start (zm_asset_t *self)
+static bool
+zm_asset_bootstrap_running (zm_asset_t *self)
 {
-    assert (self);
+    return self->bootstrap.peer && !self->bootstrap.finished;
+}
 
-    int r = zm_asset_connect_to_malamute (self);
-    if (r == -1)
+//  Ask peer for next chunk of devices
+
+static void
+zm_asset_bootstrap_request (zm_asset_t *self)
+{
+    assert (self);
+    s_bootstrap_t *bootstrap = &self->bootstrap;
+    zm_proto_t *request = zm_proto_new ();
+    zm_proto_encode_device (request,
+        bootstrap->cursor? bootstrap->cursor: "", UINT64_MAX,
+        (uint32_t) zm_asset_cfg_bootstrap_chunk (self), NULL);
+    zmsg_t *msg = zmsg_new ();
+    zm_proto_send (request, msg);
+    zm_proto_destroy (&request);
+    //  Late answer of repeated request must not be taken for the next chunk
+    char tracker [32];
+    snprintf (tracker, sizeof (tracker), ZM_ASSET_BOOTSTRAP_TRACKER "%" PRIu64, bootstrap->chunks);
+    mlm_client_sendto (self->client, bootstrap->peer, "STALE", tracker, 5000, &msg);
+    bootstrap->requested = zclock_mono ();
+}
+
+static void
+zm_asset_bootstrap_finish (zm_asset_t *self, bool failed)
+{
+    assert (self);
+    s_bootstrap_t *bootstrap = &self->bootstrap;
+    bootstrap->finished = zclock_mono ();
+    bootstrap->failed = failed;
+    zstr_free (&bootstrap->cursor);
+    int64_t duration = bootstrap->finished - bootstrap->started;
+    if (failed)
+        zsys_error ("zm_asset: bootstrap from %s failed after %" PRIu64 " devices",
+            bootstrap->peer, bootstrap->devices);
+    else
+        zsys_info ("zm_asset: bootstrap from %s done, %" PRIu64 " devices in %" PRIi64 " msec",
+            bootstrap->peer, bootstrap->devices, duration);
+}
+
+//  Start transfer of devices from configured peer, only once per actor
+
+static void
+zm_asset_bootstrap_start (zm_asset_t *self)
+{
+    assert (self);
+    const char *peer = zm_asset_cfg_bootstrap_peer (self);
+    if (!peer || !*peer || self->bootstrap.peer)
+        return;
+    self->bootstrap.peer = strdup (peer);
+    self->bootstrap.started = zclock_mono ();
+    zm_asset_bootstrap_request (self);
+}
+
+//  Return true if mailbox message is peer's reply to chunk request, which
+//  can come late, after transfer finished. Other messages from peer are
+//  its requests.
+
+static bool
+zm_asset_bootstrap_reply (zm_asset_t *self)
+{
+    assert (self);
+    const char *tracker = mlm_client_tracker (self->client);
+    return self->bootstrap.peer
+        && streq (mlm_client_sender (self->client), self->bootstrap.peer)
+        && streq (mlm_client_subject (self->client), "STALE")
+        && tracker
+        && strncmp (tracker, ZM_ASSET_BOOTSTRAP_TRACKER, strlen (ZM_ASSET_BOOTSTRAP_TRACKER)) == 0;
+}
+
+//  Insert devices of chunk peer sent and ask for the next one. Replies to
+//  older requests of chunk are dropped.
+
+static void
+zm_asset_bootstrap_chunk (zm_asset_t *self, zmsg_t *reply)
+{
+    assert (self);
+    assert (reply);
+    s_bootstrap_t *bootstrap = &self->bootstrap;
+    const char *chunk = mlm_client_tracker (self->client) + strlen (ZM_ASSET_BOOTSTRAP_TRACKER);
+    if (!zm_asset_bootstrap_running (self) || strtoull (chunk, NULL, 10) != bootstrap->chunks)
+        return;
+    bootstrap->bytes += zmsg_content_size (reply);
+
+    zframe_t *frame = zmsg_pop (reply);
+    zmsg_t *header = zmsg_new ();
+    zmsg_append (header, &frame);
+    int r = zm_proto_recv (self->msg, header);
+    zmsg_destroy (&header);
+    if (r != 0
+    ||  zm_proto_id (self->msg) != ZM_PROTO_DEVICE
+    ||  !streq (zm_proto_device (self->msg), "STALE")) {
+        zm_asset_bootstrap_finish (self, true);
+        return;
+    }
+    const char *cursor = (const char *) zhash_lookup (zm_proto_ext (self->msg), "cursor");
+    zstr_free (&bootstrap->cursor);
+    bootstrap->cursor = cursor? strdup (cursor): NULL;
+    bootstrap->chunks++;
+    bootstrap->retries = 0;
+
+    zm_proto_t *device = zm_proto_new ();
+    zmsg_t *record = zmsg_popmsg (reply);
+    while (record) {
+        if (zm_proto_recv (device, record) == 0) {
+            bootstrap->devices++;
+            zm_proto_t *local = zm_devices_lookup (self->devices, zm_proto_device (device));
+            if (!local || zm_proto_time (local) < zm_proto_time (device)) {
+                zm_devices_replicate (self->devices, device);
+                bootstrap->inserted++;
+            }
+        }
+        zmsg_destroy (&record);
+        record = zmsg_popmsg (reply);
+    }
+    zm_proto_destroy (&device);
+
+    if (bootstrap->cursor)
+        zm_asset_bootstrap_request (self);
+    else
+        zm_asset_bootstrap_finish (self, false);
+}
+
+//  Request chunk again when peer does not answer
+
+static void
+zm_asset_bootstrap_timers (zm_asset_t *self)
+{
+    assert (self);
+    s_bootstrap_t *bootstrap = &self->bootstrap;
+    if (!zm_asset_bootstrap_running (self)
+    ||  zclock_mono () < bootstrap->requested + zm_asset_cfg_bootstrap_timeout (self))
+        return;
+    if (bootstrap->retries++ == ZM_ASSET_BOOTSTRAP_RETRIES)
+        zm_asset_bootstrap_finish (self, true);
+    else
+        zm_asset_bootstrap_request (self);
+}
+
+//  Start this actor. Return a value greater or equal to zero if initialization
+//  was successful. Otherwise -1.
+
+static int
+zm_asset_start (zm_asset_t *self)
+{
+    assert (self);
+
+    int r = zm_asset_connect_to_malamute (self);
+    if (r == -1)
         return r;
 
+    zm_asset_bootstrap_start (self);
     return 0;
 }
 
@@ -255,14 +1265,164 @@ zm_asset_stop (zm_asset_t *self)
 {
     assert (self);
 
+    //  Queued requests can be answered only while client exists
+    while (zm_asset_pending (self))
+        zm_asset_schedule (self);
+    zm_asset_release (self, true);
+    zm_asset_flush (self);
     zpoller_remove (self->poller, mlm_client_msgpipe (self->client));
     mlm_client_destroy (&self->client);
     zm_devices_store (self->devices);
+    s_namespace_t *ns = (s_namespace_t *) zhashx_first (self->namespaces);
+    while (ns) {
+        zm_devices_store (ns->devices);
+        ns = (s_namespace_t *) zhashx_next (self->namespaces);
+    }
 
     return 0;
 }
 
+//  Apply server settings to devices and load them from file, if any
+
+static void
+zm_asset_setup_devices (zm_asset_t *self, zm_devices_t *devices, const char *file)
+{
+    assert (self);
+    assert (devices);
+
+    zm_devices_set_fsync (devices, zm_asset_cfg_fsync (self));
+    zm_devices_set_shards (devices, zm_asset_cfg_shards (self), zm_asset_cfg_store_workers (self));
+    zm_devices_set_budget (devices,
+        zm_asset_cfg_budget (self, "entries"),
+        zm_asset_cfg_budget (self, "memory"),
+        zm_asset_cfg_persisted_only (self));
+    zm_devices_set_digest_depth (devices, zm_asset_cfg_digest_depth (self));
+    zm_devices_set_aggregate (devices, zm_asset_cfg_aggregate (self));
+    if (file) {
+        zm_devices_set_file (devices, file);
+        zm_devices_load (devices, file, zm_asset_cfg_load_workers (self));
+        //  Journal is opened after it was replayed by load
+        if (zm_devices_set_journal (devices,
+                zm_asset_cfg_journal_level (self), zm_asset_cfg_journal_ring (self)) == -1)
+            zsys_error ("zm_asset: can't open journal of %s", file);
+    }
+}
+
+//  Create namespaces from config. All namespaces are stored first, the ones
+//  with persistence file are then loaded again, the others keep their
+//  devices. Namespaces missing in config are dropped.
+
+static void
+zm_asset_setup_namespaces (zm_asset_t *self)
+{
+    assert (self);
+
+    s_namespace_t *old = (s_namespace_t *) zhashx_first (self->namespaces);
+    while (old) {
+        zm_devices_store (old->devices);
+        old = (s_namespace_t *) zhashx_next (self->namespaces);
+    }
+
+    zhashx_t *namespaces = zhashx_new ();
+    zhashx_set_destructor (namespaces, (zhashx_destructor_fn *) s_namespace_destroy);
+    zconfig_t *item = zconfig_child (zconfig_locate (self->config, "namespaces"));
+    while (item) {
+        const char *name = zconfig_name (item);
+        const char *file = zconfig_get (item, "file", NULL);
+        if (strchr (name, '/'))
+            zsys_warning ("zm_asset: namespace %s can't be addressed, it contains slash", name);
+        s_namespace_t *ns = (s_namespace_t *) zmalloc (sizeof (s_namespace_t));
+        assert (ns);
+        ns->name = strdup (name);
+        ns->publish = atoi (zconfig_get (item, "publish", "1")) != 0;
+        old = (s_namespace_t *) zhashx_lookup (self->namespaces, name);
+        if (old && !file) {
+            ns->devices = old->devices;
+            old->devices = NULL;
+        }
+        else
+            ns->devices = zm_devices_new (NULL);
+        zm_asset_setup_devices (self, ns->devices, file);
+        zhashx_update (namespaces, name, ns);
+        item = zconfig_next (item);
+    }
+    zhashx_destroy (&self->namespaces);
+    self->namespaces = namespaces;
+}
+
+//  Start capturing mailbox requests to end of file, NULL or empty file
+//  stops capturing
+
+static int
+zm_asset_capture_open (zm_asset_t *self, const char *file)
+{
+    assert (self);
+    if (self->capture) {
+        fclose (self->capture);
+        self->capture = NULL;
+    }
+    if (!file || !*file)
+        return 0;
+    self->capture = fopen (file, "ab");
+    if (!self->capture) {
+        zsys_error ("zm_asset: can't open capture file %s: %s", file, strerror (errno));
+        return -1;
+    }
+    fseek (self->capture, 0, SEEK_END);
+    if (ftell (self->capture) == 0)
+        fwrite (ZM_ASSET_CAPTURE_MAGIC, 1, strlen (ZM_ASSET_CAPTURE_MAGIC), self->capture);
+    return 0;
+}
+
+//  Write value as big endian number of size bytes, returns position after it
+
+static byte *
+s_put_number (byte *needle, uint64_t value, size_t size)
+{
+    while (size--)
+        *needle++ = (byte) (value >> (8 * size));
+    return needle;
+}
+
+//  Write string as 1 byte length followed by at most 255 bytes of it
+
+static byte *
+s_put_string (byte *needle, const char *string)
+{
+    size_t size = strlen (string);
+    if (size > 255)
+        size = 255;
+    *needle++ = (byte) size;
+    memcpy (needle, string, size);
+    return needle + size;
+}
+
+//  Append mailbox request just received to capture file
+
+static void
+zm_asset_capture (zm_asset_t *self, zmsg_t *request)
+{
+    assert (self);
+    assert (request);
+
+    byte header [8 + 256 + 256 + 4];
+    byte *needle = s_put_number (header, (uint64_t) s_mono_usecs (), 8);
+    needle = s_put_string (needle, mlm_client_sender (self->client));
+    needle = s_put_string (needle, mlm_client_subject (self->client));
+    zframe_t *content = zmsg_encode (request);
+    needle = s_put_number (needle, zframe_size (content), 4);
+    if (fwrite (header, 1, needle - header, self->capture) != (size_t) (needle - header)
+    ||  fwrite (zframe_data (content), 1, zframe_size (content), self->capture) != zframe_size (content)) {
+        zsys_error ("zm_asset: can't write capture file, capturing stopped");
+        zm_asset_capture_open (self, NULL);
+    }
+    else
+        self->captured++;
+    zframe_destroy (&content);
+}
+
 //  Config message, second argument is string representation of config file
+
 static int
 zm_asset_config (zm_asset_t *self, zmsg_t *request)
 {
@@ -276,13 +1436,41 @@ zm_asset_config (zm_asset_t *self, zmsg_t *request)
         if (foo) {
             zconfig_destroy (&self->config);
             self->config = foo;
+            zhashx_purge (self->senders);
+            self->reads.weight = zm_asset_cfg_weight (self, "reads", 8);
+            self->writes.weight = zm_asset_cfg_weight (self, "writes", 1);
+            if (self->client)
+                zm_asset_flush (self);
+            self->batch.limit = zm_asset_cfg_batch_size (self);
+            self->batch.window = zm_asset_cfg_batch_window (self) * 1000;
+            self->conflation.enabled = zm_asset_cfg_conflate (self);
+            self->tracer.sample = zm_asset_cfg_trace (self, "sample", "0");
+            size_t trace_size = zm_asset_cfg_trace (self, "size", "1024");
+            if (self->tracer.sample && trace_size && trace_size != self->tracer.size) {
+                free (self->tracer.ring);
+                self->tracer.ring = (s_trace_t *) zmalloc (trace_size * sizeof (s_trace_t));
+                assert (self->tracer.ring);
+                self->tracer.size = trace_size;
+                self->tracer.next = 0;
+            }
+            if (!self->tracer.ring)
+                self->tracer.sample = 0;
+            zm_asset_capture_open (self, zm_asset_cfg_capture (self));
+            self->standby = zm_asset_cfg_standby (self);
+            self->heartbeat = zm_asset_cfg_heartbeat (self);
+            self->heartbeat_at = zclock_mono () + self->heartbeat;
+            self->primary_seen = zclock_mono ();
             if (zm_asset_cfg_file (self)) {
                 if (!zm_devices_file (self->devices))
                     zm_devices_set_file (self->devices, zm_asset_cfg_file (self));
                 zm_devices_store (self->devices);
                 zm_devices_destroy (&self->devices);
-                self->devices = zm_devices_new (zm_asset_cfg_file (self));
+                self->devices = zm_devices_new (NULL);
+                zm_asset_setup_devices (self, self->devices, zm_asset_cfg_file (self));
             }
+            else
+                zm_asset_setup_devices (self, self->devices, NULL);
+            zm_asset_setup_namespaces (self);
         }
         else {
             zsys_warning ("zm_asset: can't load config file from string");
@@ -295,132 +1483,1166 @@ zm_asset_config (zm_asset_t *self, zmsg_t *request)
 }
 
 
-//  Here we handle incoming message from the node
-
-static void
-zm_asset_recv_api (zm_asset_t *self)
+//  Return admission state of sender, create it if it does not exist yet
+
+static s_sender_t *
+zm_asset_sender (zm_asset_t *self, const char *sender)
+{
+    assert (self);
+    assert (sender);
+
+    s_sender_t *state = (s_sender_t *) zhashx_lookup (self->senders, sender);
+    if (!state) {
+        state = (s_sender_t *) zmalloc (sizeof (s_sender_t));
+        assert (state);
+        state->rate = zm_asset_cfg_rate (self, sender);
+        state->burst = zm_asset_cfg_burst (self);
+        state->max_pending = zm_asset_cfg_max_pending (self);
+        state->tokens = state->burst;
+        state->refilled = zclock_mono ();
+        zhashx_insert (self->senders, sender, state);
+    }
+    state->seen = zclock_mono ();
+    return state;
+}
+
+//  Forget senders idle for server/ratelimit/idle msec, with nothing queued
+//  and full token bucket, their state is the same as of a new sender
+
+static void
+zm_asset_expire_senders (zm_asset_t *self, int64_t now)
+{
+    assert (self);
+    int64_t idle = zm_asset_cfg_sender_idle (self);
+    zlistx_t *expired = zlistx_new ();
+    s_sender_t *state = (s_sender_t *) zhashx_first (self->senders);
+    while (state) {
+        double tokens = state->tokens + (now - state->refilled) * state->rate / 1000.0;
+        if (state->pending == 0
+        &&  now - state->seen >= idle
+        &&  (state->rate <= 0 || tokens >= state->burst))
+            zlistx_add_end (expired, (void *) zhashx_cursor (self->senders));
+        state = (s_sender_t *) zhashx_next (self->senders);
+    }
+    const char *sender = (const char *) zlistx_first (expired);
+    while (sender) {
+        zhashx_delete (self->senders, sender);
+        sender = (const char *) zlistx_next (expired);
+    }
+    zlistx_destroy (&expired);
+}
+
+//  Admission control, return true if request from sender can be processed
+
+static bool
+zm_asset_admit (zm_asset_t *self, s_sender_t *state)
+{
+    assert (self);
+    assert (state);
+
+    if (state->max_pending && state->pending >= state->max_pending) {
+        state->throttled++;
+        return false;
+    }
+
+    if (state->rate > 0) {
+        int64_t now = zclock_mono ();
+        state->tokens += (now - state->refilled) * state->rate / 1000.0;
+        if (state->tokens > state->burst)
+            state->tokens = state->burst;
+        state->refilled = now;
+        if (state->tokens < 1) {
+            state->throttled++;
+            return false;
+        }
+        state->tokens -= 1;
+    }
+    state->accepted++;
+    return true;
+}
+
+//  Statistics message, reply is string representation of stats in ZPL
+static void
+zm_asset_stats (zm_asset_t *self)
+{
+    assert (self);
+
+    zconfig_t *root = zconfig_new ("root", NULL);
+    zconfig_t *senders = zconfig_new ("senders", root);
+    s_sender_t *state = (s_sender_t *) zhashx_first (self->senders);
+    while (state) {
+        zconfig_t *sender = zconfig_new ((const char *) zhashx_cursor (self->senders), senders);
+        zconfig_putf (sender, "accepted", "%" PRIu64, state->accepted);
+        zconfig_putf (sender, "throttled", "%" PRIu64, state->throttled);
+        state = (s_sender_t *) zhashx_next (self->senders);
+    }
+
+    zm_devices_stats (self->devices, zconfig_new ("devices", root));
+    if (zhashx_size (self->namespaces)) {
+        zconfig_t *namespaces = zconfig_new ("namespaces", root);
+        s_namespace_t *ns = (s_namespace_t *) zhashx_first (self->namespaces);
+        while (ns) {
+            zm_devices_stats (ns->devices, zconfig_new (ns->name, namespaces));
+            ns = (s_namespace_t *) zhashx_next (self->namespaces);
+        }
+    }
+
+    zconfig_t *watches = zconfig_new ("watches", root);
+    zconfig_putf (watches, "active", "%zu", zm_watches_size (self->watches));
+    zconfig_putf (watches, "notified", "%" PRIu64, self->notified);
+
+    s_batch_t *batch = &self->batch;
+    zconfig_t *stats_batch = zconfig_new ("batch", root);
+    zconfig_putf (stats_batch, "batches", "%" PRIu64, batch->batches);
+    zconfig_putf (stats_batch, "published", "%" PRIu64, batch->published);
+    zconfig_putf (stats_batch, "latency_avg", "%" PRIi64,
+        batch->published? batch->latency_sum / (int64_t) batch->published: 0);
+    zconfig_putf (stats_batch, "latency_max", "%" PRIi64, batch->latency_max);
+    zconfig_t *sizes = zconfig_new ("sizes", stats_batch);
+    size_t bucket;
+    for (bucket = 0; bucket != ZM_ASSET_BATCH_BUCKETS; bucket++) {
+        if (batch->sizes [bucket]) {
+            char name [32];
+            snprintf (name, sizeof (name), "%lu", 2ul << bucket);
+            zconfig_putf (sizes, name, "%" PRIu64, batch->sizes [bucket]);
+        }
+    }
+
+    s_conflation_t *conflation = &self->conflation;
+    zconfig_t *stats_conflation = zconfig_new ("conflation", root);
+    zconfig_putf (stats_conflation, "pending", "%zu", zlistx_size (conflation->order));
+    zconfig_putf (stats_conflation, "max_pending", "%zu", conflation->max_pending);
+    zconfig_putf (stats_conflation, "held", "%" PRIu64, conflation->held);
+    zconfig_putf (stats_conflation, "conflated", "%" PRIu64, conflation->conflated);
+    zconfig_putf (stats_conflation, "published", "%" PRIu64, conflation->published);
+
+    if (self->tracer.sample)
+        zconfig_putf (zconfig_new ("trace", root), "sampled", "%" PRIu64, self->tracer.sampled);
+    if (self->captured)
+        zconfig_putf (zconfig_new ("capture", root), "requests", "%" PRIu64, self->captured);
+    zconfig_putf (root, "conflicts", "%" PRIu64, self->conflicts);
+    zconfig_putf (root, "compactions", "%" PRIu64, self->compactions);
+    s_bootstrap_t *bootstrap = &self->bootstrap;
+    if (bootstrap->peer) {
+        zconfig_t *stats_bootstrap = zconfig_new ("bootstrap", root);
+        int64_t duration = (bootstrap->finished? bootstrap->finished: zclock_mono ()) - bootstrap->started;
+        zconfig_putf (stats_bootstrap, "peer", "%s", bootstrap->peer);
+        zconfig_putf (stats_bootstrap, "state", "%s",
+            !bootstrap->finished? "running": bootstrap->failed? "failed": "done");
+        zconfig_putf (stats_bootstrap, "chunks", "%" PRIu64, bootstrap->chunks);
+        zconfig_putf (stats_bootstrap, "devices", "%" PRIu64, bootstrap->devices);
+        zconfig_putf (stats_bootstrap, "inserted", "%" PRIu64, bootstrap->inserted);
+        zconfig_putf (stats_bootstrap, "bytes", "%" PRIu64, bootstrap->bytes);
+        zconfig_putf (stats_bootstrap, "duration", "%" PRIi64, duration);
+        zconfig_putf (stats_bootstrap, "rate", "%.0f",
+            duration? bootstrap->devices * 1000.0 / duration: 0.0);
+    }
+
+    zconfig_t *replication = zconfig_new ("replication", root);
+    zconfig_putf (replication, "mode", "%s", self->standby? "standby": "primary");
+    zconfig_putf (replication, "applied", "%" PRIu64, self->applied);
+    zconfig_putf (replication, "takeovers", "%" PRIu64, self->takeovers);
+    if (self->standby) {
+        zconfig_putf (replication, "lag", "%" PRIi64, self->lag);
+        zconfig_putf (replication, "silence", "%" PRIi64, zclock_mono () - self->primary_seen);
+    }
+
+    zconfig_t *queues = zconfig_new ("queues", root);
+    s_queue_stats (&self->reads, zconfig_new ("reads", queues));
+    s_queue_stats (&self->writes, zconfig_new ("writes", queues));
+
+    char *stats = zconfig_str_save (root);
+    zstr_send (self->pipe, stats);
+    zstr_free (&stats);
+    zconfig_destroy (&root);
+}
+
+//  Return traced requests, oldest first, and save them to file if it is
+//  given
+
+static void
+zm_asset_trace (zm_asset_t *self, zmsg_t *request)
+{
+    assert (self);
+    assert (request);
+
+    zconfig_t *root = zconfig_new ("root", NULL);
+    zconfig_t *traces = zconfig_new ("traces", root);
+    s_tracer_t *tracer = &self->tracer;
+    size_t i;
+    for (i = 0; i != tracer->size; i++) {
+        s_trace_t *trace = &tracer->ring [(tracer->next + i) % tracer->size];
+        if (!trace->arrived)
+            continue;
+        char name [32];
+        snprintf (name, sizeof (name), "%zu", i);
+        zconfig_t *item = zconfig_new (name, traces);
+        zconfig_putf (item, "sender", "%s", trace->sender);
+        zconfig_putf (item, "subject", "%s", trace->subject);
+        zconfig_putf (item, "arrived", "%" PRIi64, trace->arrived);
+        size_t stage;
+        for (stage = 0; stage != ZM_ASSET_TRACE_STAGES; stage++)
+            if (trace->stage [stage])
+                zconfig_putf (item, s_trace_stages [stage], "%" PRIu32, trace->stage [stage]);
+    }
+
+    char *file = zmsg_popstr (request);
+    if (file && zconfig_save (root, file) == -1)
+        zsys_error ("zm_asset: can't save traces to %s", file);
+    zstr_free (&file);
+    char *str_traces = zconfig_str_save (root);
+    zstr_send (self->pipe, str_traces);
+    zstr_free (&str_traces);
+    zconfig_destroy (&root);
+}
+
+//  Start trace of request in next slot of ring
+
+static void
+zm_asset_trace_start (zm_asset_t *self, s_request_t *request)
+{
+    assert (self);
+    assert (request);
+    s_tracer_t *tracer = &self->tracer;
+    s_trace_t *trace = &tracer->ring [tracer->next];
+    tracer->next = (tracer->next + 1) % tracer->size;
+    tracer->sampled++;
+    memset (trace, 0, sizeof (s_trace_t));
+    trace->arrived = request->queued;
+    strncpy (trace->subject, request->subject, sizeof (trace->subject) - 1);
+    strncpy (trace->sender, request->sender, sizeof (trace->sender) - 1);
+    tracer->current = trace;
+}
+
+//  Record end of stage, if request being processed is traced
+
+static void
+zm_asset_trace_mark (zm_asset_t *self, s_trace_stage_t stage)
+{
+    s_trace_t *trace = self->tracer.current;
+    if (trace)
+        trace->stage [stage] = (uint32_t) (s_mono_usecs () - trace->arrived);
+}
+
+//  Here we handle incoming message from the node
+
+static void
+zm_asset_recv_api (zm_asset_t *self)
+{
+    //  Get the whole message of the pipe in one go
+    zmsg_t *request = zmsg_recv (self->pipe);
+    if (!request)
+       return;        //  Interrupted
+
+    char *command = zmsg_popstr (request);
+    if (streq (command, "START"))
+        zm_asset_start (self);
+    else
+    if (streq (command, "STOP"))
+        zm_asset_stop (self);
+    else
+    if (streq (command, "VERBOSE"))
+        self->verbose = true;
+    else
+    if (streq (command, "$TERM"))
+        //  The $TERM command is send by zactor_destroy() method
+        self->terminated = true;
+    else
+    if (streq (command, "CONFIG"))
+        zm_asset_config (self, request);
+    else
+    if (streq (command, "STATS"))
+        zm_asset_stats (self);
+    else
+    if (streq (command, "TRACE"))
+        zm_asset_trace (self, request);
+    else
+    if (streq (command, "CAPTURE")) {
+        char *file = zmsg_popstr (request);
+        zsock_signal (self->pipe, zm_asset_capture_open (self, file) == 0? 0: 1);
+        zstr_free (&file);
+    }
+    else
+    if (streq (command, "PAUSE")) {
+        self->conflation.paused = true;
+        zsock_signal (self->pipe, 0);
+    }
+    else
+    if (streq (command, "RESUME")) {
+        self->conflation.paused = false;
+        if (self->client)
+            zm_asset_release (self, false);
+        zsock_signal (self->pipe, 0);
+    }
+    else {
+        zsys_error ("invalid command '%s'", command);
+        assert (false);
+    }
+    zstr_free (&command);
+    zmsg_destroy (&request);
+}
+
+//  Publish waiting batch of changes. Batch is published with subject BATCH,
+//  each record consists of two frames: subject (INSERT or DELETE) and
+//  zm_proto message encoded into single frame.
+
+static void
+zm_asset_flush (zm_asset_t *self)
+{
+    assert (self);
+    s_batch_t *batch = &self->batch;
+    if (!batch->records)
+        return;
+
+    int64_t now = s_mono_usecs ();
+    batch->latency_sum += now * (int64_t) batch->records - batch->added_sum;
+    if (now - batch->opened > batch->latency_max)
+        batch->latency_max = now - batch->opened;
+    size_t bucket = 0;
+    size_t records = batch->records;
+    while (records >= 2 && bucket < ZM_ASSET_BATCH_BUCKETS - 1) {
+        records >>= 1;
+        bucket++;
+    }
+    batch->sizes [bucket]++;
+    batch->batches++;
+    batch->published += batch->records;
+    batch->records = 0;
+    batch->added_sum = 0;
+    mlm_client_send (self->client, "BATCH", &batch->msg);
+    zmsg_destroy (&batch->msg);
+}
+
+//  Publish encoded change right away or add it to batch
+
+static int
+zm_asset_send_change (zm_asset_t *self, const char *subject, zmsg_t **msg_p)
+{
+    assert (self);
+    assert (subject);
+    assert (msg_p);
+
+    zmsg_t *msg = *msg_p;
+    *msg_p = NULL;
+    s_batch_t *batch = &self->batch;
+    if (!batch->limit)
+        return mlm_client_send (self->client, subject, &msg);
+
+    int64_t now = s_mono_usecs ();
+    if (!batch->msg) {
+        batch->msg = zmsg_new ();
+        batch->opened = now;
+    }
+    zmsg_addstr (batch->msg, subject);
+    zmsg_addmsg (batch->msg, &msg);
+    batch->records++;
+    batch->added_sum += now;
+    if (batch->records >= batch->limit)
+        zm_asset_flush (self);
+    return 0;
+}
+
+//  Return true if malamute client should not get more changes now
+
+static bool
+zm_asset_backpressure (zm_asset_t *self)
+{
+    assert (self);
+    s_conflation_t *conflation = &self->conflation;
+    if (conflation->paused)
+        return true;
+    //  mlm_client_send passes change to actor of client, which sends it to
+    //  malamute; pipe to actor fills up when it can't keep pace
+    return conflation->enabled
+        && !(zsock_events (mlm_client_actor (self->client)) & ZMQ_POLLOUT);
+}
+
+//  Keep change in slot of its device, replacing older held change. DELETE
+//  replaces both INSERT and DELETE, INSERT only INSERT, so consumers learn
+//  device was gone.
+
+static int
+zm_asset_hold (zm_asset_t *self, const char *subject, const char *name, zmsg_t **msg_p)
+{
+    assert (self);
+    assert (subject);
+    assert (name);
+    assert (msg_p);
+
+    s_conflation_t *conflation = &self->conflation;
+    const char *command = strrchr (subject, '/');
+    int prefix_size = command? (int) (command - subject) + 1: 0;
+    command = subject + prefix_size;
+
+    char *key = zsys_sprintf ("%.*s%s", prefix_size, subject, name);
+    s_slot_t *slot = (s_slot_t *) zhashx_lookup (conflation->slots, key);
+    if (slot)
+        zstr_free (&key);
+    else {
+        slot = (s_slot_t *) zmalloc (sizeof (s_slot_t));
+        assert (slot);
+        slot->key = key;
+        slot->prefix = zsys_sprintf ("%.*s", prefix_size, subject);
+        zhashx_insert (conflation->slots, slot->key, slot);
+        zlistx_add_end (conflation->order, slot);
+        if (zlistx_size (conflation->order) > conflation->max_pending)
+            conflation->max_pending = zlistx_size (conflation->order);
+    }
+    conflation->held++;
+    if (slot->inserted) {
+        zmsg_destroy (&slot->inserted);
+        conflation->conflated++;
+    }
+    if (streq (command, "DELETE")) {
+        if (slot->deleted) {
+            zmsg_destroy (&slot->deleted);
+            conflation->conflated++;
+        }
+        slot->deleted = *msg_p;
+    }
+    else
+        slot->inserted = *msg_p;
+    *msg_p = NULL;
+    return 0;
+}
+
+//  Publish held changes while malamute client takes them, or all of them
+
+static void
+zm_asset_release (zm_asset_t *self, bool all)
+{
+    assert (self);
+    s_conflation_t *conflation = &self->conflation;
+    while (zlistx_size (conflation->order)) {
+        if (!all && zm_asset_backpressure (self))
+            break;
+        s_slot_t *slot = (s_slot_t *) zlistx_detach (conflation->order, NULL);
+        if (slot->deleted) {
+            char *subject = zsys_sprintf ("%sDELETE", slot->prefix);
+            zm_asset_send_change (self, subject, &slot->deleted);
+            zstr_free (&subject);
+            conflation->published++;
+        }
+        if (slot->inserted) {
+            char *subject = zsys_sprintf ("%sINSERT", slot->prefix);
+            zm_asset_send_change (self, subject, &slot->inserted);
+            zstr_free (&subject);
+            conflation->published++;
+        }
+        zhashx_delete (conflation->slots, slot->key);
+    }
+}
+
+//  Publish change of device, unless malamute client pushes back or older
+//  changes are held; then it is held too, so changes of device keep order
+
+static int
+zm_asset_publish (zm_asset_t *self, zm_proto_t *device, const char *subject)
+{
+    assert (self);
+    assert (device);
+    assert (subject);
+
+    zmsg_t *msg = zmsg_new ();
+    zm_proto_send (device, msg);
+    if (zlistx_size (self->conflation.order) || zm_asset_backpressure (self))
+        return zm_asset_hold (self, subject, zm_proto_device (device), &msg);
+    return zm_asset_send_change (self, subject, &msg);
+}
+
+//  Send change of device to everyone who watches it. Malamute accepts mail
+//  for watchers which are gone, so they are forgotten only when lease of
+//  their watch expires.
+
+static void
+zm_asset_notify (zm_asset_t *self, s_namespace_t *ns, zm_proto_t *device, const char *subject)
+{
+    assert (self);
+    assert (ns);
+    assert (device);
+    assert (subject);
+
+    //  Watches of namespace are registered with prefixed names
+    char *name = ns->name?
+        zsys_sprintf ("%s/%s", ns->name, zm_proto_device (device)): NULL;
+    zlistx_t *watchers = zm_watches_match (self->watches, name? name: zm_proto_device (device));
+    zstr_free (&name);
+    if (!watchers)
+        return;
+
+    const char *watcher = (const char *) zlistx_first (watchers);
+    while (watcher) {
+        zmsg_t *msg = zmsg_new ();
+        zm_proto_send (device, msg);
+        if (mlm_client_sendto (self->client, watcher, subject, NULL, 5000, &msg) == -1)
+            zmsg_destroy (&msg);
+        else
+            self->notified++;
+        watcher = (const char *) zlistx_next (watchers);
+    }
+    zlistx_destroy (&watchers);
+}
+
+//  Return true if mailbox subject does not change devices
+
+static bool
+zm_asset_is_read (const char *subject)
+{
+    const char *command = strchr (subject, '/');
+    if (command)
+        subject = command + 1;
+    return streq (subject, "LOOKUP")
+        || streq (subject, "DIGEST")
+        || streq (subject, "BUCKET")
+        || streq (subject, "STALE")
+        || streq (subject, "COUNT");
+}
+
+//  Encode nodes of requested level of hash tree to msg
+
+static void
+zm_asset_digest (zm_asset_t *self, zm_devices_t *devices, zmsg_t *msg)
+{
+    assert (self);
+    assert (devices);
+    assert (msg);
+
+    zm_digest_t *digest = zm_devices_digest (devices);
+    char *end;
+    unsigned long level = strtoul (zm_proto_device (self->msg), &end, 10);
+    if (*end || level > zm_digest_depth (digest)) {
+        zm_proto_encode_error (self->msg, 400, "Invalid level of digest");
+        zm_proto_send (self->msg, msg);
+        return;
+    }
+    zhash_t *ext = zhash_new ();
+    zhash_autofree (ext);
+    char key [32], value [32];
+    snprintf (value, sizeof (value), "%zu", zm_digest_depth (digest));
+    zhash_insert (ext, "depth", value);
+    snprintf (value, sizeof (value), "%lu", level);
+    zhash_insert (ext, "level", value);
+    size_t index;
+    for (index = 0; index != (size_t) 1 << level; index++) {
+        uint64_t hash = zm_digest_node (digest, level, index);
+        if (hash) {
+            snprintf (key, sizeof (key), "%zu", index);
+            snprintf (value, sizeof (value), "%016" PRIx64, hash);
+            zhash_insert (ext, key, value);
+        }
+    }
+    zm_proto_encode_device (self->msg, "DIGEST", 0, 0, ext);
+    zm_proto_send (self->msg, msg);
+    zhash_destroy (&ext);
+}
+
+//  Encode devices of requested bucket of hash tree to msg
+
+static void
+zm_asset_bucket (zm_asset_t *self, zm_devices_t *devices, zmsg_t *msg)
+{
+    assert (self);
+    assert (devices);
+    assert (msg);
+
+    zm_digest_t *digest = zm_devices_digest (devices);
+    char *end;
+    unsigned long bucket = strtoul (zm_proto_device (self->msg), &end, 10);
+    if (*end || bucket >= (size_t) 1 << zm_digest_depth (digest)) {
+        zm_proto_encode_error (self->msg, 400, "Invalid bucket");
+        zm_proto_send (self->msg, msg);
+        return;
+    }
+    zlistx_t *list = zm_devices_bucket (devices, bucket);
+    zhash_t *ext = zhash_new ();
+    zhash_autofree (ext);
+    char value [32];
+    snprintf (value, sizeof (value), "%lu", bucket);
+    zhash_insert (ext, "bucket", value);
+    snprintf (value, sizeof (value), "%zu", zlistx_size (list));
+    zhash_insert (ext, "count", value);
+    zm_proto_encode_device (self->msg, "BUCKET", 0, 0, ext);
+    zm_proto_send (self->msg, msg);
+    zhash_destroy (&ext);
+
+    zm_proto_t *device = (zm_proto_t *) zlistx_first (list);
+    while (device) {
+        zmsg_t *record = zmsg_new ();
+        zm_proto_send (device, record);
+        zmsg_addmsg (msg, &record);
+        device = (zm_proto_t *) zlistx_next (list);
+    }
+    zlistx_destroy (&list);
+}
+
+//  Encode page of devices not updated since requested time to msg
+
+#define ZM_ASSET_STALE_PAGE 1000
+
+static void
+zm_asset_stale (zm_asset_t *self, zm_devices_t *devices, zmsg_t *msg)
+{
+    assert (self);
+    assert (devices);
+    assert (msg);
+
+    //  Cursor is time and name of last device of previous page
+    const char *cursor = zm_proto_device (self->msg);
+    const char *after = NULL;
+    uint64_t after_time = 0;
+    if (*cursor) {
+        char *end;
+        after_time = strtoull (cursor, &end, 10);
+        if (end == cursor || *end != '/') {
+            zm_proto_encode_error (self->msg, 400, "Invalid cursor");
+            zm_proto_send (self->msg, msg);
+            return;
+        }
+        after = end + 1;
+    }
+    size_t limit = zm_proto_ttl (self->msg);
+    if (!limit || limit > ZM_ASSET_STALE_PAGE)
+        limit = ZM_ASSET_STALE_PAGE;
+    zlistx_t *list = zm_devices_stale (devices, zm_proto_time (self->msg), after_time, after, limit);
+
+    zhash_t *ext = zhash_new ();
+    zhash_autofree (ext);
+    char value [32];
+    snprintf (value, sizeof (value), "%zu", zlistx_size (list));
+    zhash_insert (ext, "count", value);
+    zm_proto_t *last = (zm_proto_t *) zlistx_last (list);
+    if (zlistx_size (list) == limit) {
+        char *next = zsys_sprintf ("%" PRIu64 "/%s", zm_proto_time (last), zm_proto_device (last));
+        zhash_insert (ext, "cursor", next);
+        zstr_free (&next);
+    }
+    zm_proto_encode_device (self->msg, "STALE", 0, 0, ext);
+    zm_proto_send (self->msg, msg);
+    zhash_destroy (&ext);
+
+    zm_proto_t *device = (zm_proto_t *) zlistx_first (list);
+    while (device) {
+        zmsg_t *record = zmsg_new ();
+        zm_proto_send (device, record);
+        zmsg_addmsg (msg, &record);
+        device = (zm_proto_t *) zlistx_next (list);
+    }
+    zlistx_destroy (&list);
+}
+
+//  Encode counts of devices by requested attribute to msg
+
+static void
+zm_asset_count (zm_asset_t *self, zm_devices_t *devices, zmsg_t *msg)
+{
+    assert (self);
+    assert (devices);
+    assert (msg);
+
+    zm_aggregate_t *aggregate = zm_devices_aggregate (devices);
+    zhash_t *groups = aggregate?
+        zm_aggregate_groups (aggregate, zm_proto_device (self->msg)): NULL;
+    if (groups)
+        zm_proto_encode_device (self->msg, "COUNT", 0, 0, groups);
+    else
+        zm_proto_encode_error (self->msg, 404, "Attribute is not counted");
+    zm_proto_send (self->msg, msg);
+    zhash_destroy (&groups);
+}
+
+static int
+zm_asset_reply (zm_asset_t *self, s_request_t *request, zmsg_t **msg_p)
+{
+    assert (self);
+    assert (request);
+
+    return mlm_client_sendto (
+        self->client,
+        request->sender,
+        request->subject,
+        request->tracker,
+        5000,
+        msg_p);
+}
+
+//  Return namespace subject is addressed to, subject without the prefix is
+//  stored to command_p. Default namespace is returned in root. Returns NULL
+//  if there is no such namespace.
+
+static s_namespace_t *
+zm_asset_resolve (zm_asset_t *self, const char *subject, s_namespace_t *root, const char **command_p)
+{
+    assert (self);
+    assert (subject);
+    assert (root);
+    assert (command_p);
+
+    root->name = NULL;
+    root->devices = self->devices;
+    root->publish = true;
+    const char *slash = strchr (subject, '/');
+    if (!slash) {
+        *command_p = subject;
+        return root;
+    }
+    *command_p = slash + 1;
+    char *name = strndup (subject, slash - subject);
+    s_namespace_t *ns = (s_namespace_t *) zhashx_lookup (self->namespaces, name);
+    zstr_free (&name);
+    return ns;
+}
+
+//  Return true if device is at version change expects. Otherwise encode
+//  conflict with current version to msg. Changes without version always
+//  pass.
+
+static bool
+zm_asset_expected (zm_asset_t *self, zm_devices_t *devices, zmsg_t *msg)
+{
+    assert (self);
+    assert (devices);
+    assert (msg);
+
+    zhash_t *ext = zm_proto_ext (self->msg);
+    const char *expected = ext? (const char *) zhash_lookup (ext, ZM_DEVICES_VERSION): NULL;
+    if (!expected)
+        return true;
+    uint64_t version = zm_devices_version (devices, zm_proto_device (self->msg));
+    if (strtoull (expected, NULL, 10) == version)
+        return true;
+
+    self->conflicts++;
+    char current [32];
+    snprintf (current, sizeof (current), "%" PRIu64, version);
+    zm_proto_encode_error (self->msg, 409, current);
+    zm_proto_send (self->msg, msg);
+    return false;
+}
+
+static void
+zm_asset_recv_mlm_mailbox (zm_asset_t *self, s_request_t *request)
+{
+    assert (self);
+    assert (request);
+
+    const char *subject;
+    s_namespace_t root;
+    s_namespace_t *ns = zm_asset_resolve (self, request->subject, &root, &subject);
+    zmsg_t *msg = zmsg_new ();
+    if (!ns) {
+        zm_proto_encode_error (self->msg, 404, "Namespace does not exists");
+        zm_proto_send (self->msg, msg);
+    }
+    else
+    if (self->standby && !zm_asset_is_read (subject)) {
+        zm_proto_encode_error (self->msg, 503, "Standby does not accept changes");
+        zm_proto_send (self->msg, msg);
+    }
+    else
+    if ((streq (subject, "INSERT") || streq (subject, "DELETE"))
+    &&  !zm_asset_expected (self, ns->devices, msg)) {
+        //  Device is at other version, conflict is in msg already
+    }
+    else
+    if (streq (subject, "INSERT")) {
+        //  Stored device is published, it has the new version
+        zm_proto_t *device = zm_devices_insert (ns->devices, self->msg);
+        zm_asset_trace_mark (self, ZM_ASSET_TRACE_STORED);
+        if (ns->publish)
+            zm_asset_publish (self, device, request->subject);
+        zm_asset_trace_mark (self, ZM_ASSET_TRACE_PUBLISHED);
+        zm_asset_notify (self, ns, device, subject);
+        zm_asset_trace_mark (self, ZM_ASSET_TRACE_NOTIFIED);
+        zm_proto_encode_ok (self->msg);
+        zm_proto_send (self->msg, msg);
+    }
+    else
+    if (streq (subject, "DELETE")) {
+        const char *device = zm_proto_device (self->msg);
+        zm_devices_delete (ns->devices, device);
+        zm_asset_trace_mark (self, ZM_ASSET_TRACE_STORED);
+        if (ns->publish)
+            zm_asset_publish (self, self->msg, request->subject);
+        zm_asset_trace_mark (self, ZM_ASSET_TRACE_PUBLISHED);
+        zm_asset_notify (self, ns, self->msg, subject);
+        zm_asset_trace_mark (self, ZM_ASSET_TRACE_NOTIFIED);
+        zm_proto_encode_ok (self->msg);
+        zm_proto_send (self->msg, msg);
+    }
+    else
+    if (streq (subject, "WATCH") || streq (subject, "UNWATCH")) {
+        char *pattern = ns->name?
+            zsys_sprintf ("%s/%s", ns->name, zm_proto_device (self->msg)):
+            strdup (zm_proto_device (self->msg));
+        int64_t lease = zm_proto_ttl (self->msg)? zm_proto_ttl (self->msg): zm_asset_cfg_lease (self);
+        if (streq (subject, "UNWATCH")) {
+            zm_watches_delete (self->watches, request->sender, pattern);
+            zm_proto_encode_ok (self->msg);
+        }
+        else
+        if (zm_watches_insert (self->watches, request->sender, pattern, lease) == 0)
+            zm_proto_encode_ok (self->msg);
+        else
+            zm_proto_encode_error (self->msg, 400, "Invalid device name or prefix");
+        zm_proto_send (self->msg, msg);
+        zstr_free (&pattern);
+    }
+    else
+    if (streq (subject, "DIGEST"))
+        zm_asset_digest (self, ns->devices, msg);
+    else
+    if (streq (subject, "BUCKET"))
+        zm_asset_bucket (self, ns->devices, msg);
+    else
+    if (streq (subject, "STALE"))
+        zm_asset_stale (self, ns->devices, msg);
+    else
+    if (streq (subject, "COUNT"))
+        zm_asset_count (self, ns->devices, msg);
+    else
+    if (streq (subject, "LOOKUP")) {
+        //  Device is sent as encoded by the store, without copying
+        const char *device = zm_proto_device (self->msg);
+        zframe_t *reply = zm_devices_lookup_frame (ns->devices, device);
+        zm_asset_trace_mark (self, ZM_ASSET_TRACE_STORED);
+
+        if (reply)
+            zmsg_append (msg, &reply);
+        else {
+            zm_proto_encode_error (self->msg, 404, "Requested device does not exists");
+            zm_proto_send (self->msg, msg);
+        }
+    }
+    else {
+        zm_proto_encode_error (self->msg, 403, "Subject not found");
+        zm_proto_send (self->msg, msg);
+    }
+    zm_asset_reply (self, request, &msg);
+    zm_asset_trace_mark (self, ZM_ASSET_TRACE_REPLIED);
+}
+
+//  Apply change published by primary to warm copy of devices
+
+static void
+zm_asset_replicate (zm_asset_t *self, const char *subject)
+{
+    assert (self);
+    assert (subject);
+
+    if (zm_proto_id (self->msg) != ZM_PROTO_DEVICE) {
+        if (self->verbose)
+            zsys_warning ("message from primary with subject=%s is not DEVICE", subject);
+        return;
+    }
+    const char *command;
+    s_namespace_t root;
+    s_namespace_t *ns = zm_asset_resolve (self, subject, &root, &command);
+    if (!ns) {
+        if (self->verbose)
+            zsys_warning ("change from primary with subject=%s is for unknown namespace", subject);
+        return;
+    }
+    if (streq (command, "INSERT")) {
+        zm_devices_replicate (ns->devices, self->msg);
+        self->applied++;
+    }
+    else
+    if (streq (command, "DELETE")) {
+        zm_devices_delete (ns->devices, zm_proto_device (self->msg));
+        self->applied++;
+    }
+    else
+    if (streq (command, "HEARTBEAT"))
+        self->lag = zclock_time () - (int64_t) zm_proto_time (self->msg);
+}
+
+static void
+zm_asset_recv_mlm_stream (zm_asset_t *self, zmsg_t *request)
+{
+    assert (self);
+    assert (request);
+
+    const char *primary = zm_asset_cfg_primary (self);
+    if (!self->standby || !primary || !streq (mlm_client_sender (self->client), primary))
+        return;
+
+    self->primary_seen = zclock_mono ();
+    const char *subject = mlm_client_subject (self->client);
+    if (streq (subject, "BATCH")) {
+        while (zmsg_size (request) >= 2) {
+            char *record_subject = zmsg_popstr (request);
+            zmsg_t *record = zmsg_popmsg (request);
+            if (record && zm_proto_recv (self->msg, record) == 0)
+                zm_asset_replicate (self, record_subject);
+            zmsg_destroy (&record);
+            zstr_free (&record_subject);
+        }
+    }
+    else
+    if (zm_proto_recv (self->msg, request) == 0)
+        zm_asset_replicate (self, subject);
+    else
+    if (self->verbose)
+        zsys_warning ("can't read message from sender=%s, with subject=%s",
+        mlm_client_sender (self->client),
+        subject);
+}
+
+//  Put mailbox request to read or write queue, unless sender is throttled
+
+static void
+zm_asset_enqueue (zm_asset_t *self, zmsg_t **content_p)
+{
+    assert (self);
+    assert (content_p);
+
+    s_request_t *request = s_request_new (
+        content_p,
+        mlm_client_sender (self->client),
+        mlm_client_subject (self->client),
+        mlm_client_tracker (self->client));
+
+    s_sender_t *sender = zm_asset_sender (self, request->sender);
+    if (!zm_asset_admit (self, sender)) {
+        zmsg_t *msg = zmsg_new ();
+        zm_proto_encode_error (self->msg, 429, "Too many requests");
+        zm_proto_send (self->msg, msg);
+        zm_asset_reply (self, request, &msg);
+        s_request_destroy (&request);
+        return;
+    }
+
+    sender->pending++;
+    request->traced = self->tracer.sample
+                   && ++self->tracer.counter % self->tracer.sample == 0;
+    if (zm_asset_is_read (request->subject))
+        zlistx_add_end (self->reads.requests, request);
+    else
+        zlistx_add_end (self->writes.requests, request);
+}
+
+//  Process first request from queue
+
+static void
+zm_asset_dispatch (zm_asset_t *self, s_queue_t *queue)
+{
+    assert (self);
+    assert (queue);
+
+    s_request_t *request = (s_request_t *) zlistx_detach (queue->requests, NULL);
+    assert (request);
+    s_queue_account (queue, s_mono_usecs () - request->queued);
+
+    s_sender_t *sender = (s_sender_t *) zhashx_lookup (self->senders, request->sender);
+    if (sender && sender->pending)
+        sender->pending--;
+    if (request->traced && self->tracer.ring) {
+        zm_asset_trace_start (self, request);
+        zm_asset_trace_mark (self, ZM_ASSET_TRACE_QUEUED);
+    }
+
+    int r = zm_proto_recv (self->msg, request->content);
+    zm_asset_trace_mark (self, ZM_ASSET_TRACE_DECODED);
+    if (r != 0) {
+        if (self->verbose)
+            zsys_warning ("can't read message from sender=%s, with subject=%s",
+            request->sender,
+            request->subject);
+    }
+    else
+        zm_asset_recv_mlm_mailbox (self, request);
+    self->tracer.current = NULL;
+    s_request_destroy (&request);
+}
+
+//  Run one scheduling round, reads go first, writes get their share so they
+//  are never starved. Round which does not have reads gives whole round to
+//  writes and vice versa.
+
+static void
+zm_asset_schedule (zm_asset_t *self)
+{
+    assert (self);
+    size_t round = self->reads.weight + self->writes.weight;
+    size_t reads = zlistx_size (self->reads.requests);
+    size_t writes = zlistx_size (self->writes.requests);
+    size_t read_share = reads < self->reads.weight? reads: self->reads.weight;
+    size_t write_share = writes < self->writes.weight? writes: self->writes.weight;
+
+    if (read_share < self->reads.weight)
+        write_share = writes < round - read_share? writes: round - read_share;
+    else
+    if (write_share < self->writes.weight)
+        read_share = reads < round - write_share? reads: round - write_share;
+    reads = read_share;
+    writes = write_share;
+
+    while (reads--)
+        zm_asset_dispatch (self, &self->reads);
+    while (writes--)
+        zm_asset_dispatch (self, &self->writes);
+}
+
+//  Return true if there are requests to process, they can be processed
+//  only while connected
+
+static bool
+zm_asset_pending (zm_asset_t *self)
+{
+    assert (self);
+    return self->client
+        && (zlistx_size (self->reads.requests) || zlistx_size (self->writes.requests));
+}
+
+//  Return how long can poller wait, do not block while there are requests
+//  to process
+
+static int
+zm_asset_timeout (zm_asset_t *self)
 {
-    //  Get the whole message of the pipe in one go
-    zmsg_t *request = zmsg_recv (self->pipe);
-    if (!request)
-       return;        //  Interrupted
-
-    char *command = zmsg_popstr (request);
-    if (streq (command, "START"))
-        zm_asset_start (self);
-    else
-    if (streq (command, "STOP"))
-        zm_asset_stop (self);
-    else
-    if (streq (command, "VERBOSE"))
-        self->verbose = true;
-    else
-    if (streq (command, "$TERM"))
-        //  The $TERM command is send by zactor_destroy() method
-        self->terminated = true;
-    else
-    if (streq (command, "CONFIG"))
-        zm_asset_config (self, request);
-    else {
-        zsys_error ("invalid command '%s'", command);
-        assert (false);
+    assert (self);
+    if (zm_asset_pending (self))
+        return 0;
+    int64_t now = zclock_mono ();
+    int64_t next = self->expire_at;
+    if (self->standby && next > self->primary_seen + zm_asset_cfg_takeover (self))
+        next = self->primary_seen + zm_asset_cfg_takeover (self);
+    if (!self->standby && self->heartbeat && next > self->heartbeat_at)
+        next = self->heartbeat_at;
+    if (zm_asset_bootstrap_running (self)
+    &&  next > self->bootstrap.requested + zm_asset_cfg_bootstrap_timeout (self))
+        next = self->bootstrap.requested + zm_asset_cfg_bootstrap_timeout (self);
+    int64_t timeout = next > now? next - now: 0;
+    if (self->batch.records) {
+        int64_t flush = (self->batch.opened + self->batch.window - s_mono_usecs ()) / 1000;
+        if (flush < timeout)
+            timeout = flush > 0? flush: 0;
     }
-    zstr_free (&command);
-    zmsg_destroy (&request);
+    if (zlistx_size (self->conflation.order)
+    &&  !self->conflation.paused
+    &&  timeout > ZM_ASSET_RELEASE_INTERVAL)
+        timeout = ZM_ASSET_RELEASE_INTERVAL;
+    return (int) timeout;
 }
 
-static int
-zm_asset_publish (zm_asset_t *self, zm_proto_t *device, const char *subject)
+//  Tell standby we are alive, HEARTBEAT goes after pending changes
+
+static void
+zm_asset_send_heartbeat (zm_asset_t *self)
 {
     assert (self);
-    assert (device);
-    assert (subject);
-
+    zm_asset_flush (self);
+    zm_proto_t *heartbeat = zm_proto_new ();
+    zm_proto_encode_device (heartbeat, zm_asset_cfg_address (self), zclock_time (), self->heartbeat, NULL);
     zmsg_t *msg = zmsg_new ();
-    zm_proto_send (device, msg);
-    return mlm_client_send (self->client, subject, &msg);
+    zm_proto_send (heartbeat, msg);
+    zm_proto_destroy (&heartbeat);
+    mlm_client_send (self->client, "HEARTBEAT", &msg);
 }
 
+//  Primary is gone, reconnect with its address and serve requests sent to it
+
 static void
-zm_asset_recv_mlm_mailbox (zm_asset_t *self)
+zm_asset_takeover (zm_asset_t *self)
 {
     assert (self);
+    zsys_info ("zm_asset: primary %s silent for %" PRIi64 "ms, taking over",
+        zm_asset_cfg_primary (self), zclock_mono () - self->primary_seen);
+    zpoller_remove (self->poller, mlm_client_msgpipe (self->client));
+    mlm_client_destroy (&self->client);
+    self->standby = false;
+    self->takeovers++;
+    if (zm_asset_connect_to_malamute (self) == -1)
+        zsys_error ("zm_asset: takeover of %s failed", zm_asset_cfg_primary (self));
+    self->heartbeat_at = zclock_mono ();
+}
 
-    const char *subject = mlm_client_subject (self->client);
-    zmsg_t *msg = zmsg_new ();
-    if (streq (subject, "INSERT")) {
-        zm_devices_insert (self->devices, self->msg);
-        zm_asset_publish (self, self->msg, subject);
-        zm_proto_encode_ok (self->msg);
-        zm_proto_send (self->msg, msg);
-    }
-    else
-    if (streq (subject, "DELETE")) {
-        const char *device = zm_proto_device (self->msg);
-        zm_devices_delete (self->devices, device);
-        zm_asset_publish (self, self->msg, subject);
-        zm_proto_encode_ok (self->msg);
-        zm_proto_send (self->msg, msg);
-    }
-    else
-    if (streq (subject, "LOOKUP")) {
-        const char *device = zm_proto_device (self->msg);
-        zm_proto_t *reply = zm_devices_lookup (self->devices, device);
+//  Store snapshot of devices whose journal has grown over the limit, so
+//  journal is truncated and replay on start stays short
 
-        if (reply)
-            zm_proto_send (reply, msg);
-        else {
-            zm_proto_encode_error (self->msg, 404, "Requested device does not exists");
-            zm_proto_send (self->msg, msg);
-        }
-    }
-    else {
-        zm_proto_encode_error (self->msg, 403, "Subject not found");
-        zm_proto_send (self->msg, msg);
-    }
-    mlm_client_sendto (
-        self->client,
-        mlm_client_sender (self->client),
-        "LOOKUP",
-        NULL,
-        5000,
-        &msg);
+static void
+zm_asset_compact (zm_asset_t *self, zm_devices_t *devices)
+{
+    assert (self);
+    uint64_t limit = zm_asset_cfg_journal_compact (self);
+    if (!limit || zm_devices_journaled (devices) < limit)
+        return;
+    if (zm_devices_store (devices) == 0)
+        self->compactions++;
+    else
+        zsys_error ("zm_asset: can't store %s to compact its journal", zm_devices_file (devices));
 }
 
+//  Run periodic tasks which are due
+
 static void
-zm_asset_recv_mlm_stream (zm_asset_t *self)
+zm_asset_timers (zm_asset_t *self)
 {
     assert (self);
-
-    if (zm_proto_id (self->msg) != ZM_PROTO_DEVICE) {
-        if (self->verbose)
-            zsys_warning ("message from sender=%s, with subject=%s os not DEVICE",
-            mlm_client_sender (self->client),
-            mlm_client_subject (self->client));
+    int64_t now = zclock_mono ();
+    if (now >= self->expire_at) {
+        zm_watches_expire (self->watches);
+        zm_asset_expire_senders (self, now);
+        zm_asset_compact (self, self->devices);
+        s_namespace_t *ns = (s_namespace_t *) zhashx_first (self->namespaces);
+        while (ns) {
+            zm_asset_compact (self, ns->devices);
+            ns = (s_namespace_t *) zhashx_next (self->namespaces);
+        }
+        self->expire_at = now + ZM_ASSET_EXPIRE_INTERVAL;
+    }
+    if (self->client && zlistx_size (self->conflation.order))
+        zm_asset_release (self, false);
+    if (self->client
+    &&  self->batch.records
+    &&  s_mono_usecs () >= self->batch.opened + self->batch.window)
+        zm_asset_flush (self);
+    if (!self->client || !mlm_client_connected (self->client))
         return;
+    zm_asset_bootstrap_timers (self);
+    if (self->standby
+    &&  zm_asset_cfg_primary (self)
+    &&  now >= self->primary_seen + zm_asset_cfg_takeover (self))
+        zm_asset_takeover (self);
+    if (!self->standby
+    &&  self->heartbeat
+    &&  zm_asset_cfg_producer (self)
+    &&  now >= self->heartbeat_at) {
+        zm_asset_send_heartbeat (self);
+        self->heartbeat_at = now + self->heartbeat;
     }
 }
 
+//  Maximum number of messages drained from malamute at once
+#define ZM_ASSET_DRAIN_MAX 1024
+
 static void
 zm_asset_recv_mlm (zm_asset_t *self)
 {
     assert (self);
-    zmsg_t *request = mlm_client_recv (self->client);
-    int r = zm_proto_recv (self->msg, request);
-    zmsg_destroy (&request);
-    if (r != 0) {
-        if (self->verbose)
-            zsys_warning ("can't read message from sender=%s, with subject=%s",
-            mlm_client_sender (self->client),
-            mlm_client_subject (self->client));
-        return;
-    }
 
-    if (streq (mlm_client_command (self->client), "MAILBOX DELIVER"))
-        zm_asset_recv_mlm_mailbox (self);
-    else
-    if (streq (mlm_client_command (self->client), "STREAM DELIVER"))
-        zm_asset_recv_mlm_stream (self);
+    //  Drain what is waiting, so we can reorder it
+    size_t count = 0;
+    do {
+        zmsg_t *request = mlm_client_recv (self->client);
+        if (!request)
+            return;         //  Interrupted
+
+        if (streq (mlm_client_command (self->client), "MAILBOX DELIVER")
+        &&  zm_asset_bootstrap_reply (self))
+            zm_asset_bootstrap_chunk (self, request);
+        else
+        if (streq (mlm_client_command (self->client), "MAILBOX DELIVER")) {
+            if (self->capture)
+                zm_asset_capture (self, request);
+            zm_asset_enqueue (self, &request);
+        }
+        else
+        if (streq (mlm_client_command (self->client), "STREAM DELIVER"))
+            zm_asset_recv_mlm_stream (self, request);
+        zmsg_destroy (&request);
+    } while (++count < ZM_ASSET_DRAIN_MAX
+         &&  zsock_events (mlm_client_msgpipe (self->client)) & ZMQ_POLLIN);
 }
 
 //  --------------------------------------------------------------------------
@@ -437,14 +2659,18 @@ zm_asset_actor (zsock_t *pipe, void *args)
     zsock_signal (self->pipe, 0);
 
     while (!self->terminated) {
-        zsock_t *which = (zsock_t *) zpoller_wait (self->poller, 0);
+        zsock_t *which = (zsock_t *) zpoller_wait (self->poller, zm_asset_timeout (self));
 
         if (which == self->pipe)
             zm_asset_recv_api (self);
         else
-        if (which == mlm_client_msgpipe (self->client))
+        if (self->client && which == mlm_client_msgpipe (self->client))
             zm_asset_recv_mlm (self);
        //  Add other sockets when you need them.
+
+        if (self->client)
+            zm_asset_schedule (self);
+        zm_asset_timers (self);
     }
     zm_asset_destroy (&self);
 }
@@ -473,11 +2699,21 @@ zm_asset_test (bool verbose)
         "    address = it.zmon.asset\n"
         "    consumer\n"
         "        " ZM_PROTO_DEVICE_STREAM " = .*\n"
-        "    producer = " ZM_PROTO_DEVICE_STREAM "\n",
+        "    producer = " ZM_PROTO_DEVICE_STREAM "\n"
+        "server\n"
+        "    aggregate\n"
+        "        attributes = site\n"
+        "    trace\n"
+        "        sample = 1\n"
+        "        size = 4\n"
+        "    ratelimit\n"
+        "        burst = 1\n"
+        "        senders\n"
+        "            flood = 0.001\n",
         NULL);
     zstr_sendx (zm_asset, "START", NULL);
 
-    int r;
+    int r, i;
     mlm_client_t *reader = mlm_client_new ();
     assert (reader);
     r = mlm_client_connect (reader, endpoint, 1000, "reader");
@@ -514,6 +2750,812 @@ zm_asset_test (bool verbose)
     zmsg_destroy (&zreply);
     assert (streq (mlm_client_subject (reader), "INSERT"));
     assert (streq (zm_proto_device (reply), "device1"));
+    assert (zm_proto_ext (reply) && zhash_lookup (zm_proto_ext (reply), ZM_DEVICES_VERSION));
+
+    //  Watcher gets just the devices it asked for, once per change
+    mlm_client_t *watcher = mlm_client_new ();
+    assert (watcher);
+    r = mlm_client_connect (watcher, endpoint, 1000, "watcher");
+    assert (r == 0);
+    request = zm_proto_encode_device_v1 ("device2", 0, 0, NULL);
+    mlm_client_sendto (watcher, "it.zmon.asset", "WATCH", NULL, 1000, &request);
+    request = zm_proto_encode_device_v1 ("dev*", 0, 0, NULL);
+    mlm_client_sendto (watcher, "it.zmon.asset", "WATCH", NULL, 1000, &request);
+    for (i = 0; i != 2; i++) {
+        zreply = mlm_client_recv (watcher);
+        zm_proto_recv (reply, zreply);
+        zmsg_destroy (&zreply);
+        assert (zm_proto_id (reply) == ZM_PROTO_OK);
+    }
+
+    request = zm_proto_encode_device_v1 ("device2", zclock_mono (), 1024, NULL);
+    mlm_client_sendto (writer, "it.zmon.asset", "INSERT", NULL, 1000, &request);
+    zreply = mlm_client_recv (writer);
+    zmsg_destroy (&zreply);
+
+    zreply = mlm_client_recv (watcher);
+    zm_proto_recv (reply, zreply);
+    zmsg_destroy (&zreply);
+    assert (streq (mlm_client_subject (watcher), "INSERT"));
+    assert (streq (zm_proto_device (reply), "device2"));
+
+    request = zm_proto_encode_device_v1 ("dev*", 0, 0, NULL);
+    mlm_client_sendto (watcher, "it.zmon.asset", "UNWATCH", NULL, 1000, &request);
+    request = zm_proto_encode_device_v1 ("device2", 0, 0, NULL);
+    mlm_client_sendto (watcher, "it.zmon.asset", "UNWATCH", NULL, 1000, &request);
+    for (i = 0; i != 2; i++) {
+        zreply = mlm_client_recv (watcher);
+        zmsg_destroy (&zreply);
+    }
+    request = zm_proto_encode_device_v1 ("device2", zclock_mono (), 1024, NULL);
+    mlm_client_sendto (writer, "it.zmon.asset", "INSERT", NULL, 1000, &request);
+    zreply = mlm_client_recv (writer);
+    zmsg_destroy (&zreply);
+    zpoller_t *poller = zpoller_new (mlm_client_msgpipe (watcher), NULL);
+    assert (!zpoller_wait (poller, 200));
+    zpoller_destroy (&poller);
+    mlm_client_destroy (&watcher);
+
+    //  Second request of limited sender in a row is refused
+    mlm_client_t *flood = mlm_client_new ();
+    assert (flood);
+    r = mlm_client_connect (flood, endpoint, 1000, "flood");
+    assert (r == 0);
+    for (i = 0; i != 2; i++) {
+        request = zm_proto_encode_device_v1 ("device1", 0, 0, NULL);
+        mlm_client_sendto (flood, "it.zmon.asset", "LOOKUP", NULL, 1000, &request);
+        zreply = mlm_client_recv (flood);
+        zm_proto_recv (reply, zreply);
+        zmsg_destroy (&zreply);
+    }
+    assert (zm_proto_id (reply) == ZM_PROTO_ERROR);
+    assert (zm_proto_code (reply) == 429);
+    mlm_client_destroy (&flood);
+
+    zstr_sendx (zm_asset, "STATS", NULL);
+    char *str_stats = zstr_recv (zm_asset);
+    zconfig_t *stats = zconfig_str_load (str_stats);
+    zstr_free (&str_stats);
+    assert (stats);
+    assert (streq (zconfig_get (stats, "senders/flood/accepted", ""), "1"));
+    assert (streq (zconfig_get (stats, "senders/flood/throttled", ""), "1"));
+    assert (streq (zconfig_get (stats, "senders/writer/throttled", ""), "0"));
+    assert (atoi (zconfig_get (stats, "queues/reads/processed", "0")) >= 2);
+    assert (atoi (zconfig_get (stats, "queues/writes/processed", "0")) >= 7);
+    assert (streq (zconfig_get (stats, "watches/active", ""), "0"));
+    assert (streq (zconfig_get (stats, "watches/notified", ""), "1"));
+    assert (atoi (zconfig_get (stats, "devices/hits", "0")) >= 2);
+    assert (atoi (zconfig_get (stats, "trace/sampled", "0")) >= 4);
+    zconfig_destroy (&stats);
+
+    //  Ring keeps just last traces, stages follow each other
+    zstr_sendx (zm_asset, "TRACE", ".test-zm-asset-trace.zpl", NULL);
+    char *str_traces = zstr_recv (zm_asset);
+    zconfig_t *traces = zconfig_str_load (str_traces);
+    zstr_free (&str_traces);
+    assert (zsys_file_exists (".test-zm-asset-trace.zpl"));
+    zsys_file_delete (".test-zm-asset-trace.zpl");
+    zconfig_t *trace = zconfig_child (zconfig_locate (traces, "traces"));
+    for (i = 0; trace; i++) {
+        assert (atoi (zconfig_get (trace, "queued", "0")) <= atoi (zconfig_get (trace, "decoded", "0")));
+        assert (atoi (zconfig_get (trace, "decoded", "0")) <= atoi (zconfig_get (trace, "replied", "0")));
+        if (streq (zconfig_get (trace, "subject", ""), "INSERT"))
+            assert (zconfig_get (trace, "published", NULL));
+        trace = zconfig_next (trace);
+    }
+    assert (i == 4);
+    zconfig_destroy (&traces);
+
+    //  Cost of tracing every request, round trips to actor which traces
+    //  them are compared to one which does not
+    if (verbose) {
+        int64_t durations [2];
+        for (i = 0; i != 2; i++) {
+            zactor_t *timed = zactor_new (zm_asset_actor, NULL);
+            char *config = zsys_sprintf (
+                "malamute\n"
+                "    endpoint = inproc://zm-asset-test\n"
+                "    address = it.zmon.asset.timed%d\n"
+                "server\n"
+                "    trace\n"
+                "        sample = %d\n", i, i);
+            zstr_sendx (timed, "CONFIG", config, NULL);
+            zstr_free (&config);
+            zstr_sendx (timed, "START", NULL);
+            char address [32];
+            snprintf (address, sizeof (address), "it.zmon.asset.timed%d", i);
+            int64_t start = zclock_usecs ();
+            int lookup;
+            for (lookup = 0; lookup != 10000; lookup++) {
+                request = zm_proto_encode_device_v1 ("device1", 0, 0, NULL);
+                mlm_client_sendto (writer, address, "LOOKUP", NULL, 1000, &request);
+                zreply = mlm_client_recv (writer);
+                zmsg_destroy (&zreply);
+            }
+            durations [i] = zclock_usecs () - start;
+            zstr_sendx (timed, "STOP", NULL);
+            zactor_destroy (&timed);
+        }
+        zsys_info ("zm_asset: 10000 LOOKUPs in %" PRIi64 " usec untraced, %" PRIi64 " usec traced, overhead %.2f usec per request",
+            durations [0], durations [1], (durations [1] - durations [0]) / 10000.0);
+    }
+
+    //  Journal which grew over the limit is compacted by storing snapshot
+    zactor_t *compacted = zactor_new (zm_asset_actor, NULL);
+    zstr_sendx (compacted, "CONFIG",
+        "malamute\n"
+        "    endpoint = inproc://zm-asset-test\n"
+        "    address = it.zmon.asset.compacted\n"
+        "server\n"
+        "    file = .test-zm-asset-compact.zpl\n"
+        "    journal\n"
+        "        level = async\n"
+        "        compact = 10\n",
+        NULL);
+    zstr_sendx (compacted, "START", NULL);
+    for (i = 0; i != 20; i++) {
+        char name [32];
+        snprintf (name, sizeof (name), "device%d", i);
+        request = zm_proto_encode_device_v1 (name, zclock_mono (), 1024, NULL);
+        mlm_client_sendto (writer, "it.zmon.asset.compacted", "INSERT", NULL, 1000, &request);
+        zreply = mlm_client_recv (writer);
+        zmsg_destroy (&zreply);
+    }
+    zclock_sleep (ZM_ASSET_EXPIRE_INTERVAL + 500);
+    zstr_sendx (compacted, "STATS", NULL);
+    str_stats = zstr_recv (compacted);
+    stats = zconfig_str_load (str_stats);
+    zstr_free (&str_stats);
+    assert (atoi (zconfig_get (stats, "compactions", "0")) >= 1);
+    assert (streq (zconfig_get (stats, "devices/journal/size", ""), "0"));
+    zconfig_destroy (&stats);
+    assert (zsys_file_exists (".test-zm-asset-compact.zpl"));
+    zstr_sendx (compacted, "STOP", NULL);
+    zactor_destroy (&compacted);
+    zsys_file_delete (".test-zm-asset-compact.zpl");
+    zsys_file_delete (".test-zm-asset-compact.zpl.journal");
+
+    //  Idle sender is forgotten by the next sweep
+    zactor_t *forgetful = zactor_new (zm_asset_actor, NULL);
+    zstr_sendx (forgetful, "CONFIG",
+        "malamute\n"
+        "    endpoint = inproc://zm-asset-test\n"
+        "    address = it.zmon.asset.forgetful\n"
+        "server\n"
+        "    ratelimit\n"
+        "        idle = 1\n",
+        NULL);
+    zstr_sendx (forgetful, "START", NULL);
+    request = zm_proto_encode_device_v1 ("device1", 0, 0, NULL);
+    mlm_client_sendto (writer, "it.zmon.asset.forgetful", "LOOKUP", NULL, 1000, &request);
+    zreply = mlm_client_recv (writer);
+    zmsg_destroy (&zreply);
+    zstr_sendx (forgetful, "STATS", NULL);
+    str_stats = zstr_recv (forgetful);
+    stats = zconfig_str_load (str_stats);
+    zstr_free (&str_stats);
+    assert (streq (zconfig_get (stats, "senders/writer/accepted", ""), "1"));
+    zconfig_destroy (&stats);
+    zclock_sleep (ZM_ASSET_EXPIRE_INTERVAL + 500);
+    zstr_sendx (forgetful, "STATS", NULL);
+    str_stats = zstr_recv (forgetful);
+    stats = zconfig_str_load (str_stats);
+    zstr_free (&str_stats);
+    assert (!zconfig_locate (stats, "senders/writer"));
+    zconfig_destroy (&stats);
+    zstr_sendx (forgetful, "STOP", NULL);
+    zactor_destroy (&forgetful);
+
+    //  Consumer descends to differing bucket by DIGEST and fetches it
+    request = zm_proto_encode_device_v1 ("0", 0, 0, NULL);
+    mlm_client_sendto (writer, "it.zmon.asset", "DIGEST", NULL, 1000, &request);
+    zreply = mlm_client_recv (writer);
+    zm_proto_recv (reply, zreply);
+    zmsg_destroy (&zreply);
+    assert (zm_proto_id (reply) == ZM_PROTO_DEVICE);
+    assert (streq (zm_proto_device (reply), "DIGEST"));
+    assert (streq (zhash_lookup (zm_proto_ext (reply), "depth"), "10"));
+    assert (zhash_lookup (zm_proto_ext (reply), "0"));
+
+    zm_digest_t *digest = zm_digest_new (10);
+    size_t bucket = zm_digest_bucket (digest, "device1");
+    zm_digest_destroy (&digest);
+    char index [32];
+    snprintf (index, sizeof (index), "%zu", bucket);
+    request = zm_proto_encode_device_v1 (index, 0, 0, NULL);
+    mlm_client_sendto (writer, "it.zmon.asset", "DIGEST", NULL, 1000, &request);
+    request = zm_proto_encode_device_v1 ("10", 0, 0, NULL);
+    mlm_client_sendto (writer, "it.zmon.asset", "DIGEST", NULL, 1000, &request);
+    zreply = mlm_client_recv (writer);
+    zmsg_destroy (&zreply);
+    zreply = mlm_client_recv (writer);
+    zm_proto_recv (reply, zreply);
+    zmsg_destroy (&zreply);
+    assert (zhash_lookup (zm_proto_ext (reply), index));
+
+    request = zm_proto_encode_device_v1 (index, 0, 0, NULL);
+    mlm_client_sendto (writer, "it.zmon.asset", "BUCKET", NULL, 1000, &request);
+    zreply = mlm_client_recv (writer);
+    zframe_t *frame = zmsg_pop (zreply);
+    zmsg_t *header = zmsg_new ();
+    zmsg_append (header, &frame);
+    zm_proto_recv (reply, header);
+    zmsg_destroy (&header);
+    assert (streq (zm_proto_device (reply), "BUCKET"));
+    size_t count = atoi (zhash_lookup (zm_proto_ext (reply), "count"));
+    assert (count >= 1);
+    assert (zmsg_size (zreply) == count);
+    bool found = false;
+    zmsg_t *record = zmsg_popmsg (zreply);
+    while (record) {
+        zm_proto_recv (reply, record);
+        zmsg_destroy (&record);
+        if (streq (zm_proto_device (reply), "device1"))
+            found = true;
+        record = zmsg_popmsg (zreply);
+    }
+    assert (found);
+    zmsg_destroy (&zreply);
+
+    //  Stale devices are paged through by cursor, oldest first
+    char *cursor = strdup ("");
+    const char *stale [] = {"device1", "device2", NULL};
+    for (i = 0; i != 3; i++) {
+        request = zm_proto_encode_device_v1 (cursor, zclock_mono () + 1, 1, NULL);
+        mlm_client_sendto (writer, "it.zmon.asset", "STALE", NULL, 1000, &request);
+        zreply = mlm_client_recv (writer);
+        frame = zmsg_pop (zreply);
+        header = zmsg_new ();
+        zmsg_append (header, &frame);
+        zm_proto_recv (reply, header);
+        zmsg_destroy (&header);
+        assert (streq (zm_proto_device (reply), "STALE"));
+        zstr_free (&cursor);
+        if (zhash_lookup (zm_proto_ext (reply), "cursor"))
+            cursor = strdup ((char *) zhash_lookup (zm_proto_ext (reply), "cursor"));
+        record = zmsg_popmsg (zreply);
+        if (stale [i]) {
+            assert (cursor);
+            assert (streq (zhash_lookup (zm_proto_ext (reply), "count"), "1"));
+            zm_proto_recv (reply, record);
+            assert (streq (zm_proto_device (reply), stale [i]));
+        }
+        else {
+            assert (!cursor);
+            assert (!record);
+        }
+        zmsg_destroy (&record);
+        zmsg_destroy (&zreply);
+        if (!cursor)
+            break;
+    }
+    assert (i == 2);
+    request = zm_proto_encode_device_v1 ("device1", 0, 0, NULL);
+    mlm_client_sendto (writer, "it.zmon.asset", "STALE", NULL, 1000, &request);
+    zreply = mlm_client_recv (writer);
+    zm_proto_recv (reply, zreply);
+    zmsg_destroy (&zreply);
+    assert (zm_proto_id (reply) == ZM_PROTO_ERROR);
+    assert (zm_proto_code (reply) == 400);
+
+    //  Devices are counted by configured attributes
+    zhash_t *attrs = zhash_new ();
+    zhash_insert (attrs, "site", "prague");
+    request = zm_proto_encode_device_v1 ("device3", zclock_mono (), 1024, attrs);
+    zhash_destroy (&attrs);
+    mlm_client_sendto (writer, "it.zmon.asset", "INSERT", NULL, 1000, &request);
+    zreply = mlm_client_recv (writer);
+    zmsg_destroy (&zreply);
+    request = zm_proto_encode_device_v1 ("site", 0, 0, NULL);
+    mlm_client_sendto (writer, "it.zmon.asset", "COUNT", NULL, 1000, &request);
+    zreply = mlm_client_recv (writer);
+    zm_proto_recv (reply, zreply);
+    zmsg_destroy (&zreply);
+    assert (streq (zm_proto_device (reply), "COUNT"));
+    assert (zhash_size (zm_proto_ext (reply)) == 1);
+    assert (streq (zhash_lookup (zm_proto_ext (reply), "prague"), "1"));
+    request = zm_proto_encode_device_v1 ("model", 0, 0, NULL);
+    mlm_client_sendto (writer, "it.zmon.asset", "COUNT", NULL, 1000, &request);
+    zreply = mlm_client_recv (writer);
+    zm_proto_recv (reply, zreply);
+    zmsg_destroy (&zreply);
+    assert (zm_proto_id (reply) == ZM_PROTO_ERROR);
+    assert (zm_proto_code (reply) == 404);
+
+    //  Captured requests are written to file in arrival order
+    zstr_sendx (zm_asset, "CAPTURE", ".test-zm-asset-capture.bin", NULL);
+    assert (zsock_wait (zm_asset) == 0);
+    request = zm_proto_encode_device_v1 ("device1", 0, 0, NULL);
+    mlm_client_sendto (writer, "it.zmon.asset", "LOOKUP", NULL, 1000, &request);
+    zreply = mlm_client_recv (writer);
+    zmsg_destroy (&zreply);
+    zstr_sendx (zm_asset, "CAPTURE", NULL);
+    assert (zsock_wait (zm_asset) == 0);
+    FILE *capture = fopen (".test-zm-asset-capture.bin", "rb");
+    assert (capture);
+    byte captured [64];
+    size_t captured_size = fread (captured, 1, sizeof (captured), capture);
+    fclose (capture);
+    size_t magic = strlen (ZM_ASSET_CAPTURE_MAGIC);
+    assert (captured_size > magic + 8 + 1 + 6 + 1 + 6 + 4);
+    assert (memcmp (captured, ZM_ASSET_CAPTURE_MAGIC, magic) == 0);
+    assert (captured [magic + 8] == 6);
+    assert (memcmp (captured + magic + 9, "writer", 6) == 0);
+    assert (memcmp (captured + magic + 16, "LOOKUP", 6) == 0);
+    zsys_file_delete (".test-zm-asset-capture.bin");
+
+    //  Change conditional on version fails with current version
+    attrs = zhash_new ();
+    zhash_insert (attrs, ZM_DEVICES_VERSION, "1");
+    request = zm_proto_encode_device_v1 ("device3", zclock_mono (), 1024, attrs);
+    mlm_client_sendto (writer, "it.zmon.asset", "INSERT", NULL, 1000, &request);
+    zreply = mlm_client_recv (writer);
+    zm_proto_recv (reply, zreply);
+    zmsg_destroy (&zreply);
+    assert (zm_proto_id (reply) == ZM_PROTO_ERROR);
+    assert (zm_proto_code (reply) == 409);
+    char *version = strdup (zm_proto_description (reply));
+    zhash_update (attrs, ZM_DEVICES_VERSION, version);
+    zhash_update (attrs, "site", "brno");
+    request = zm_proto_encode_device_v1 ("device3", zclock_mono (), 1024, attrs);
+    mlm_client_sendto (writer, "it.zmon.asset", "INSERT", NULL, 1000, &request);
+    zreply = mlm_client_recv (writer);
+    zm_proto_recv (reply, zreply);
+    zmsg_destroy (&zreply);
+    assert (zm_proto_id (reply) == ZM_PROTO_OK);
+    //  The same version is stale now
+    request = zm_proto_encode_device_v1 ("device3", 0, 0, attrs);
+    mlm_client_sendto (writer, "it.zmon.asset", "DELETE", NULL, 1000, &request);
+    zreply = mlm_client_recv (writer);
+    zm_proto_recv (reply, zreply);
+    zmsg_destroy (&zreply);
+    assert (zm_proto_code (reply) == 409);
+    assert (strtoull (zm_proto_description (reply), NULL, 10) > strtoull (version, NULL, 10));
+    zhash_update (attrs, ZM_DEVICES_VERSION, "0");
+    request = zm_proto_encode_device_v1 ("device3", zclock_mono (), 1024, attrs);
+    mlm_client_sendto (writer, "it.zmon.asset", "INSERT", NULL, 1000, &request);
+    zreply = mlm_client_recv (writer);
+    zm_proto_recv (reply, zreply);
+    zmsg_destroy (&zreply);
+    assert (zm_proto_code (reply) == 409);
+    zstr_free (&version);
+    zhash_destroy (&attrs);
+
+    //  New instance copies devices from running one
+    zactor_t *bootstrapped = zactor_new (zm_asset_actor, NULL);
+    zstr_sendx (bootstrapped, "CONFIG",
+        "malamute\n"
+        "    endpoint = inproc://zm-asset-test\n"
+        "    address = it.zmon.asset.bootstrapped\n"
+        "server\n"
+        "    bootstrap\n"
+        "        peer = it.zmon.asset\n"
+        "        chunk = 1\n",
+        NULL);
+    zstr_sendx (bootstrapped, "START", NULL);
+    for (i = 0; i != 100; i++) {
+        zstr_sendx (bootstrapped, "STATS", NULL);
+        str_stats = zstr_recv (bootstrapped);
+        stats = zconfig_str_load (str_stats);
+        zstr_free (&str_stats);
+        bool running = streq (zconfig_get (stats, "bootstrap/state", ""), "running");
+        if (!running)
+            break;
+        zconfig_destroy (&stats);
+        zclock_sleep (10);
+    }
+    assert (streq (zconfig_get (stats, "bootstrap/state", ""), "done"));
+    assert (streq (zconfig_get (stats, "bootstrap/devices", ""), "3"));
+    assert (streq (zconfig_get (stats, "bootstrap/chunks", ""), "4"));
+    assert (streq (zconfig_get (stats, "devices/devices", ""), "3"));
+    zconfig_destroy (&stats);
+    request = zm_proto_encode_device_v1 ("device3", 0, 0, NULL);
+    mlm_client_sendto (writer, "it.zmon.asset.bootstrapped", "LOOKUP", NULL, 1000, &request);
+    zreply = mlm_client_recv (writer);
+    zm_proto_recv (reply, zreply);
+    zmsg_destroy (&zreply);
+    assert (zm_proto_id (reply) == ZM_PROTO_DEVICE);
+    assert (streq (zhash_lookup (zm_proto_ext (reply), "site"), "brno"));
+    zactor_destroy (&bootstrapped);
+
+    //  Requests of peer are served while transfer from it runs
+    mlm_client_t *peer = mlm_client_new ();
+    assert (peer);
+    r = mlm_client_connect (peer, endpoint, 1000, "it.zmon.asset.peer");
+    assert (r == 0);
+    bootstrapped = zactor_new (zm_asset_actor, NULL);
+    zstr_sendx (bootstrapped, "CONFIG",
+        "malamute\n"
+        "    endpoint = inproc://zm-asset-test\n"
+        "    address = it.zmon.asset.bootstrapped\n"
+        "server\n"
+        "    bootstrap\n"
+        "        peer = it.zmon.asset.peer\n",
+        NULL);
+    zstr_sendx (bootstrapped, "START", NULL);
+    zreply = mlm_client_recv (peer);
+    zmsg_destroy (&zreply);
+    assert (streq (mlm_client_subject (peer), "STALE"));
+    char *chunk_tracker = strdup (mlm_client_tracker (peer));
+    request = zm_proto_encode_device_v1 ("device3", 0, 0, NULL);
+    mlm_client_sendto (peer, "it.zmon.asset.bootstrapped", "LOOKUP", "lookup", 1000, &request);
+    zreply = mlm_client_recv (peer);
+    zm_proto_recv (reply, zreply);
+    zmsg_destroy (&zreply);
+    assert (streq (mlm_client_tracker (peer), "lookup"));
+    assert (zm_proto_code (reply) == 404);
+    zhash_t *page = zhash_new ();
+    zhash_insert (page, "count", "0");
+    request = zm_proto_encode_device_v1 ("STALE", 0, 0, page);
+    zhash_destroy (&page);
+    mlm_client_sendto (peer, "it.zmon.asset.bootstrapped", "STALE", chunk_tracker, 1000, &request);
+    zstr_free (&chunk_tracker);
+    zstr_sendx (bootstrapped, "STATS", NULL);
+    str_stats = zstr_recv (bootstrapped);
+    stats = zconfig_str_load (str_stats);
+    zstr_free (&str_stats);
+    for (i = 0; i != 100 && streq (zconfig_get (stats, "bootstrap/state", ""), "running"); i++) {
+        zconfig_destroy (&stats);
+        zclock_sleep (10);
+        zstr_sendx (bootstrapped, "STATS", NULL);
+        str_stats = zstr_recv (bootstrapped);
+        stats = zconfig_str_load (str_stats);
+        zstr_free (&str_stats);
+    }
+    assert (streq (zconfig_get (stats, "bootstrap/state", ""), "done"));
+    zconfig_destroy (&stats);
+    zactor_destroy (&bootstrapped);
+    mlm_client_destroy (&peer);
+
+    //  Namespaces are isolated from each other and from default one
+    zactor_t *tenants = zactor_new (zm_asset_actor, NULL);
+    zstr_sendx (tenants, "CONFIG",
+        "malamute\n"
+        "    endpoint = inproc://zm-asset-test\n"
+        "    address = it.zmon.asset.tenants\n"
+        "    producer = TENANTS\n"
+        "namespaces\n"
+        "    tenant1\n"
+        "    tenant2\n"
+        "        publish = 0\n",
+        NULL);
+    zstr_sendx (tenants, "START", NULL);
+    mlm_client_set_consumer (reader, "TENANTS", ".*");
+    request = zm_proto_encode_device_v1 ("device7", zclock_mono (), 1024, NULL);
+    mlm_client_sendto (writer, "it.zmon.asset.tenants", "tenant2/INSERT", NULL, 1000, &request);
+    request = zm_proto_encode_device_v1 ("device7", zclock_mono (), 1024, NULL);
+    mlm_client_sendto (writer, "it.zmon.asset.tenants", "tenant1/INSERT", NULL, 1000, &request);
+    for (i = 0; i != 2; i++) {
+        zreply = mlm_client_recv (writer);
+        zm_proto_recv (reply, zreply);
+        zmsg_destroy (&zreply);
+        assert (zm_proto_id (reply) == ZM_PROTO_OK);
+    }
+    const char *lookups [] = {"tenant1/LOOKUP", "tenant2/LOOKUP", "LOOKUP", "tenant3/LOOKUP"};
+    for (i = 0; i != 4; i++) {
+        request = zm_proto_encode_device_v1 ("device7", 0, 0, NULL);
+        mlm_client_sendto (writer, "it.zmon.asset.tenants", lookups [i], NULL, 1000, &request);
+        zreply = mlm_client_recv (writer);
+        zm_proto_recv (reply, zreply);
+        zmsg_destroy (&zreply);
+        if (i < 2)
+            assert (zm_proto_id (reply) == ZM_PROTO_DEVICE);
+        else {
+            assert (zm_proto_id (reply) == ZM_PROTO_ERROR);
+            assert (zm_proto_code (reply) == 404);
+        }
+    }
+    //  Only change of tenant1 is published
+    zreply = mlm_client_recv (reader);
+    while (!streq (mlm_client_sender (reader), "it.zmon.asset.tenants")) {
+        zmsg_destroy (&zreply);
+        zreply = mlm_client_recv (reader);
+    }
+    assert (streq (mlm_client_subject (reader), "tenant1/INSERT"));
+    zmsg_destroy (&zreply);
+    zstr_sendx (tenants, "STATS", NULL);
+    str_stats = zstr_recv (tenants);
+    stats = zconfig_str_load (str_stats);
+    zstr_free (&str_stats);
+    assert (streq (zconfig_get (stats, "namespaces/tenant1/devices", ""), "1"));
+    assert (streq (zconfig_get (stats, "namespaces/tenant2/devices", ""), "1"));
+    assert (streq (zconfig_get (stats, "devices/devices", ""), "0"));
+    zconfig_destroy (&stats);
+    mlm_client_remove_consumer (reader, "TENANTS");
+    zactor_destroy (&tenants);
+
+    //  Batching actor publishes changes together, in order
+    zactor_t *batcher = zactor_new (zm_asset_actor, NULL);
+    zstr_sendx (batcher, "CONFIG",
+        "malamute\n"
+        "    endpoint = inproc://zm-asset-test\n"
+        "    address = it.zmon.asset.batcher\n"
+        "    producer = BATCHED\n"
+        "    batch\n"
+        "        size = 3\n"
+        "        window = 50\n",
+        NULL);
+    zstr_sendx (batcher, "START", NULL);
+    mlm_client_set_consumer (reader, "BATCHED", ".*");
+    for (i = 0; i != 4; i++) {
+        request = zm_proto_encode_device_v1 (i == 3? "device3": "device4", zclock_mono (), 1024, NULL);
+        mlm_client_sendto (writer, "it.zmon.asset.batcher", i == 1? "DELETE": "INSERT", NULL, 1000, &request);
+        zreply = mlm_client_recv (writer);
+        zmsg_destroy (&zreply);
+    }
+    //  First three records are published as soon as batch is full, the last
+    //  one when window expires
+    size_t expected [] = {3, 1};
+    for (i = 0; i != 2; i++) {
+        //  Skip changes published by the first actor
+        zreply = mlm_client_recv (reader);
+        while (!streq (mlm_client_subject (reader), "BATCH")) {
+            zmsg_destroy (&zreply);
+            zreply = mlm_client_recv (reader);
+        }
+        assert (zmsg_size (zreply) == expected [i] * 2);
+        char *subject = zmsg_popstr (zreply);
+        assert (streq (subject, "INSERT"));
+        zstr_free (&subject);
+        record = zmsg_popmsg (zreply);
+        zm_proto_recv (reply, record);
+        zmsg_destroy (&record);
+        assert (streq (zm_proto_device (reply), i == 0? "device4": "device3"));
+        if (i == 0) {
+            subject = zmsg_popstr (zreply);
+            assert (streq (subject, "DELETE"));
+            zstr_free (&subject);
+        }
+        zmsg_destroy (&zreply);
+    }
+    zstr_sendx (batcher, "STATS", NULL);
+    str_stats = zstr_recv (batcher);
+    stats = zconfig_str_load (str_stats);
+    zstr_free (&str_stats);
+    assert (streq (zconfig_get (stats, "batch/batches", ""), "2"));
+    assert (streq (zconfig_get (stats, "batch/published", ""), "4"));
+    assert (streq (zconfig_get (stats, "batch/sizes/2", ""), "1"));
+    assert (streq (zconfig_get (stats, "batch/sizes/4", ""), "1"));
+    zconfig_destroy (&stats);
+    zactor_destroy (&batcher);
+
+    //  Held changes are conflated to the last one of each device, DELETE is
+    //  kept
+    zactor_t *conflater = zactor_new (zm_asset_actor, NULL);
+    zstr_sendx (conflater, "CONFIG",
+        "malamute\n"
+        "    endpoint = inproc://zm-asset-test\n"
+        "    address = it.zmon.asset.conflater\n"
+        "    producer = CONFLATED\n"
+        "    conflate = 1\n",
+        NULL);
+    zstr_sendx (conflater, "START", NULL);
+    mlm_client_set_consumer (reader, "CONFLATED", ".*");
+    zstr_sendx (conflater, "PAUSE", NULL);
+    zsock_wait (conflater);
+    for (i = 0; i != 5; i++) {
+        request = zm_proto_encode_device_v1 (i < 3? "device5": "device6", zclock_mono (), 1000 + i, NULL);
+        mlm_client_sendto (writer, "it.zmon.asset.conflater", i == 3? "DELETE": "INSERT", NULL, 1000, &request);
+        zreply = mlm_client_recv (writer);
+        zmsg_destroy (&zreply);
+    }
+    zstr_sendx (conflater, "RESUME", NULL);
+    zsock_wait (conflater);
+    const char *conflated [] = {"INSERT", "device5", "DELETE", "device6", "INSERT", "device6"};
+    for (i = 0; i != 3; i++) {
+        zreply = mlm_client_recv (reader);
+        while (!streq (mlm_client_address (reader), "CONFLATED")) {
+            zmsg_destroy (&zreply);
+            zreply = mlm_client_recv (reader);
+        }
+        zm_proto_recv (reply, zreply);
+        zmsg_destroy (&zreply);
+        assert (streq (mlm_client_subject (reader), conflated [2 * i]));
+        assert (streq (zm_proto_device (reply), conflated [2 * i + 1]));
+        if (i == 0)
+            assert (zm_proto_ttl (reply) == 1002);
+    }
+    zstr_sendx (conflater, "STATS", NULL);
+    str_stats = zstr_recv (conflater);
+    stats = zconfig_str_load (str_stats);
+    zstr_free (&str_stats);
+    assert (streq (zconfig_get (stats, "conflation/pending", ""), "0"));
+    assert (streq (zconfig_get (stats, "conflation/max_pending", ""), "2"));
+    assert (streq (zconfig_get (stats, "conflation/held", ""), "5"));
+    assert (streq (zconfig_get (stats, "conflation/conflated", ""), "2"));
+    assert (streq (zconfig_get (stats, "conflation/published", ""), "3"));
+    zconfig_destroy (&stats);
+    zactor_destroy (&conflater);
+
+    //  Burst of changes fills pipe to actor of malamute client, changes are
+    //  held and conflated until it catches up; consumer does not read
+    //  meanwhile. Pipe of client is made tiny to fill up quickly.
+    size_t pipehwm = zsys_pipehwm ();
+    zsys_set_pipehwm (1);
+    zactor_t *pressed = zactor_new (zm_asset_actor, NULL);
+    zstr_sendx (pressed, "CONFIG",
+        "malamute\n"
+        "    endpoint = inproc://zm-asset-test\n"
+        "    address = it.zmon.asset.pressed\n"
+        "    producer = PRESSED\n"
+        "    conflate = 1\n",
+        NULL);
+    zstr_sendx (pressed, "START", NULL);
+    mlm_client_set_consumer (reader, "PRESSED", ".*");
+    request = zm_proto_encode_device_v1 ("device7", 0, 0, NULL);
+    mlm_client_sendto (writer, "it.zmon.asset.pressed", "LOOKUP", NULL, 1000, &request);
+    zreply = mlm_client_recv (writer);
+    zmsg_destroy (&zreply);
+    zsys_set_pipehwm (pipehwm);
+    for (i = 0; i != 2000; i++) {
+        request = zm_proto_encode_device_v1 (i % 2? "device8": "device7", zclock_mono (), 1000 + i, NULL);
+        mlm_client_sendto (writer, "it.zmon.asset.pressed", "INSERT", NULL, 1000, &request);
+    }
+    for (i = 0; i != 2000; i++) {
+        zreply = mlm_client_recv (writer);
+        zmsg_destroy (&zreply);
+    }
+    //  The last change of each device is published, after all held ones
+    int received = 0;
+    bool last [2] = {false, false};
+    while (!last [0] || !last [1]) {
+        zreply = mlm_client_recv (reader);
+        assert (zreply);
+        if (streq (mlm_client_address (reader), "PRESSED")) {
+            zm_proto_recv (reply, zreply);
+            received++;
+            if (zm_proto_ttl (reply) >= 1000 + 1998)
+                last [zm_proto_ttl (reply) - 1000 - 1998] = true;
+        }
+        zmsg_destroy (&zreply);
+    }
+    zstr_sendx (pressed, "STATS", NULL);
+    str_stats = zstr_recv (pressed);
+    stats = zconfig_str_load (str_stats);
+    zstr_free (&str_stats);
+    assert (atoi (zconfig_get (stats, "conflation/held", "0")) > 0);
+    assert (atoi (zconfig_get (stats, "conflation/conflated", "0")) > 0);
+    assert (streq (zconfig_get (stats, "conflation/pending", ""), "0"));
+    assert (received == 2000 - atoi (zconfig_get (stats, "conflation/conflated", "0")));
+    if (verbose)
+        zsys_info ("zm_asset: 2000 changes under backpressure, %s held, %d published",
+            zconfig_get (stats, "conflation/held", ""), received);
+    zconfig_destroy (&stats);
+    zstr_sendx (pressed, "STOP", NULL);
+    zactor_destroy (&pressed);
+
+    //  Standby follows primary and takes its address over when it is gone
+    zactor_t *primary = zactor_new (zm_asset_actor, NULL);
+    zstr_sendx (primary, "CONFIG",
+        "malamute\n"
+        "    endpoint = inproc://zm-asset-test\n"
+        "    address = it.zmon.asset.primary\n"
+        "    producer = REPLICATED\n"
+        "server\n"
+        "    heartbeat = 50\n",
+        NULL);
+    zstr_sendx (primary, "START", NULL);
+    //  Change standby does not see makes versions of primary differ from
+    //  ones standby would give
+    request = zm_proto_encode_device_v1 ("device4", zclock_mono (), 1024, NULL);
+    mlm_client_sendto (writer, "it.zmon.asset.primary", "INSERT", NULL, 1000, &request);
+    zreply = mlm_client_recv (writer);
+    zmsg_destroy (&zreply);
+    zactor_t *standby = zactor_new (zm_asset_actor, NULL);
+    zstr_sendx (standby, "CONFIG",
+        "malamute\n"
+        "    endpoint = inproc://zm-asset-test\n"
+        "    address = it.zmon.asset.standby\n"
+        "    producer = REPLICATED\n"
+        "    consumer\n"
+        "        REPLICATED = .*\n"
+        "server\n"
+        "    mode = standby\n"
+        "    heartbeat = 50\n"
+        "    standby\n"
+        "        primary = it.zmon.asset.primary\n"
+        "        timeout = 300\n",
+        NULL);
+    zstr_sendx (standby, "START", NULL);
+    zclock_sleep (100);
+
+    request = zm_proto_encode_device_v1 ("device5", zclock_mono (), 1024, NULL);
+    mlm_client_sendto (writer, "it.zmon.asset.primary", "INSERT", NULL, 1000, &request);
+    zreply = mlm_client_recv (writer);
+    zmsg_destroy (&zreply);
+    request = zm_proto_encode_device_v1 ("device6", zclock_mono (), 1024, NULL);
+    mlm_client_sendto (writer, "it.zmon.asset.standby", "INSERT", NULL, 1000, &request);
+    zreply = mlm_client_recv (writer);
+    zm_proto_recv (reply, zreply);
+    zmsg_destroy (&zreply);
+    assert (zm_proto_id (reply) == ZM_PROTO_ERROR);
+    assert (zm_proto_code (reply) == 503);
+
+    for (i = 0; i != 100; i++) {
+        request = zm_proto_encode_device_v1 ("device5", 0, 0, NULL);
+        mlm_client_sendto (writer, "it.zmon.asset.standby", "LOOKUP", NULL, 1000, &request);
+        zreply = mlm_client_recv (writer);
+        zm_proto_recv (reply, zreply);
+        zmsg_destroy (&zreply);
+        if (zm_proto_id (reply) == ZM_PROTO_DEVICE)
+            break;
+        zclock_sleep (10);
+    }
+    assert (zm_proto_id (reply) == ZM_PROTO_DEVICE);
+    zstr_sendx (standby, "STATS", NULL);
+    str_stats = zstr_recv (standby);
+    stats = zconfig_str_load (str_stats);
+    zstr_free (&str_stats);
+    assert (streq (zconfig_get (stats, "replication/mode", ""), "standby"));
+    assert (streq (zconfig_get (stats, "replication/applied", ""), "1"));
+    assert (atoi (zconfig_get (stats, "replication/silence", "1000")) < 300);
+    zconfig_destroy (&stats);
+    request = zm_proto_encode_device_v1 ("device5", 0, 0, NULL);
+    mlm_client_sendto (writer, "it.zmon.asset.primary", "LOOKUP", NULL, 1000, &request);
+    zreply = mlm_client_recv (writer);
+    zm_proto_recv (reply, zreply);
+    zmsg_destroy (&zreply);
+    char *primary_version = strdup (zhash_lookup (zm_proto_ext (reply), ZM_DEVICES_VERSION));
+    assert (streq (primary_version, "2"));
+
+    zstr_sendx (primary, "STOP", NULL);
+    zactor_destroy (&primary);
+    request = zm_proto_encode_device_v1 ("device5", 0, 0, NULL);
+    mlm_client_sendto (writer, "it.zmon.asset.primary", "LOOKUP", NULL, 1000, &request);
+    poller = zpoller_new (mlm_client_msgpipe (writer), NULL);
+    assert (zpoller_wait (poller, 2000));
+    zpoller_destroy (&poller);
+    zreply = mlm_client_recv (writer);
+    zm_proto_recv (reply, zreply);
+    zmsg_destroy (&zreply);
+    assert (zm_proto_id (reply) == ZM_PROTO_DEVICE);
+    assert (streq (zm_proto_device (reply), "device5"));
+    //  Version clients know from primary survives takeover
+    assert (streq (zhash_lookup (zm_proto_ext (reply), ZM_DEVICES_VERSION), primary_version));
+    zstr_free (&primary_version);
+    zstr_sendx (standby, "STATS", NULL);
+    str_stats = zstr_recv (standby);
+    stats = zconfig_str_load (str_stats);
+    zstr_free (&str_stats);
+    assert (streq (zconfig_get (stats, "replication/mode", ""), "primary"));
+    assert (streq (zconfig_get (stats, "replication/takeovers", ""), "1"));
+    zconfig_destroy (&stats);
+    zactor_destroy (&standby);
+
+    //  Replies of pipelined requests are matched by tracker, throughput
+    //  without waiting for each reply is compared to one by one
+    size_t depths [] = {1, 64};
+    size_t pipelined = verbose? 100000: 256;
+    bool *replied = (bool *) zmalloc (pipelined * sizeof (bool));
+    assert (replied);
+    for (i = 0; i != 2; i++) {
+        memset (replied, 0, pipelined * sizeof (bool));
+        size_t sent = 0, received = 0;
+        int64_t start = zclock_usecs ();
+        while (received < pipelined) {
+            while (sent < pipelined && sent - received < depths [i]) {
+                char tracker [32];
+                snprintf (tracker, sizeof (tracker), "%zu", sent);
+                request = zm_proto_encode_device_v1 (sent % 2? "device1": "device0", 0, 0, NULL);
+                mlm_client_sendto (writer, "it.zmon.asset", "LOOKUP", tracker, 1000, &request);
+                sent++;
+            }
+            zreply = mlm_client_recv (writer);
+            zm_proto_recv (reply, zreply);
+            zmsg_destroy (&zreply);
+            assert (streq (mlm_client_subject (writer), "LOOKUP"));
+            size_t lookup = (size_t) strtoul (mlm_client_tracker (writer), NULL, 10);
+            assert (lookup < sent && !replied [lookup]);
+            replied [lookup] = true;
+            assert ((zm_proto_id (reply) == ZM_PROTO_DEVICE) == (lookup % 2 == 1));
+            received++;
+        }
+        int64_t duration = zclock_usecs () - start;
+        if (verbose)
+            zsys_info ("zm_asset: %zu LOOKUPs at pipeline depth %zu in %" PRIi64 " usec, %.0f requests/s",
+                pipelined, depths [i], duration, duration? pipelined * 1e6 / duration: 0.0);
+    }
+    free (replied);
 
     zm_proto_destroy (&reply);
     
@@ -24,15 +24,46 @@
 #include "../include/zmasset.h"
 
 //  Extra headers
+#include "zm_hash.h"
 
 //  Opaque class structures to allow forward references
 #ifndef ZM_DEVICES_T_DEFINED
 typedef struct _zm_devices_t zm_devices_t;
 #define ZM_DEVICES_T_DEFINED
 #endif
+#ifndef ZM_BLOOM_T_DEFINED
+typedef struct _zm_bloom_t zm_bloom_t;
+#define ZM_BLOOM_T_DEFINED
+#endif
+#ifndef ZM_WATCHES_T_DEFINED
+typedef struct _zm_watches_t zm_watches_t;
+#define ZM_WATCHES_T_DEFINED
+#endif
+#ifndef ZM_DIGEST_T_DEFINED
+typedef struct _zm_digest_t zm_digest_t;
+#define ZM_DIGEST_T_DEFINED
+#endif
+#ifndef ZM_JOURNAL_T_DEFINED
+typedef struct _zm_journal_t zm_journal_t;
+#define ZM_JOURNAL_T_DEFINED
+#endif
+#ifndef ZM_INDEX_T_DEFINED
+typedef struct _zm_index_t zm_index_t;
+#define ZM_INDEX_T_DEFINED
+#endif
+#ifndef ZM_AGGREGATE_T_DEFINED
+typedef struct _zm_aggregate_t zm_aggregate_t;
+#define ZM_AGGREGATE_T_DEFINED
+#endif
 
 //  Internal API
 #include "zm_devices.h"
+#include "zm_bloom.h"
+#include "zm_watches.h"
+#include "zm_digest.h"
+#include "zm_journal.h"
+#include "zm_index.h"
+#include "zm_aggregate.h"
 
 //  *** To avoid double-definitions, only define if building without draft ***
 #ifndef ZM_ASSET_BUILD_DRAFT_API
@@ -42,6 +73,36 @@ typedef struct _zm_devices_t zm_devices_t;
 ZM_ASSET_PRIVATE void
     zm_devices_test (bool verbose);
 
+//  *** Draft method, defined for internal use only ***
+//  Self test of this class.
+ZM_ASSET_PRIVATE void
+    zm_bloom_test (bool verbose);
+
+//  *** Draft method, defined for internal use only ***
+//  Self test of this class.
+ZM_ASSET_PRIVATE void
+    zm_watches_test (bool verbose);
+
+//  *** Draft method, defined for internal use only ***
+//  Self test of this class.
+ZM_ASSET_PRIVATE void
+    zm_digest_test (bool verbose);
+
+//  *** Draft method, defined for internal use only ***
+//  Self test of this class.
+ZM_ASSET_PRIVATE void
+    zm_journal_test (bool verbose);
+
+//  *** Draft method, defined for internal use only ***
+//  Self test of this class.
+ZM_ASSET_PRIVATE void
+    zm_index_test (bool verbose);
+
+//  *** Draft method, defined for internal use only ***
+//  Self test of this class.
+ZM_ASSET_PRIVATE void
+    zm_aggregate_test (bool verbose);
+
 //  Self test for private classes
 ZM_ASSET_PRIVATE void
     zm_asset_private_selftest (bool verbose);
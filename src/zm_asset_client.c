@@ -0,0 +1,771 @@
+/*  =========================================================================
+    zm_asset_client - Client of zm asset with local cache
+
+    Copyright (c) the Contributors as noted in the AUTHORS file.  This file is part
+    of zmon.it, the fast and scalable monitoring system.                           
+                                                                                   
+    This Source Code Form is subject to the terms of the Mozilla Public License, v.
+    2.0. If a copy of the MPL was not distributed with this file, You can obtain   
+    one at http://mozilla.org/MPL/2.0/.                                            
+    =========================================================================
+*/
+
+/*
+@header
+    zm_asset_client - Client of zm asset with local cache
+@discuss
+    Client sends LOOKUP, INSERT and DELETE to zm_asset actor over malamute
+    mailbox and decodes its replies. Synchronous calls wait for their reply,
+    asynchronous ones return tracker and replies are received in any order
+    by zm_asset_client_recv. Replies of other requests which come while
+    synchronous call waits are kept for zm_asset_client_recv.
+
+    With cache enabled, devices looked up are kept locally and following
+    lookups of them do not go to server. Client consumes stream server
+    publishes changes to and forgets devices changed there, so cached copy
+    is never older than the last change delivered to client. Lookup reply
+    is not cached when any change came while it was on the way, it could
+    be older than that change. When cache is full, the least recently used
+    device is dropped.
+
+    Requests for namespace of server have subject prefixed by its name,
+    e.g. tenant1/LOOKUP. Devices are cached per namespace, changes on stream
+    with prefixed subjects drop only copies from their namespace. Namespace
+    which does not publish its changes (publish = 0 on server) must not be
+    cached, see zm_asset_client_set_cache_namespace.
+
+    Reply which comes after synchronous call timed out is discarded, it
+    is not returned by zm_asset_client_recv.
+@end
+*/
+
+#include "zm_asset_classes.h"
+
+//  Reply waiting to be returned, either from server or from cache
+
+typedef struct {
+    uint64_t tracker;           //  Tracker of request
+    zmsg_t *content;            //  Encoded zm_proto message
+} s_reply_t;
+
+static s_reply_t *
+s_reply_new (uint64_t tracker, zmsg_t **content_p)
+{
+    s_reply_t *self = (s_reply_t *) zmalloc (sizeof (s_reply_t));
+    assert (self);
+    self->tracker = tracker;
+    self->content = *content_p;
+    *content_p = NULL;
+    return self;
+}
+
+static void
+s_reply_destroy (s_reply_t **self_p)
+{
+    assert (self_p);
+    if (*self_p) {
+        s_reply_t *self = *self_p;
+        zmsg_destroy (&self->content);
+        free (self);
+        *self_p = NULL;
+    }
+}
+
+//  Device kept in cache under key made of namespace and name
+
+typedef struct {
+    char *key;                  //  Key in cache
+    zm_proto_t *device;         //  Copy of device
+} s_cached_t;
+
+static void
+s_cached_destroy (s_cached_t **self_p)
+{
+    assert (self_p);
+    if (*self_p) {
+        s_cached_t *self = *self_p;
+        zstr_free (&self->key);
+        zm_proto_destroy (&self->device);
+        free (self);
+        *self_p = NULL;
+    }
+}
+
+//  LOOKUP sent to server whose reply can be cached
+
+typedef struct {
+    uint64_t changes;           //  Changes came from stream when sent
+    char *prefix;               //  Namespace of request with slash or ""
+} s_lookup_t;
+
+static void
+s_lookup_destroy (s_lookup_t **self_p)
+{
+    assert (self_p);
+    if (*self_p) {
+        s_lookup_t *self = *self_p;
+        zstr_free (&self->prefix);
+        free (self);
+        *self_p = NULL;
+    }
+}
+
+//  Return command of subject, the part after namespace prefix
+
+static const char *
+s_command (const char *subject)
+{
+    const char *slash = strrchr (subject, '/');
+    return slash? slash + 1: subject;
+}
+
+//  Return cache key of device name in namespace of subject or its prefix,
+//  caller frees it. Namespace names do not contain slash, so the first slash of key
+//  separates it from name.
+
+static char *
+s_key (const char *subject, const char *name)
+{
+    int prefix = (int) (s_command (subject) - subject);
+    return zsys_sprintf ("%.*s/%s", prefix? prefix - 1: 0, subject, name);
+}
+
+//  Structure of our class
+
+struct _zm_asset_client_t {
+    mlm_client_t *client;       //  Connection to malamute
+    zpoller_t *poller;          //  Waits for messages of client
+    char *server;               //  Address of zm_asset actor
+    int timeout;                //  Timeout of synchronous calls, msec
+    uint64_t sequence;          //  Tracker of the last request
+    zm_proto_t *request;        //  Request being encoded
+    zm_proto_t *change;         //  Change from stream being decoded
+    zm_proto_t *reply;          //  Last reply
+    zm_proto_t *last;           //  Last reply or NULL after timeout
+    uint64_t tracker;           //  Tracker of the last reply
+    zlistx_t *pending;          //  Replies not returned yet
+    zhashx_t *lookups;          //  Tracker of LOOKUP -> s_lookup_t
+    zhashx_t *abandoned;        //  Trackers of timed out synchronous calls
+    zhashx_t *uncached;         //  Prefixes of namespaces not cached
+    bool caching;               //  Cache is enabled
+    size_t limit;               //  Maximum size of cache, 0 = unlimited
+    zhashx_t *cache;            //  Key -> handle in devices
+    zlistx_t *devices;          //  Cached s_cached_t, least recently used first
+    uint64_t changes;           //  Changes came from stream
+    uint64_t hits;              //  Lookups answered from cache
+    uint64_t misses;            //  Lookups sent to server
+};
+
+//  Return cached device of key and mark it as recently used, or NULL
+
+static zm_proto_t *
+s_cache_lookup (zm_asset_client_t *self, const char *key)
+{
+    void *handle = zhashx_lookup (self->cache, key);
+    if (!handle)
+        return NULL;
+    zlistx_move_end (self->devices, handle);
+    return ((s_cached_t *) zlistx_handle_item (handle))->device;
+}
+
+static void
+s_cache_remove (zm_asset_client_t *self, const char *key)
+{
+    void *handle = zhashx_lookup (self->cache, key);
+    if (handle) {
+        zhashx_delete (self->cache, key);
+        zlistx_delete (self->devices, handle);
+    }
+}
+
+//  Drop the least recently used devices until there are at most limit
+
+static void
+s_cache_shrink (zm_asset_client_t *self, size_t limit)
+{
+    while (zlistx_size (self->devices) > limit)
+        s_cache_remove (self, ((s_cached_t *) zlistx_first (self->devices))->key);
+}
+
+static void
+s_cache_insert (zm_asset_client_t *self, const char *prefix, zm_proto_t *device)
+{
+    s_cached_t *cached = (s_cached_t *) zmalloc (sizeof (s_cached_t));
+    assert (cached);
+    cached->key = s_key (prefix, zm_proto_device (device));
+    cached->device = zm_proto_dup (device);
+    s_cache_remove (self, cached->key);
+    if (self->limit)
+        s_cache_shrink (self, self->limit - 1);
+    void *handle = zlistx_add_end (self->devices, cached);
+    zhashx_insert (self->cache, cached->key, handle);
+}
+
+//  Forget device changed on stream, cached copy of it is stale. Subject
+//  can be prefixed by namespace device belongs to.
+
+static void
+s_cache_change (zm_asset_client_t *self, const char *subject, zmsg_t *content)
+{
+    const char *command = s_command (subject);
+    if (!streq (command, "INSERT") && !streq (command, "DELETE"))
+        return;
+    self->changes++;
+    if (zm_proto_recv (self->change, content) == 0) {
+        char *key = s_key (subject, zm_proto_device (self->change));
+        s_cache_remove (self, key);
+        zstr_free (&key);
+    }
+}
+
+//  Receive one message, waiting up to timeout msec. Changes from stream are
+//  applied to cache, replies of server are kept in pending unless their
+//  call was abandoned. Returns -1 on timeout or interrupt.
+
+static int
+s_receive (zm_asset_client_t *self, int timeout)
+{
+    if (!zpoller_wait (self->poller, timeout))
+        return -1;
+    zmsg_t *content = mlm_client_recv (self->client);
+    if (!content)
+        return -1;          //  Interrupted
+
+    const char *command = mlm_client_command (self->client);
+    const char *tracker = mlm_client_tracker (self->client);
+    if (streq (command, "STREAM DELIVER")) {
+        const char *subject = mlm_client_subject (self->client);
+        if (streq (subject, "BATCH")) {
+            while (zmsg_size (content) >= 2) {
+                char *record_subject = zmsg_popstr (content);
+                zmsg_t *record = zmsg_popmsg (content);
+                if (record)
+                    s_cache_change (self, record_subject, record);
+                zmsg_destroy (&record);
+                zstr_free (&record_subject);
+            }
+        }
+        else
+            s_cache_change (self, subject, content);
+    }
+    else
+    //  Notifications of watches come without tracker
+    if (streq (command, "MAILBOX DELIVER")
+    &&  streq (mlm_client_sender (self->client), self->server)
+    &&  tracker && *tracker) {
+        if (zhashx_lookup (self->abandoned, tracker)) {
+            zhashx_delete (self->abandoned, tracker);
+            zmsg_destroy (&content);
+            return 0;
+        }
+        s_reply_t *reply = s_reply_new (strtoull (tracker, NULL, 10), &content);
+        zlistx_add_end (self->pending, reply);
+    }
+    zmsg_destroy (&content);
+    return 0;
+}
+
+//  Process messages which are waiting, so cache does not answer with
+//  devices already changed
+
+static void
+s_drain (zm_asset_client_t *self)
+{
+    while (zsock_events (mlm_client_msgpipe (self->client)) & ZMQ_POLLIN)
+        if (s_receive (self, 0) == -1)
+            break;
+}
+
+//  Decode reply and cache device it returned. Returns reply or NULL if it
+//  can't be decoded.
+
+static zm_proto_t *
+s_take (zm_asset_client_t *self, s_reply_t **reply_p)
+{
+    s_reply_t *reply = *reply_p;
+    self->tracker = reply->tracker;
+    self->last = zm_proto_recv (self->reply, reply->content) == 0? self->reply: NULL;
+
+    char key [32];
+    snprintf (key, sizeof (key), "%" PRIu64, reply->tracker);
+    s_lookup_t *lookup = (s_lookup_t *) zhashx_lookup (self->lookups, key);
+    if (lookup) {
+        if (self->last
+        &&  zm_proto_id (self->last) == ZM_PROTO_DEVICE
+        &&  lookup->changes == self->changes)
+            s_cache_insert (self, lookup->prefix, self->last);
+        zhashx_delete (self->lookups, key);
+    }
+    s_reply_destroy (reply_p);
+    return self->last;
+}
+
+//  Wait for reply with tracker up to timeout of client. On timeout the call
+//  is abandoned, its reply is discarded when it comes.
+
+static zm_proto_t *
+s_wait (zm_asset_client_t *self, uint64_t tracker)
+{
+    if (!tracker) {
+        self->last = NULL;
+        return NULL;            //  Request was not sent
+    }
+    int64_t deadline = zclock_mono () + self->timeout;
+    while (true) {
+        s_reply_t *reply = (s_reply_t *) zlistx_first (self->pending);
+        while (reply && reply->tracker != tracker)
+            reply = (s_reply_t *) zlistx_next (self->pending);
+        if (reply) {
+            zlistx_detach_cur (self->pending);
+            return s_take (self, &reply);
+        }
+        int64_t wait = deadline - zclock_mono ();
+        if (wait < 0 || s_receive (self, (int) wait) == -1) {
+            char key [32];
+            snprintf (key, sizeof (key), "%" PRIu64, tracker);
+            zhashx_delete (self->lookups, key);
+            zhashx_insert (self->abandoned, key, (void *) 1);
+            self->last = NULL;
+            return NULL;
+        }
+    }
+}
+
+
+//  --------------------------------------------------------------------------
+//  Create a new zm_asset_client
+
+zm_asset_client_t *
+zm_asset_client_new (const char *endpoint, const char *address, const char *server)
+{
+    assert (endpoint);
+    assert (address);
+    assert (server);
+
+    zm_asset_client_t *self = (zm_asset_client_t *) zmalloc (sizeof (zm_asset_client_t));
+    assert (self);
+    self->client = mlm_client_new ();
+    assert (self->client);
+    if (mlm_client_connect (self->client, endpoint, 1000, address) == -1) {
+        zsys_error ("zm_asset_client: can't connect to %s as %s", endpoint, address);
+        mlm_client_destroy (&self->client);
+        free (self);
+        return NULL;
+    }
+    self->poller = zpoller_new (mlm_client_msgpipe (self->client), NULL);
+    assert (self->poller);
+    self->server = strdup (server);
+    self->timeout = 5000;
+    self->request = zm_proto_new ();
+    self->change = zm_proto_new ();
+    self->reply = zm_proto_new ();
+    self->pending = zlistx_new ();
+    assert (self->pending);
+    zlistx_set_destructor (self->pending, (zlistx_destructor_fn *) s_reply_destroy);
+    self->lookups = zhashx_new ();
+    assert (self->lookups);
+    zhashx_set_destructor (self->lookups, (zhashx_destructor_fn *) s_lookup_destroy);
+    self->abandoned = zhashx_new ();
+    assert (self->abandoned);
+    self->uncached = zhashx_new ();
+    assert (self->uncached);
+    self->cache = zhashx_new ();
+    assert (self->cache);
+    self->devices = zlistx_new ();
+    assert (self->devices);
+    zlistx_set_destructor (self->devices, (zlistx_destructor_fn *) s_cached_destroy);
+    return self;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Destroy the zm_asset_client
+
+void
+zm_asset_client_destroy (zm_asset_client_t **self_p)
+{
+    assert (self_p);
+    if (*self_p) {
+        zm_asset_client_t *self = *self_p;
+        zhashx_destroy (&self->cache);
+        zlistx_destroy (&self->devices);
+        zhashx_destroy (&self->uncached);
+        zhashx_destroy (&self->abandoned);
+        zhashx_destroy (&self->lookups);
+        zlistx_destroy (&self->pending);
+        zm_proto_destroy (&self->reply);
+        zm_proto_destroy (&self->change);
+        zm_proto_destroy (&self->request);
+        zstr_free (&self->server);
+        zpoller_destroy (&self->poller);
+        mlm_client_destroy (&self->client);
+        free (self);
+        *self_p = NULL;
+    }
+}
+
+int
+zm_asset_client_set_cache (zm_asset_client_t *self, const char *stream, size_t size)
+{
+    assert (self);
+    assert (stream);
+    if (mlm_client_set_consumer (self->client, stream, ".*") == -1)
+        return -1;
+    self->caching = true;
+    self->limit = size;
+    if (self->limit)
+        s_cache_shrink (self, self->limit);
+    return 0;
+}
+
+void
+zm_asset_client_set_cache_namespace (zm_asset_client_t *self, const char *ns, bool enabled)
+{
+    assert (self);
+    assert (ns);
+    char *prefix = *ns? zsys_sprintf ("%s/", ns): strdup ("");
+    if (enabled)
+        zhashx_delete (self->uncached, prefix);
+    else {
+        zhashx_update (self->uncached, prefix, (void *) 1);
+        //  Key of cached device starts with namespace and slash
+        const char *start = *ns? prefix: "/";
+        size_t length = strlen (start);
+        zlistx_t *stale = zlistx_new ();
+        zlistx_set_destructor (stale, (zlistx_destructor_fn *) zstr_free);
+        s_cached_t *cached = (s_cached_t *) zlistx_first (self->devices);
+        while (cached) {
+            if (strncmp (cached->key, start, length) == 0)
+                zlistx_add_end (stale, strdup (cached->key));
+            cached = (s_cached_t *) zlistx_next (self->devices);
+        }
+        char *key = (char *) zlistx_first (stale);
+        while (key) {
+            s_cache_remove (self, key);
+            key = (char *) zlistx_next (stale);
+        }
+        zlistx_destroy (&stale);
+    }
+    zstr_free (&prefix);
+}
+
+void
+zm_asset_client_set_timeout (zm_asset_client_t *self, int timeout)
+{
+    assert (self);
+    self->timeout = timeout;
+}
+
+zm_proto_t *
+zm_asset_client_lookup (zm_asset_client_t *self, const char *name)
+{
+    assert (self);
+    assert (name);
+    zm_proto_encode_device (self->request, name, 0, 0, NULL);
+    zm_proto_t *reply = s_wait (self, zm_asset_client_send (self, "LOOKUP", self->request));
+    return reply && zm_proto_id (reply) == ZM_PROTO_DEVICE? reply: NULL;
+}
+
+int
+zm_asset_client_insert (zm_asset_client_t *self, zm_proto_t *device)
+{
+    assert (self);
+    assert (device);
+    zm_proto_t *reply = s_wait (self, zm_asset_client_send (self, "INSERT", device));
+    return reply && zm_proto_id (reply) == ZM_PROTO_OK? 0: -1;
+}
+
+int
+zm_asset_client_delete (zm_asset_client_t *self, const char *name)
+{
+    assert (self);
+    assert (name);
+    zm_proto_encode_device (self->request, name, 0, 0, NULL);
+    zm_proto_t *reply = s_wait (self, zm_asset_client_send (self, "DELETE", self->request));
+    return reply && zm_proto_id (reply) == ZM_PROTO_OK? 0: -1;
+}
+
+zm_proto_t *
+zm_asset_client_reply (zm_asset_client_t *self)
+{
+    assert (self);
+    return self->last;
+}
+
+uint64_t
+zm_asset_client_send (zm_asset_client_t *self, const char *subject, zm_proto_t *request)
+{
+    assert (self);
+    assert (subject);
+    assert (request);
+
+    uint64_t tracker = ++self->sequence;
+    char key [32];
+    snprintf (key, sizeof (key), "%" PRIu64, tracker);
+    const char *command = s_command (subject);
+    char *cache_key = s_key (subject, zm_proto_device (request));
+    char *prefix = strndup (subject, (size_t) (command - subject));
+    bool caching = self->caching && !zhashx_lookup (self->uncached, prefix);
+    if (streq (command, "LOOKUP") && caching) {
+        s_drain (self);
+        zm_proto_t *cached = s_cache_lookup (self, cache_key);
+        zstr_free (&cache_key);
+        if (cached) {
+            zstr_free (&prefix);
+            self->hits++;
+            zmsg_t *content = zmsg_new ();
+            zm_proto_send (cached, content);
+            s_reply_t *reply = s_reply_new (tracker, &content);
+            zlistx_add_end (self->pending, reply);
+            return tracker;
+        }
+        s_lookup_t *lookup = (s_lookup_t *) zmalloc (sizeof (s_lookup_t));
+        assert (lookup);
+        lookup->changes = self->changes;
+        lookup->prefix = prefix;
+        prefix = NULL;
+        zhashx_update (self->lookups, key, lookup);
+    }
+    else
+    //  Cached copy is stale as soon as server applies the change
+    if (self->caching)
+        s_cache_remove (self, cache_key);
+    zstr_free (&cache_key);
+    zstr_free (&prefix);
+    if (streq (command, "LOOKUP"))
+        self->misses++;
+
+    zmsg_t *msg = zmsg_new ();
+    zm_proto_send (request, msg);
+    if (mlm_client_sendto (self->client, self->server, subject, key, self->timeout, &msg) == -1) {
+        zmsg_destroy (&msg);
+        zhashx_delete (self->lookups, key);
+        return 0;
+    }
+    return tracker;
+}
+
+zm_proto_t *
+zm_asset_client_recv (zm_asset_client_t *self, int timeout)
+{
+    assert (self);
+    int64_t deadline = zclock_mono () + timeout;
+    while (zlistx_size (self->pending) == 0) {
+        int64_t wait = -1;
+        if (timeout != -1) {
+            wait = deadline - zclock_mono ();
+            if (wait < 0)
+                return NULL;
+        }
+        if (s_receive (self, (int) wait) == -1)
+            return NULL;
+    }
+    s_reply_t *reply = (s_reply_t *) zlistx_detach (self->pending, NULL);
+    return s_take (self, &reply);
+}
+
+uint64_t
+zm_asset_client_tracker (zm_asset_client_t *self)
+{
+    assert (self);
+    return self->tracker;
+}
+
+uint64_t
+zm_asset_client_hits (zm_asset_client_t *self)
+{
+    assert (self);
+    return self->hits;
+}
+
+uint64_t
+zm_asset_client_misses (zm_asset_client_t *self)
+{
+    assert (self);
+    return self->misses;
+}
+
+size_t
+zm_asset_client_cached (zm_asset_client_t *self)
+{
+    assert (self);
+    return zlistx_size (self->devices);
+}
+
+
+//  --------------------------------------------------------------------------
+//  Self test of this class
+
+void
+zm_asset_client_test (bool verbose)
+{
+    printf (" * zm_asset_client: ");
+
+    //  @selftest
+    static const char *endpoint = "inproc://zm-asset-client-test";
+    zactor_t *server = zactor_new (mlm_server, "Malamute");
+    zstr_sendx (server, "BIND", endpoint, NULL);
+    zactor_t *asset = zactor_new (zm_asset_actor, NULL);
+    zstr_sendx (asset, "CONFIG",
+        "malamute\n"
+        "    endpoint = inproc://zm-asset-client-test\n"
+        "    address = it.zmon.asset.client\n"
+        "    producer = " ZM_PROTO_DEVICE_STREAM "\n"
+        "namespaces\n"
+        "    tenant1\n"
+        "    tenant2\n"
+        "        publish = 0\n",
+        NULL);
+    zstr_sendx (asset, "START", NULL);
+
+    zm_asset_client_t *writer = zm_asset_client_new (endpoint, "client-writer", "it.zmon.asset.client");
+    assert (writer);
+    zm_asset_client_t *self = zm_asset_client_new (endpoint, "client", "it.zmon.asset.client");
+    assert (self);
+
+    zhash_t *ext = zhash_new ();
+    zhash_insert (ext, "site", "prague");
+    zm_proto_t *device = zm_proto_new ();
+    const char *names [] = {"device1", "device2", "device3"};
+    int r, i;
+    for (i = 0; i != 3; i++) {
+        zm_proto_encode_device (device, names [i], zclock_mono (), 1024, ext);
+        r = zm_asset_client_insert (writer, device);
+        assert (r == 0);
+    }
+    r = zm_asset_client_set_cache (self, ZM_PROTO_DEVICE_STREAM, 2);
+    assert (r == 0);
+
+    assert (!zm_asset_client_lookup (self, "device9"));
+    assert (zm_proto_code (zm_asset_client_reply (self)) == 404);
+
+    //  The second lookup is answered from cache
+    zm_proto_t *found = zm_asset_client_lookup (self, "device1");
+    assert (found);
+    assert (streq (zhash_lookup (zm_proto_ext (found), "site"), "prague"));
+    found = zm_asset_client_lookup (self, "device1");
+    assert (found);
+    assert (streq (zm_proto_device (found), "device1"));
+    assert (zm_asset_client_hits (self) == 1);
+    assert (zm_asset_client_misses (self) == 2);
+
+    //  Asynchronous lookups, the least recently used device is dropped
+    uint64_t trackers [3];
+    for (i = 0; i != 3; i++) {
+        zm_proto_encode_device (device, names [i], 0, 0, NULL);
+        trackers [i] = zm_asset_client_send (self, "LOOKUP", device);
+    }
+    bool replied [3] = {false, false, false};
+    for (i = 0; i != 3; i++) {
+        found = zm_asset_client_recv (self, 5000);
+        assert (found);
+        assert (zm_proto_id (found) == ZM_PROTO_DEVICE);
+        int lookup;
+        for (lookup = 0; trackers [lookup] != zm_asset_client_tracker (self); lookup++)
+            assert (lookup < 2);
+        assert (!replied [lookup]);
+        replied [lookup] = true;
+        assert (streq (zm_proto_device (found), names [lookup]));
+    }
+    assert (zm_asset_client_hits (self) == 2);
+    assert (zm_asset_client_misses (self) == 4);
+    assert (zm_asset_client_cached (self) == 2);
+
+    //  Change made by other client comes on stream and drops cached copy
+    zhash_update (ext, "site", "brno");
+    zm_proto_encode_device (device, "device2", zclock_mono (), 1024, ext);
+    r = zm_asset_client_insert (writer, device);
+    assert (r == 0);
+    for (i = 0; i != 100; i++) {
+        found = zm_asset_client_lookup (self, "device2");
+        assert (found);
+        if (streq (zhash_lookup (zm_proto_ext (found), "site"), "brno"))
+            break;
+        zclock_sleep (10);
+    }
+    assert (i != 100);
+    r = zm_asset_client_delete (writer, "device3");
+    assert (r == 0);
+    for (i = 0; i != 100; i++) {
+        if (!zm_asset_client_lookup (self, "device3"))
+            break;
+        zclock_sleep (10);
+    }
+    assert (i != 100);
+
+    //  Devices of namespace are cached apart from default one and changes
+    //  with prefixed subject drop only them
+    assert (zm_asset_client_lookup (self, "device1"));
+    zhash_update (ext, "site", "ostrava");
+    zm_proto_encode_device (device, "device1", zclock_mono (), 1024, ext);
+    zm_asset_client_send (writer, "tenant1/INSERT", device);
+    found = zm_asset_client_recv (writer, 5000);
+    assert (found && zm_proto_id (found) == ZM_PROTO_OK);
+    zm_proto_encode_device (device, "device1", 0, 0, NULL);
+    for (i = 0; i != 2; i++) {
+        zm_asset_client_send (self, "tenant1/LOOKUP", device);
+        found = zm_asset_client_recv (self, 5000);
+        assert (found && zm_proto_id (found) == ZM_PROTO_DEVICE);
+        assert (streq (zhash_lookup (zm_proto_ext (found), "site"), "ostrava"));
+    }
+    uint64_t hits = zm_asset_client_hits (self);
+    found = zm_asset_client_lookup (self, "device1");
+    assert (found);
+    assert (streq (zhash_lookup (zm_proto_ext (found), "site"), "prague"));
+    assert (zm_asset_client_hits (self) == hits + 1);
+    zhash_update (ext, "site", "plzen");
+    zm_proto_encode_device (device, "device1", zclock_mono (), 1024, ext);
+    zm_asset_client_send (writer, "tenant1/INSERT", device);
+    found = zm_asset_client_recv (writer, 5000);
+    assert (found && zm_proto_id (found) == ZM_PROTO_OK);
+    zm_proto_encode_device (device, "device1", 0, 0, NULL);
+    for (i = 0; i != 100; i++) {
+        zm_asset_client_send (self, "tenant1/LOOKUP", device);
+        found = zm_asset_client_recv (self, 5000);
+        assert (found && zm_proto_id (found) == ZM_PROTO_DEVICE);
+        if (streq (zhash_lookup (zm_proto_ext (found), "site"), "plzen"))
+            break;
+        zclock_sleep (10);
+    }
+    assert (i != 100);
+    found = zm_asset_client_lookup (self, "device1");
+    assert (found);
+    assert (streq (zhash_lookup (zm_proto_ext (found), "site"), "prague"));
+
+    //  Namespace which does not publish changes is not cached
+    zm_asset_client_set_cache_namespace (self, "tenant2", false);
+    for (i = 0; i != 2; i++) {
+        zhash_update (ext, "site", i? "plzen": "ostrava");
+        zm_proto_encode_device (device, "device1", zclock_mono (), 1024, ext);
+        zm_asset_client_send (writer, "tenant2/INSERT", device);
+        found = zm_asset_client_recv (writer, 5000);
+        assert (found && zm_proto_id (found) == ZM_PROTO_OK);
+        zm_proto_encode_device (device, "device1", 0, 0, NULL);
+        hits = zm_asset_client_hits (self);
+        zm_asset_client_send (self, "tenant2/LOOKUP", device);
+        found = zm_asset_client_recv (self, 5000);
+        assert (found && zm_proto_id (found) == ZM_PROTO_DEVICE);
+        assert (streq (zhash_lookup (zm_proto_ext (found), "site"), i? "plzen": "ostrava"));
+        assert (zm_asset_client_hits (self) == hits);
+    }
+
+    //  Reply of timed out call is discarded, not returned later
+    zm_asset_client_set_timeout (self, 0);
+    assert (!zm_asset_client_lookup (self, "device9"));
+    assert (!zm_asset_client_reply (self));
+    zm_asset_client_set_timeout (self, 5000);
+    assert (!zm_asset_client_recv (self, 200));
+    if (verbose)
+        zsys_info ("zm_asset_client: %" PRIu64 " hits, %" PRIu64 " misses",
+            zm_asset_client_hits (self), zm_asset_client_misses (self));
+
+    zm_proto_destroy (&device);
+    zhash_destroy (&ext);
+    zm_asset_client_destroy (&self);
+    zm_asset_client_destroy (&writer);
+    zstr_sendx (asset, "STOP", NULL);
+    zactor_destroy (&asset);
+    zactor_destroy (&server);
+    //  @end
+    printf ("OK\n");
+}
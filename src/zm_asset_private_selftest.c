@@ -30,6 +30,12 @@ zm_asset_private_selftest (bool verbose)
 {
 // Tests for stable private classes:
     zm_devices_test (verbose);
+    zm_bloom_test (verbose);
+    zm_watches_test (verbose);
+    zm_digest_test (verbose);
+    zm_journal_test (verbose);
+    zm_index_test (verbose);
+    zm_aggregate_test (verbose);
 }
 /*
 ################################################################################
@@ -0,0 +1,350 @@
+/*  =========================================================================
+    zm_asset_replay - Replay captured traffic against inproc actor
+
+    Copyright (c) the Contributors as noted in the AUTHORS file.  This file is part
+    of zmon.it, the fast and scalable monitoring system.                           
+                                                                                   
+    This Source Code Form is subject to the terms of the Mozilla Public License, v.
+    2.0. If a copy of the MPL was not distributed with this file, You can obtain   
+    one at http://mozilla.org/MPL/2.0/.                                            
+    =========================================================================
+*/
+
+/*
+@header
+    zm_asset_replay - Replay captured traffic against inproc actor
+@discuss
+    Reads file captured by zm_asset actor (see CAPTURE there) and sends its
+    requests to zm_asset actor running with malamute broker inside this
+    process. Every captured sender gets its own client with the same
+    address, so rate limits and scheduling see the same senders as in
+    production. Requests keep captured pacing divided by speed, speed 0
+    (max) sends them as fast as possible. When all replies arrive, number
+    of requests, throughput and latency percentiles are printed.
+
+    Actor configuration can be given by -c, its malamute endpoint is
+    replaced by inproc one and capturing is disabled.
+
+    Every request is sent with its sequence number of the sender as
+    tracker, so replies are matched to requests even when reads overtake
+    writes.
+@end
+*/
+
+#include "zm_asset_classes.h"
+
+#define ZM_ASSET_REPLAY_ENDPOINT "inproc://zm-asset-replay"
+#define ZM_ASSET_REPLAY_MAGIC "ZMCAP1\n"
+
+//  How long to wait for outstanding replies after the last request, msec
+#define ZM_ASSET_REPLAY_LINGER 5000
+
+//  One record of capture file
+
+typedef struct {
+    FILE *handle;               //  Capture file
+    int64_t time;               //  Arrival of request, usec
+    char sender [256];          //  Sender of request
+    char subject [256];         //  Subject of request
+    zmsg_t *content;            //  Request
+} s_record_t;
+
+static bool
+s_get_number (FILE *handle, uint64_t *value, size_t size)
+{
+    byte buffer [8];
+    if (fread (buffer, 1, size, handle) != size)
+        return false;
+    *value = 0;
+    size_t i;
+    for (i = 0; i != size; i++)
+        *value = (*value << 8) | buffer [i];
+    return true;
+}
+
+static bool
+s_get_string (FILE *handle, char *string)
+{
+    int size = fgetc (handle);
+    if (size == EOF || fread (string, 1, size, handle) != (size_t) size)
+        return false;
+    string [size] = 0;
+    return true;
+}
+
+//  Read next record, returns -1 at end of file or on truncated record
+
+static int
+s_record_next (s_record_t *self)
+{
+    uint64_t time, size;
+    if (!s_get_number (self->handle, &time, 8)
+    ||  !s_get_string (self->handle, self->sender)
+    ||  !s_get_string (self->handle, self->subject)
+    ||  !s_get_number (self->handle, &size, 4))
+        return -1;
+    zframe_t *frame = zframe_new (NULL, size);
+    assert (frame);
+    if (fread (zframe_data (frame), 1, size, self->handle) != size) {
+        zframe_destroy (&frame);
+        return -1;
+    }
+    self->time = (int64_t) time;
+    self->content = zmsg_decode (frame);
+    zframe_destroy (&frame);
+    return self->content? 0: -1;
+}
+
+//  Client replaying requests of one captured sender
+
+typedef struct {
+    mlm_client_t *client;       //  Connected with address of sender
+    int64_t *sent;              //  Send times of requests, 0 when replied
+    size_t size;                //  Number of sent requests
+    size_t limit;               //  Allocated size of sent
+} s_sender_t;
+
+static s_sender_t *
+s_sender_new (const char *address)
+{
+    s_sender_t *self = (s_sender_t *) zmalloc (sizeof (s_sender_t));
+    assert (self);
+    self->client = mlm_client_new ();
+    assert (self->client);
+    if (mlm_client_connect (self->client, ZM_ASSET_REPLAY_ENDPOINT, 1000, address) == -1)
+        zsys_error ("zm_asset_replay: can't connect sender %s", address);
+    self->limit = 16;
+    self->sent = (int64_t *) zmalloc (self->limit * sizeof (int64_t));
+    assert (self->sent);
+    return self;
+}
+
+static void
+s_sender_destroy (s_sender_t **self_p)
+{
+    assert (self_p);
+    if (*self_p) {
+        s_sender_t *self = *self_p;
+        mlm_client_destroy (&self->client);
+        free (self->sent);
+        free (self);
+        *self_p = NULL;
+    }
+}
+
+//  Store send time of next request, return its sequence number
+
+static size_t
+s_sender_push (s_sender_t *self, int64_t time)
+{
+    if (self->size == self->limit) {
+        self->limit *= 2;
+        self->sent = (int64_t *) realloc (self->sent, self->limit * sizeof (int64_t));
+        assert (self->sent);
+    }
+    self->sent [self->size] = time;
+    return self->size++;
+}
+
+//  Latencies of replied requests
+
+typedef struct {
+    int64_t *values;            //  Latency of each reply, usec
+    size_t size;                //  Number of values
+    size_t limit;               //  Allocated size of values
+} s_latencies_t;
+
+static void
+s_latencies_add (s_latencies_t *self, int64_t value)
+{
+    if (self->size == self->limit) {
+        self->limit = self->limit? self->limit * 2: 1024;
+        self->values = (int64_t *) realloc (self->values, self->limit * sizeof (int64_t));
+        assert (self->values);
+    }
+    self->values [self->size++] = value;
+}
+
+static int
+s_latencies_compare (const void *a, const void *b)
+{
+    int64_t first = *(const int64_t *) a;
+    int64_t second = *(const int64_t *) b;
+    return first < second? -1: first > second;
+}
+
+static int64_t
+s_latencies_percentile (s_latencies_t *self, double percentile)
+{
+    if (!self->size)
+        return 0;
+    size_t index = (size_t) (percentile * (self->size - 1) / 100.0);
+    return self->values [index];
+}
+
+//  Receive replies until timeout, msec. Returns false if nothing arrived.
+
+static bool
+s_receive (zpoller_t *poller, zhashx_t *senders, s_latencies_t *latencies, int timeout)
+{
+    void *which = zpoller_wait (poller, timeout);
+    if (!which)
+        return false;
+    s_sender_t *sender = (s_sender_t *) zhashx_first (senders);
+    while (sender && (void *) mlm_client_msgpipe (sender->client) != which)
+        sender = (s_sender_t *) zhashx_next (senders);
+    if (!sender)
+        return false;
+    zmsg_t *reply = mlm_client_recv (sender->client);
+    zmsg_destroy (&reply);
+    //  Notifications of watches are not replies, they come without tracker
+    const char *tracker = mlm_client_tracker (sender->client);
+    if (tracker && *tracker) {
+        size_t sequence = (size_t) strtoul (tracker, NULL, 10);
+        if (sequence < sender->size && sender->sent [sequence]) {
+            s_latencies_add (latencies, zclock_usecs () - sender->sent [sequence]);
+            sender->sent [sequence] = 0;
+        }
+    }
+    return true;
+}
+
+int main (int argc, char *argv [])
+{
+    bool verbose = false;
+    double speed = 1.0;
+    const char *config_file = NULL;
+    const char *capture_file = NULL;
+    int argn;
+    for (argn = 1; argn < argc; argn++) {
+        if (streq (argv [argn], "--help")
+        ||  streq (argv [argn], "-h")) {
+            puts ("zm_asset_replay [options] capture-file");
+            puts ("  --speed / -s N         replay N times faster, 0 or max = as fast as possible");
+            puts ("  --config / -c file     configuration of zm_asset actor");
+            puts ("  --verbose / -v         verbose output");
+            puts ("  --help / -h            this information");
+            return 0;
+        }
+        else
+        if (streq (argv [argn], "--verbose")
+        ||  streq (argv [argn], "-v"))
+            verbose = true;
+        else
+        if ((streq (argv [argn], "--speed")
+        ||   streq (argv [argn], "-s")) && argn + 1 < argc) {
+            argn++;
+            speed = streq (argv [argn], "max")? 0: atof (argv [argn]);
+        }
+        else
+        if ((streq (argv [argn], "--config")
+        ||   streq (argv [argn], "-c")) && argn + 1 < argc)
+            config_file = argv [++argn];
+        else
+        if (argv [argn][0] != '-' && !capture_file)
+            capture_file = argv [argn];
+        else {
+            printf ("Unknown option: %s\n", argv [argn]);
+            return 1;
+        }
+    }
+    if (!capture_file) {
+        puts ("zm_asset_replay: capture file is missing, see --help");
+        return 1;
+    }
+
+    s_record_t record;
+    memset (&record, 0, sizeof (record));
+    record.handle = fopen (capture_file, "rb");
+    char magic [sizeof (ZM_ASSET_REPLAY_MAGIC)] = "";
+    if (!record.handle
+    ||  fread (magic, 1, strlen (ZM_ASSET_REPLAY_MAGIC), record.handle) != strlen (ZM_ASSET_REPLAY_MAGIC)
+    ||  !streq (magic, ZM_ASSET_REPLAY_MAGIC)) {
+        zsys_error ("zm_asset_replay: %s is not capture file", capture_file);
+        if (record.handle)
+            fclose (record.handle);
+        return 1;
+    }
+
+    zconfig_t *config = config_file? zconfig_load (config_file): zconfig_new ("root", NULL);
+    if (!config) {
+        zsys_error ("zm_asset_replay: can't load %s", config_file);
+        fclose (record.handle);
+        return 1;
+    }
+    char *address = strdup (zconfig_resolve (config, "malamute/address", "it.zmon.asset"));
+    zconfig_put (config, "malamute/endpoint", ZM_ASSET_REPLAY_ENDPOINT);
+    zconfig_put (config, "malamute/address", address);
+    zconfig_put (config, "server/capture/file", "");
+    char *str_config = zconfig_str_save (config);
+    zconfig_destroy (&config);
+
+    zactor_t *server = zactor_new (mlm_server, "Malamute");
+    zstr_sendx (server, "BIND", ZM_ASSET_REPLAY_ENDPOINT, NULL);
+    zactor_t *asset = zactor_new (zm_asset_actor, NULL);
+    if (verbose)
+        zstr_sendx (asset, "VERBOSE", NULL);
+    zstr_sendx (asset, "CONFIG", str_config, NULL);
+    zstr_sendx (asset, "START", NULL);
+    zstr_free (&str_config);
+
+    zhashx_t *senders = zhashx_new ();
+    zhashx_set_destructor (senders, (zhashx_destructor_fn *) s_sender_destroy);
+    zpoller_t *poller = zpoller_new (NULL);
+    s_latencies_t latencies = {NULL, 0, 0};
+    size_t requests = 0;
+    int64_t first = -1;
+    int64_t start = zclock_usecs ();
+
+    while (s_record_next (&record) == 0) {
+        if (first == -1)
+            first = record.time;
+        if (speed > 0) {
+            //  Serve replies while waiting for the time of request
+            int64_t due = start + (int64_t) ((record.time - first) / speed);
+            int64_t now = zclock_usecs ();
+            while (now < due) {
+                s_receive (poller, senders, &latencies, (int) ((due - now + 999) / 1000));
+                now = zclock_usecs ();
+            }
+        }
+        s_sender_t *sender = (s_sender_t *) zhashx_lookup (senders, record.sender);
+        if (!sender) {
+            sender = s_sender_new (record.sender);
+            zhashx_insert (senders, record.sender, sender);
+            zpoller_add (poller, mlm_client_msgpipe (sender->client));
+        }
+        char tracker [32];
+        snprintf (tracker, sizeof (tracker), "%zu", s_sender_push (sender, zclock_usecs ()));
+        mlm_client_sendto (sender->client, address, record.subject, tracker, 1000, &record.content);
+        zmsg_destroy (&record.content);
+        requests++;
+        while (s_receive (poller, senders, &latencies, 0))
+            ;
+    }
+    fclose (record.handle);
+    while (latencies.size < requests
+    &&     s_receive (poller, senders, &latencies, ZM_ASSET_REPLAY_LINGER))
+        ;
+    int64_t duration = zclock_usecs () - start;
+
+    qsort (latencies.values, latencies.size, sizeof (int64_t), s_latencies_compare);
+    printf ("zm_asset_replay: %zu requests of %zu senders in %.3f s, %.0f requests/s\n",
+        requests, zhashx_size (senders), duration / 1e6,
+        duration? requests * 1e6 / duration: 0.0);
+    printf ("zm_asset_replay: latency p50=%" PRIi64 " p90=%" PRIi64 " p99=%" PRIi64
+        " max=%" PRIi64 " usec, %zu requests without reply\n",
+        s_latencies_percentile (&latencies, 50),
+        s_latencies_percentile (&latencies, 90),
+        s_latencies_percentile (&latencies, 99),
+        s_latencies_percentile (&latencies, 100),
+        requests - latencies.size);
+
+    free (latencies.values);
+    zpoller_destroy (&poller);
+    zhashx_destroy (&senders);
+    zactor_destroy (&asset);
+    zactor_destroy (&server);
+    zstr_free (&address);
+    return 0;
+}
@@ -30,6 +30,7 @@ all_tests [] = {
 #ifdef ZM_ASSET_BUILD_DRAFT_API
 // Tests for draft public classes:
     { "zm_asset", zm_asset_test },
+    { "zm_asset_client", zm_asset_client_test },
 #endif // ZM_ASSET_BUILD_DRAFT_API
 #ifdef ZM_ASSET_BUILD_DRAFT_API
     { "private_classes", zm_asset_private_selftest },
@@ -91,7 +92,7 @@ main (int argc, char **argv)
         else
         if (streq (argv [argn], "--number")
         ||  streq (argv [argn], "-n")) {
-            puts ("2");
+            puts ("3");
             return 0;
         }
         else
@@ -99,6 +100,7 @@ main (int argc, char **argv)
         ||  streq (argv [argn], "-l")) {
             puts ("Available tests:");
             puts ("    zm_asset\t\t- draft");
+            puts ("    zm_asset_client\t- draft");
             puts ("    private_classes\t- draft");
             return 0;
         }
@@ -0,0 +1,191 @@
+/*  =========================================================================
+    zm_bloom - Bloom filter of device names
+
+    Copyright (c) the Contributors as noted in the AUTHORS file.  This file is part
+    of zmon.it, the fast and scalable monitoring system.                           
+                                                                                   
+    This Source Code Form is subject to the terms of the Mozilla Public License, v.
+    2.0. If a copy of the MPL was not distributed with this file, You can obtain   
+    one at http://mozilla.org/MPL/2.0/.                                            
+    =========================================================================
+*/
+
+/*
+@header
+    zm_bloom - Bloom filter of device names
+@discuss
+    Answers definite misses without touching the device index. Filter can't
+    forget keys, so owner rebuilds it when too many keys were deleted or
+    when it grows over its capacity.
+@end
+*/
+
+#include "zm_asset_classes.h"
+
+//  Structure of our class
+
+struct _zm_bloom_t {
+    uint64_t *bits;             //  Bit array
+    size_t nbits;               //  Size of bit array
+    size_t set;                 //  Bits set to one
+    size_t capacity;            //  Keys filter was sized for
+    size_t size;                //  Keys inserted
+};
+
+//  10 bits per key and 7 hashes give about 1% of false positives at full
+//  capacity
+#define ZM_BLOOM_BITS_PER_KEY 10
+#define ZM_BLOOM_HASHES 7
+
+//  FNV-1a gives first hash, second one is derived by finalizer of
+//  MurmurHash3, filter then uses h1 + i * h2 as i-th hash
+
+static void
+s_bloom_hash (const char *key, uint64_t *h1, uint64_t *h2)
+{
+    *h1 = zm_hash_fnv (ZM_HASH_FNV_BASIS, key);
+    *h2 = zm_hash_mix (*h1) | 1;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Create a new zm_bloom
+
+zm_bloom_t *
+zm_bloom_new (size_t capacity)
+{
+    zm_bloom_t *self = (zm_bloom_t *) zmalloc (sizeof (zm_bloom_t));
+    assert (self);
+    if (capacity < 64)
+        capacity = 64;
+    self->capacity = capacity;
+    self->nbits = (capacity * ZM_BLOOM_BITS_PER_KEY + 63) & ~(size_t) 63;
+    self->bits = (uint64_t *) zmalloc (self->nbits / 8);
+    assert (self->bits);
+    return self;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Destroy the zm_bloom
+
+void
+zm_bloom_destroy (zm_bloom_t **self_p)
+{
+    assert (self_p);
+    if (*self_p) {
+        zm_bloom_t *self = *self_p;
+        free (self->bits);
+        free (self);
+        *self_p = NULL;
+    }
+}
+
+void
+zm_bloom_insert (zm_bloom_t *self, const char *key)
+{
+    assert (self);
+    assert (key);
+    uint64_t h1, h2;
+    s_bloom_hash (key, &h1, &h2);
+    size_t i;
+    for (i = 0; i != ZM_BLOOM_HASHES; i++) {
+        size_t bit = (size_t) ((h1 + i * h2) % self->nbits);
+        uint64_t mask = 1ULL << (bit % 64);
+        if (!(self->bits [bit / 64] & mask)) {
+            self->bits [bit / 64] |= mask;
+            self->set++;
+        }
+    }
+    self->size++;
+}
+
+bool
+zm_bloom_exists (zm_bloom_t *self, const char *key)
+{
+    assert (self);
+    assert (key);
+    uint64_t h1, h2;
+    s_bloom_hash (key, &h1, &h2);
+    size_t i;
+    for (i = 0; i != ZM_BLOOM_HASHES; i++) {
+        size_t bit = (size_t) ((h1 + i * h2) % self->nbits);
+        if (!(self->bits [bit / 64] & (1ULL << (bit % 64))))
+            return false;
+    }
+    return true;
+}
+
+size_t
+zm_bloom_size (zm_bloom_t *self)
+{
+    assert (self);
+    return self->size;
+}
+
+size_t
+zm_bloom_capacity (zm_bloom_t *self)
+{
+    assert (self);
+    return self->capacity;
+}
+
+double
+zm_bloom_fp_rate (zm_bloom_t *self)
+{
+    assert (self);
+    //  Probability that all k probed bits are set
+    double fill = (double) self->set / self->nbits;
+    double rate = 1;
+    size_t i;
+    for (i = 0; i != ZM_BLOOM_HASHES; i++)
+        rate *= fill;
+    return rate;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Self test of this class
+
+void
+zm_bloom_test (bool verbose)
+{
+    printf (" * zm_bloom: ");
+
+    //  @selftest
+    zm_bloom_t *self = zm_bloom_new (10000);
+    assert (self);
+    assert (zm_bloom_capacity (self) == 10000);
+    assert (!zm_bloom_exists (self, "device1"));
+
+    char name [32];
+    int i;
+    for (i = 0; i != 10000; i++) {
+        snprintf (name, sizeof (name), "device%d", i);
+        zm_bloom_insert (self, name);
+    }
+    assert (zm_bloom_size (self) == 10000);
+
+    //  No false negatives
+    for (i = 0; i != 10000; i++) {
+        snprintf (name, sizeof (name), "device%d", i);
+        assert (zm_bloom_exists (self, name));
+    }
+
+    //  False positive rate close to requested one
+    int positives = 0;
+    for (i = 0; i != 10000; i++) {
+        snprintf (name, sizeof (name), "missing%d", i);
+        if (zm_bloom_exists (self, name))
+            positives++;
+    }
+    if (verbose)
+        zsys_debug ("zm_bloom: measured fp rate=%.4f, estimated=%.4f",
+            positives / 10000.0, zm_bloom_fp_rate (self));
+    assert (positives < 300);
+    assert (zm_bloom_fp_rate (self) < 0.02);
+
+    zm_bloom_destroy (&self);
+    //  @end
+    printf ("OK\n");
+}
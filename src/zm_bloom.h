@@ -0,0 +1,60 @@
+/*  =========================================================================
+    zm_bloom - Bloom filter of device names
+
+    Copyright (c) the Contributors as noted in the AUTHORS file.  This file is part
+    of zmon.it, the fast and scalable monitoring system.                           
+                                                                                   
+    This Source Code Form is subject to the terms of the Mozilla Public License, v.
+    2.0. If a copy of the MPL was not distributed with this file, You can obtain   
+    one at http://mozilla.org/MPL/2.0/.                                            
+    =========================================================================
+*/
+
+#ifndef ZM_BLOOM_H_INCLUDED
+#define ZM_BLOOM_H_INCLUDED
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//  @interface
+//  Create a new zm_bloom sized for capacity keys, it gives about 1% of false
+//  positives when full
+ZM_ASSET_PRIVATE zm_bloom_t *
+    zm_bloom_new (size_t capacity);
+
+//  Destroy the zm_bloom
+ZM_ASSET_PRIVATE void
+    zm_bloom_destroy (zm_bloom_t **self_p);
+
+//  Add key to the filter
+ZM_ASSET_PRIVATE void
+    zm_bloom_insert (zm_bloom_t *self, const char *key);
+
+//  Return false if key was never inserted, true if it might have been
+ZM_ASSET_PRIVATE bool
+    zm_bloom_exists (zm_bloom_t *self, const char *key);
+
+//  Return number of keys inserted
+ZM_ASSET_PRIVATE size_t
+    zm_bloom_size (zm_bloom_t *self);
+
+//  Return number of keys filter was sized for
+ZM_ASSET_PRIVATE size_t
+    zm_bloom_capacity (zm_bloom_t *self);
+
+//  Return estimated false positive rate for keys inserted so far
+ZM_ASSET_PRIVATE double
+    zm_bloom_fp_rate (zm_bloom_t *self);
+
+//  Self test of this class
+ZM_ASSET_PRIVATE void
+    zm_bloom_test (bool verbose);
+
+//  @end
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -14,129 +14,1534 @@
 @header
     zm_devices - Devices API
 @discuss
+    Devices are persisted as ZPL file with one top-level entry per device.
+    The file is read entry by entry, so loading never builds zconfig_t tree
+    of the whole inventory.
+
+    Snapshot can be split to shard files file.0 ... file.N-1 by hash of
+    device name. Shards are written and loaded by worker threads in
+    parallel, and store writes again only shards with changed devices.
+    Load finds out layout of snapshot from files present, when both single
+    file and shards exist after layout change was interrupted, the newer
+    one is loaded. Store of complete snapshot removes files of the other
+    layout.
 @end
 */
 
-#include "zm_asset_classes.h"
+#include "zm_asset_classes.h"
+
+//  Device kept in the store with its bookkeeping. Evicted record keeps only
+//  position of device in snapshot, so device can be loaded back on lookup.
+//  Records are linked in order of time of update, see zm_devices_stale.
+
+//  Device encoded by zm_proto_send, shared by frames of LOOKUP replies. It
+//  is freed by the last of store and frames, which libzmq can release in
+//  its I/O thread.
+
+typedef struct {
+    uint32_t references;        //  Store and frames sharing the buffer
+    zframe_t *frame;            //  Encoded device
+} s_encoded_t;
+
+static s_encoded_t *
+s_encoded_new (zm_proto_t *device)
+{
+    zmsg_t *msg = zmsg_new ();
+    zm_proto_send (device, msg);
+    assert (zmsg_size (msg) == 1);
+    s_encoded_t *self = (s_encoded_t *) zmalloc (sizeof (s_encoded_t));
+    assert (self);
+    self->references = 1;
+    self->frame = zmsg_pop (msg);
+    zmsg_destroy (&msg);
+    return self;
+}
+
+static void
+s_encoded_release (s_encoded_t *self)
+{
+    if (__atomic_sub_fetch (&self->references, 1, __ATOMIC_ACQ_REL) == 0) {
+        zframe_destroy (&self->frame);
+        free (self);
+    }
+}
+
+#ifdef CZMQ_BUILD_DRAFT_API
+//  Destructor of frame sharing encoded device
+static void
+s_encoded_free (void **hint)
+{
+    s_encoded_release ((s_encoded_t *) *hint);
+    *hint = NULL;
+}
+#endif
+
+typedef struct _record_t {
+    zm_proto_t *device;         //  Device, NULL if evicted
+    s_encoded_t *encoded;       //  Device encoded for replies, NULL if not yet
+    size_t size;                //  Estimated memory used by device, bytes
+    bool referenced;            //  Looked up since eviction passed it
+    bool dirty;                 //  Changed since it was stored
+    uint16_t shard;             //  Snapshot file of offset, see s_shard_path
+    long offset;                //  Position in snapshot, -1 = not stored
+    long stored;                //  Position in snapshot being written
+    void *handle;               //  Position in eviction queue, NULL if evicted
+    uint64_t digest;            //  Content hash of device, see zm_digest
+    uint64_t version;           //  Version of device, see ZM_DEVICES_VERSION
+    const char *name;           //  Name of device, owned by index
+    uint64_t time;              //  Time of last update of device
+    struct _record_t *older;    //  Previous record in order of time
+    struct _record_t *newer;    //  Next record in order of time
+} s_record_t;
+
+//  Memory used by record itself and by hash item, estimate
+#define ZM_DEVICES_RECORD_OVERHEAD (sizeof (s_record_t) + 64)
+
+//  Memory used by zm_proto_t, its hash of ext and their items, estimate
+#define ZM_DEVICES_PROTO_OVERHEAD 256
+#define ZM_DEVICES_EXT_OVERHEAD 64
+
+//  Default depth of digest tree, 1024 buckets
+#define ZM_DEVICES_DIGEST_DEPTH 10
+
+static size_t
+s_device_size (zm_proto_t *device)
+{
+    size_t size = ZM_DEVICES_PROTO_OVERHEAD + strlen (zm_proto_device (device)) + 1;
+    zhash_t *ext = zm_proto_ext (device);
+    if (ext) {
+        const char *value = (const char *) zhash_first (ext);
+        while (value) {
+            size += ZM_DEVICES_EXT_OVERHEAD + strlen (zhash_cursor (ext)) + strlen (value) + 2;
+            value = (const char *) zhash_next (ext);
+        }
+    }
+    return size;
+}
+
+static uint64_t
+s_device_version (zm_proto_t *device)
+{
+    zhash_t *ext = zm_proto_ext (device);
+    const char *version = ext? (const char *) zhash_lookup (ext, ZM_DEVICES_VERSION): NULL;
+    return version? strtoull (version, NULL, 10): 0;
+}
+
+static void
+s_device_set_version (zm_proto_t *device, uint64_t version)
+{
+    zhash_t *ext = zm_proto_ext (device)? zhash_dup (zm_proto_ext (device)): zhash_new ();
+    assert (ext);
+    zhash_autofree (ext);
+    char value [32];
+    snprintf (value, sizeof (value), "%" PRIu64, version);
+    zhash_update (ext, ZM_DEVICES_VERSION, value);
+    zm_proto_encode_device (device,
+        zm_proto_device (device), zm_proto_time (device), zm_proto_ttl (device), ext);
+    zhash_destroy (&ext);
+}
+
+static s_record_t *
+s_record_new (zm_proto_t *device, long offset)
+{
+    s_record_t *self = (s_record_t *) zmalloc (sizeof (s_record_t));
+    assert (self);
+    self->device = device;
+    self->offset = offset;
+    self->dirty = offset == -1;
+    return self;
+}
+
+static void
+s_record_destroy (s_record_t **self_p)
+{
+    assert (self_p);
+    if (*self_p) {
+        s_record_t *self = *self_p;
+        zm_proto_destroy (&self->device);
+        if (self->encoded)
+            s_encoded_release (self->encoded);
+        free (self);
+        *self_p = NULL;
+    }
+}
+
+//  Most shard files of snapshot
+#define ZM_DEVICES_MAX_SHARDS 256
+
+//  Structure of our class
+
+struct _zm_devices_t {
+    zm_index_t *devices;        //  Name -> s_record_t
+    char *file;
+    bool fsync;                 //  fsync snapshot before rename
+    zm_journal_t *journal;      //  Changes since last store, or NULL
+    uint64_t replayed;          //  Changes replayed on load, left in journal file
+    char *snapshot;             //  File record offsets point to
+    size_t snapshot_shards;     //  Shard files of snapshot, 0 = single file
+    FILE *snapshot_handles [ZM_DEVICES_MAX_SHARDS];
+                                //  Snapshot files opened for reloads
+    size_t shards;              //  Shard files to store, 0 or 1 = single file
+    size_t store_workers;       //  Shards written at once
+    bool changed [ZM_DEVICES_MAX_SHARDS];
+                                //  Shards to write again by next store
+    uint64_t shards_written;    //  Shard files written by store
+    zlistx_t *queue;            //  Resident records, eviction goes from head
+    size_t max_entries;         //  Limit of resident devices, 0 = unlimited
+    size_t max_memory;          //  Limit of memory, 0 = unlimited
+    bool persisted_only;        //  Evict only devices which can be reloaded
+    size_t memory;              //  Estimated memory used by devices
+    uint64_t evictions;         //  Devices evicted
+    uint64_t reloads;           //  Evicted devices loaded back by lookup
+    zm_digest_t *digest;        //  Hash tree over devices
+    zm_bloom_t *filter;         //  Names of devices, answers definite misses
+    zm_aggregate_t *aggregate;  //  Counts of devices by attributes, or NULL
+    size_t deleted;             //  Deletes since filter was built
+    uint64_t lookups;           //  Number of lookups
+    uint64_t hits;              //  Lookups which found device
+    uint64_t filtered;          //  Misses answered by filter
+    uint64_t false_positives;   //  Misses filter did not recognize
+    uint64_t inserts;           //  Number of inserts
+    uint64_t refreshed;         //  Inserts which only refreshed time/ttl
+    uint64_t allocations;       //  Devices duplicated by inserts
+    uint64_t encodings;         //  Devices encoded for replies
+    s_record_t *oldest;         //  Least recently updated record
+    s_record_t *newest;         //  Most recently updated record
+    bool loading;               //  Records are sorted by time after load
+    uint64_t version;           //  Highest version given to device
+};
+
+
+//  --------------------------------------------------------------------------
+//  Streaming ZPL reader
+//
+//  Snapshot is a sequence of top-level ZPL entries, one per device. Reader
+//  collects lines of one entry at a time and parses only that fragment, so
+//  we never hold more than a single device as zconfig_t tree in memory.
+
+typedef struct {
+    FILE *handle;               //  Snapshot file
+    long end;                   //  Stop at first entry starting here, -1 = EOF
+    char *line;                 //  Lookahead line
+    size_t line_size;           //  Allocated size of line
+    ssize_t line_len;           //  Length of lookahead line, -1 = EOF
+    long line_offset;           //  Offset of lookahead line in file
+    char *entry;                //  Text of current entry
+    size_t entry_size;          //  Allocated size of entry
+    size_t entry_len;           //  Length of text in entry
+    long entry_offset;          //  Offset of current entry in file
+} s_zpl_reader_t;
+
+//  Entry starts by a line with non-indented name
+static bool
+s_zpl_entry_start (const char *line, ssize_t len)
+{
+    return len > 0 && !isspace ((unsigned char) line [0]) && line [0] != '#';
+}
+
+static void
+s_zpl_reader_readln (s_zpl_reader_t *self)
+{
+    self->line_offset = ftell (self->handle);
+    self->line_len = getline (&self->line, &self->line_size, self->handle);
+}
+
+//  Position the reader at first entry starting at or after start offset
+static void
+s_zpl_reader_init (s_zpl_reader_t *self, FILE *handle, long start, long end)
+{
+    memset (self, 0, sizeof (s_zpl_reader_t));
+    self->handle = handle;
+    self->end = end;
+    if (start > 0) {
+        //  Skip rest of line we have jumped into
+        fseek (self->handle, start - 1, SEEK_SET);
+        s_zpl_reader_readln (self);
+    }
+    else
+        fseek (self->handle, 0, SEEK_SET);
+    s_zpl_reader_readln (self);
+    while (self->line_len != -1 && !s_zpl_entry_start (self->line, self->line_len))
+        s_zpl_reader_readln (self);
+}
+
+static void
+s_zpl_reader_destroy (s_zpl_reader_t *self)
+{
+    free (self->line);
+    free (self->entry);
+}
+
+static void
+s_zpl_reader_append (s_zpl_reader_t *self)
+{
+    if (self->entry_len + self->line_len + 1 > self->entry_size) {
+        self->entry_size = (self->entry_len + self->line_len + 1) * 2;
+        self->entry = (char *) realloc (self->entry, self->entry_size);
+        assert (self->entry);
+    }
+    memcpy (self->entry + self->entry_len, self->line, self->line_len + 1);
+    self->entry_len += self->line_len;
+}
+
+//  Return next device from snapshot or NULL if there are no more entries.
+//  Caller owns returned object.
+static zm_proto_t *
+s_zpl_reader_next (s_zpl_reader_t *self)
+{
+    while (self->line_len != -1) {
+        if (self->end != -1 && self->line_offset >= self->end)
+            return NULL;
+
+        self->entry_len = 0;
+        self->entry_offset = self->line_offset;
+        s_zpl_reader_append (self);
+        s_zpl_reader_readln (self);
+        while (self->line_len != -1 && !s_zpl_entry_start (self->line, self->line_len)) {
+            s_zpl_reader_append (self);
+            s_zpl_reader_readln (self);
+        }
+
+        zconfig_t *root = zconfig_str_load (self->entry);
+        zconfig_t *item = root? zconfig_child (root): NULL;
+        zm_proto_t *dev = item? zm_proto_new_zpl (item): NULL;
+        zconfig_destroy (&root);
+        if (dev)
+            return dev;
+        zsys_warning ("zm_devices: skipping malformed entry at offset %ld", self->entry_offset);
+    }
+    return NULL;
+}
+
+//  Write device as ZPL entry, only one device is converted to zconfig_t at
+//  the time. Returns -1 on I/O error.
+
+static int
+s_zpl_write (FILE *handle, zm_proto_t *device)
+{
+    zconfig_t *root = zconfig_new ("root", NULL);
+    zm_proto_zpl (device, root);
+    int rc = zconfig_fprint (root, handle);
+    zconfig_destroy (&root);
+    return rc == -1? -1: 0;
+}
+
+//  Return device stored at offset of file, NULL if it can't be read
+
+static zm_proto_t *
+s_zpl_read_at (FILE *handle, long offset)
+{
+    s_zpl_reader_t reader;
+    s_zpl_reader_init (&reader, handle, offset, -1);
+    zm_proto_t *dev = reader.line_offset == offset? s_zpl_reader_next (&reader): NULL;
+    s_zpl_reader_destroy (&reader);
+    return dev;
+}
+
+
+//  Return name of snapshot file, shard files have its index appended.
+//  Caller frees the name.
+
+static char *
+s_shard_path (const char *file, size_t shards, size_t shard)
+{
+    return shards? zsys_sprintf ("%s.%zu", file, shard): strdup (file);
+}
+
+//  Return number of shard files of snapshot on disk
+
+static size_t
+s_shard_files (const char *file)
+{
+    size_t shards = 0;
+    while (shards < ZM_DEVICES_MAX_SHARDS) {
+        char *path = s_shard_path (file, 1, shards);
+        bool exists = zsys_file_exists (path);
+        zstr_free (&path);
+        if (!exists)
+            break;
+        shards++;
+    }
+    return shards;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Store maintenance
+
+//  Return shard of device, FNV-1a hash of name modulo number of shards
+
+static size_t
+s_zm_devices_shard (zm_devices_t *self, const char *name)
+{
+    if (self->shards < 2)
+        return 0;
+    return (size_t) (zm_hash_fnv (ZM_HASH_FNV_BASIS, name) % self->shards);
+}
+
+//  Shard of device must be written again by next store
+
+static void
+s_zm_devices_touch (zm_devices_t *self, const char *name)
+{
+    self->changed [s_zm_devices_shard (self, name)] = true;
+}
+
+//  Build filter again for current devices with room for growth. Filter can't
+//  forget names, so deleted devices only increase false positive rate until
+//  the rebuild.
+
+static void
+s_zm_devices_rebuild_filter (zm_devices_t *self)
+{
+    zm_bloom_destroy (&self->filter);
+    self->filter = zm_bloom_new (zm_index_size (self->devices) * 2);
+    s_record_t *record = (s_record_t *) zm_index_first (self->devices);
+    while (record) {
+        zm_bloom_insert (self->filter, zm_index_cursor (self->devices));
+        record = (s_record_t *) zm_index_next (self->devices);
+    }
+    self->deleted = 0;
+}
+
+//  Read evicted device back from snapshot
+
+static zm_proto_t *
+s_zm_devices_reload (zm_devices_t *self, s_record_t *record)
+{
+    FILE **handle = &self->snapshot_handles [record->shard];
+    if (!*handle) {
+        char *path = s_shard_path (self->snapshot, self->snapshot_shards, record->shard);
+        *handle = fopen (path, "r");
+        zstr_free (&path);
+    }
+    if (!*handle)
+        return NULL;
+    zm_proto_t *device = s_zpl_read_at (*handle, record->offset);
+    //  Device from snapshot without versions got its version on load
+    if (device && record->version && !s_device_version (device))
+        s_device_set_version (device, record->version);
+    return device;
+}
+
+//  Close snapshot files, they are reopened on next reload
+
+static void
+s_zm_devices_close_handles (zm_devices_t *self)
+{
+    size_t shard;
+    for (shard = 0; shard != ZM_DEVICES_MAX_SHARDS; shard++)
+        if (self->snapshot_handles [shard]) {
+            fclose (self->snapshot_handles [shard]);
+            self->snapshot_handles [shard] = NULL;
+        }
+}
+
+//  Forget snapshot file
+
+static void
+s_zm_devices_close_snapshot (zm_devices_t *self)
+{
+    s_zm_devices_close_handles (self);
+    zstr_free (&self->snapshot);
+}
+
+//  Compare record with time and name of other record, ties of time are
+//  ordered by name, so order is total and cursor is unambiguous
+
+static int
+s_record_compare (s_record_t *record, uint64_t time, const char *name)
+{
+    if (record->time != time)
+        return record->time < time? -1: 1;
+    return strcmp (record->name, name);
+}
+
+static int
+s_record_sort (const void *a, const void *b)
+{
+    s_record_t *first = *(s_record_t **) a;
+    s_record_t *second = *(s_record_t **) b;
+    return s_record_compare (first, second->time, second->name);
+}
+
+//  Take record out of order of time
+
+static void
+s_zm_devices_unlink (zm_devices_t *self, s_record_t *record)
+{
+    if (record->older)
+        record->older->newer = record->newer;
+    else
+    if (self->oldest == record)
+        self->oldest = record->newer;
+    if (record->newer)
+        record->newer->older = record->older;
+    else
+    if (self->newest == record)
+        self->newest = record->older;
+    record->older = NULL;
+    record->newer = NULL;
+}
+
+//  Set time of update of record and move it to its place in order of time.
+//  Devices are mostly updated to current time, so place is searched from
+//  the newest end and it is usually found at once. Loader just appends,
+//  snapshot is not ordered by time and it is sorted at the end.
+
+static void
+s_zm_devices_age (zm_devices_t *self, s_record_t *record, uint64_t time)
+{
+    s_zm_devices_unlink (self, record);
+    record->time = time;
+    s_record_t *older = self->newest;
+    if (!self->loading)
+        while (older && s_record_compare (older, time, record->name) > 0)
+            older = older->older;
+    record->older = older;
+    record->newer = older? older->newer: self->oldest;
+    if (record->newer)
+        record->newer->older = record;
+    else
+        self->newest = record;
+    if (older)
+        older->newer = record;
+    else
+        self->oldest = record;
+}
+
+//  Sort records by time after load
+
+static void
+s_zm_devices_sort (zm_devices_t *self)
+{
+    size_t size = zm_index_size (self->devices);
+    if (size < 2)
+        return;
+    s_record_t **records = (s_record_t **) malloc (size * sizeof (s_record_t *));
+    assert (records);
+    size_t index = 0;
+    s_record_t *record;
+    for (record = self->oldest; record; record = record->newer)
+        records [index++] = record;
+    assert (index == size);
+    qsort (records, size, sizeof (s_record_t *), s_record_sort);
+    for (index = 0; index != size; index++) {
+        records [index]->older = index? records [index - 1]: NULL;
+        records [index]->newer = index + 1 < size? records [index + 1]: NULL;
+    }
+    self->oldest = records [0];
+    self->newest = records [size - 1];
+    free (records);
+}
+
+static bool
+s_zm_devices_over_budget (zm_devices_t *self)
+{
+    return (self->max_entries && zlistx_size (self->queue) > self->max_entries)
+        || (self->max_memory && self->memory > self->max_memory);
+}
+
+//  Make record resident, device is owned by record then
+
+static void
+s_zm_devices_attach (zm_devices_t *self, s_record_t *record, zm_proto_t *device)
+{
+    assert (!record->device);
+    record->device = device;
+    record->size = s_device_size (device);
+    record->referenced = true;
+    record->handle = zlistx_add_end (self->queue, record);
+    self->memory += record->size;
+}
+
+//  Drop device of record, record itself stays in the store
+
+static void
+s_zm_devices_detach (zm_devices_t *self, s_record_t *record)
+{
+    assert (record->device);
+    zlistx_detach (self->queue, record->handle);
+    record->handle = NULL;
+    zm_proto_destroy (&record->device);
+    if (record->encoded) {
+        s_encoded_release (record->encoded);
+        record->encoded = NULL;
+    }
+    self->memory -= record->size;
+    record->size = 0;
+}
+
+//  Encode device of resident record, it is done once until device changes
+
+static void
+s_zm_devices_encode (zm_devices_t *self, s_record_t *record)
+{
+    assert (record->device);
+    if (record->encoded)
+        return;
+    record->encoded = s_encoded_new (record->device);
+    size_t size = zframe_size (record->encoded->frame);
+    record->size += size;
+    self->memory += size;
+    self->encodings++;
+}
+
+//  Drop encoded device of record, device has changed
+
+static void
+s_zm_devices_unencode (zm_devices_t *self, s_record_t *record)
+{
+    if (!record->encoded)
+        return;
+    size_t size = zframe_size (record->encoded->frame);
+    record->size -= size;
+    self->memory -= size;
+    s_encoded_release (record->encoded);
+    record->encoded = NULL;
+}
+
+//  Replace device of record by new one in counts of aggregate. Device of
+//  evicted record is read from snapshot for that.
+
+static void
+s_zm_devices_count (zm_devices_t *self, s_record_t *record, zm_proto_t *device)
+{
+    zm_proto_t *old_device = record->device;
+    if (!old_device && record->offset != -1)
+        old_device = s_zm_devices_reload (self, record);
+    zm_aggregate_update (self->aggregate, old_device, device);
+    if (old_device != record->device)
+        zm_proto_destroy (&old_device);
+}
+
+//  Remove record from the store
+
+static void
+s_zm_devices_remove (zm_devices_t *self, const char *name)
+{
+    s_record_t *record = (s_record_t *) zm_index_lookup (self->devices, name);
+    if (!record)
+        return;
+    if (self->aggregate)
+        s_zm_devices_count (self, record, NULL);
+    if (record->device)
+        s_zm_devices_detach (self, record);
+    self->memory -= ZM_DEVICES_RECORD_OVERHEAD + strlen (name);
+    s_zm_devices_touch (self, name);
+    zm_digest_update (self->digest, name, record->digest, 0);
+    s_zm_devices_unlink (self, record);
+    zm_index_delete (self->devices, name);
+    if (++self->deleted > zm_index_size (self->devices))
+        s_zm_devices_rebuild_filter (self);
+}
+
+//  Evict least recently looked up devices until store fits to budget. It
+//  is clock algorithm in a form of FIFO with second chance: referenced
+//  record at head of queue loses the reference and goes to tail. Record
+//  keep, if any, is never evicted.
+
+static void
+s_zm_devices_evict (zm_devices_t *self, s_record_t *keep)
+{
+    size_t visited = 0;
+    while (s_zm_devices_over_budget (self)
+    &&     visited++ < 2 * zlistx_size (self->queue)) {
+        s_record_t *record = (s_record_t *) zlistx_first (self->queue);
+        bool persisted = self->snapshot && !record->dirty && record->offset != -1;
+        if (record == keep || record->referenced || (self->persisted_only && !persisted)) {
+            record->referenced = false;
+            zlistx_move_end (self->queue, record->handle);
+            continue;
+        }
+        self->evictions++;
+        if (persisted)
+            s_zm_devices_detach (self, record);
+        else
+            //  Name of device is freed by detach, index keeps its own
+            s_zm_devices_remove (self, record->name);
+        visited = 0;
+    }
+}
+
+//  Add device to the store, store takes ownership of it. Offset is position
+//  of device in snapshot, -1 if it is not stored. Returns record of device.
+
+static s_record_t *
+s_zm_devices_put (zm_devices_t *self, zm_proto_t *dev, long offset)
+{
+    const char *name = zm_proto_device (dev);
+    s_record_t *record = (s_record_t *) zm_index_lookup (self->devices, name);
+    if (record) {
+        if (self->aggregate)
+            s_zm_devices_count (self, record, dev);
+        if (record->device)
+            s_zm_devices_detach (self, record);
+        record->offset = offset;
+        record->dirty = offset == -1;
+    }
+    else {
+        if (zm_bloom_size (self->filter) >= zm_bloom_capacity (self->filter))
+            s_zm_devices_rebuild_filter (self);
+        zm_bloom_insert (self->filter, name);
+        record = s_record_new (NULL, offset);
+        zm_index_insert (self->devices, name, record);
+        record->name = zm_index_key (self->devices, name);
+        self->memory += ZM_DEVICES_RECORD_OVERHEAD + strlen (name);
+        if (self->aggregate)
+            zm_aggregate_update (self->aggregate, NULL, dev);
+    }
+    if (offset == -1)
+        s_zm_devices_touch (self, name);
+    s_zm_devices_age (self, record, zm_proto_time (dev));
+    uint64_t digest = zm_digest_hash (dev);
+    zm_digest_update (self->digest, name, record->digest, digest);
+    record->digest = digest;
+    record->version = s_device_version (dev);
+    if (record->version > self->version)
+        self->version = record->version;
+    s_zm_devices_attach (self, record, dev);
+    s_zm_devices_evict (self, record);
+    return record;
+}
+
+//  Forget offsets into previous snapshot when different file or layout is
+//  loaded, evicted devices can't be loaded back anymore
+
+static void
+s_zm_devices_set_snapshot (zm_devices_t *self, const char *file, size_t shards)
+{
+    if (self->snapshot && streq (self->snapshot, file) && self->snapshot_shards == shards)
+        return;
+    if (self->snapshot) {
+        zlistx_t *gone = zlistx_new ();
+        s_record_t *record = (s_record_t *) zm_index_first (self->devices);
+        while (record) {
+            //  Evicted records are removed below, they keep offsets, so
+            //  aggregate can still read them
+            if (!record->device)
+                zlistx_add_end (gone, (void *) zm_index_cursor (self->devices));
+            else {
+                record->offset = -1;
+                record->dirty = true;
+            }
+            record = (s_record_t *) zm_index_next (self->devices);
+        }
+        const char *name = (const char *) zlistx_first (gone);
+        while (name) {
+            s_zm_devices_remove (self, name);
+            name = (const char *) zlistx_next (gone);
+        }
+        zlistx_destroy (&gone);
+        s_zm_devices_close_snapshot (self);
+    }
+    self->snapshot = strdup (file);
+    self->snapshot_shards = shards;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Parallel loader, each worker parses one range of snapshot
+
+typedef struct {
+    const char *file;           //  Snapshot file
+    long start;                 //  Start of range
+    long end;                   //  End of range
+    zlistx_t *records;          //  Devices parsed by worker, with offsets
+} s_zpl_loader_t;
+
+static void
+s_zpl_loader_actor (zsock_t *pipe, void *args)
+{
+    s_zpl_loader_t *loader = (s_zpl_loader_t *) args;
+    zsock_signal (pipe, 0);
+
+    FILE *handle = fopen (loader->file, "r");
+    if (handle) {
+        s_zpl_reader_t reader;
+        s_zpl_reader_init (&reader, handle, loader->start, loader->end);
+        zm_proto_t *dev = s_zpl_reader_next (&reader);
+        while (dev) {
+            zlistx_add_end (loader->records, s_record_new (dev, reader.entry_offset));
+            dev = s_zpl_reader_next (&reader);
+        }
+        s_zpl_reader_destroy (&reader);
+        fclose (handle);
+    }
+    //  Tell the caller we are done, then wait for $TERM
+    zsock_signal (pipe, 0);
+    char *command = zstr_recv (pipe);
+    zstr_free (&command);
+}
+
+//  Put devices parsed by loader to the store and destroy its list
+
+static void
+s_zm_devices_merge (zm_devices_t *self, s_zpl_loader_t *loader, size_t shard)
+{
+    s_record_t *record = (s_record_t *) zlistx_first (loader->records);
+    while (record) {
+        s_record_t *put = s_zm_devices_put (self, record->device, record->offset);
+        put->shard = (uint16_t) shard;
+        free (record);
+        record = (s_record_t *) zlistx_next (loader->records);
+    }
+    zlistx_destroy (&loader->records);
+}
+
+//  Snapshots smaller than this are always read by single thread
+#define ZM_DEVICES_PARALLEL_MIN (1024 * 1024)
+
+static int
+s_zm_devices_load_parallel (zm_devices_t *self, const char *file, long size, size_t workers)
+{
+    s_zpl_loader_t *loaders = (s_zpl_loader_t *) zmalloc (workers * sizeof (s_zpl_loader_t));
+    zactor_t **actors = (zactor_t **) zmalloc (workers * sizeof (zactor_t *));
+    assert (loaders);
+    assert (actors);
+
+    size_t i;
+    for (i = 0; i != workers; i++) {
+        loaders [i].file = file;
+        loaders [i].start = size / (long) workers * (long) i;
+        loaders [i].end = i == workers - 1? -1: size / (long) workers * (long) (i + 1);
+        loaders [i].records = zlistx_new ();
+        actors [i] = zactor_new (s_zpl_loader_actor, &loaders [i]);
+    }
+    //  Merge in order of ranges, so later entries win as in sequential load
+    for (i = 0; i != workers; i++) {
+        zsock_wait (actors [i]);
+        zactor_destroy (&actors [i]);
+        s_zm_devices_merge (self, &loaders [i], 0);
+    }
+    free (actors);
+    free (loaders);
+    s_zm_devices_rebuild_filter (self);
+    return 0;
+}
+
+//  Load shard files of snapshot, each by one worker, up to workers of them
+//  at once
+
+static void
+s_zm_devices_load_shards (zm_devices_t *self, const char *file, size_t shards, size_t workers)
+{
+    s_zpl_loader_t *loaders = (s_zpl_loader_t *) zmalloc (shards * sizeof (s_zpl_loader_t));
+    zactor_t **actors = (zactor_t **) zmalloc (shards * sizeof (zactor_t *));
+    char **paths = (char **) zmalloc (shards * sizeof (char *));
+    assert (loaders);
+    assert (actors);
+    assert (paths);
+    if (workers < 1)
+        workers = 1;
+
+    size_t first, i;
+    for (first = 0; first < shards; first += workers) {
+        size_t last = first + workers < shards? first + workers: shards;
+        for (i = first; i != last; i++) {
+            paths [i] = s_shard_path (file, shards, i);
+            loaders [i].file = paths [i];
+            loaders [i].start = 0;
+            loaders [i].end = -1;
+            loaders [i].records = zlistx_new ();
+            actors [i] = zactor_new (s_zpl_loader_actor, &loaders [i]);
+        }
+        for (i = first; i != last; i++) {
+            zsock_wait (actors [i]);
+            zactor_destroy (&actors [i]);
+            s_zm_devices_merge (self, &loaders [i], i);
+            zstr_free (&paths [i]);
+        }
+    }
+    free (paths);
+    free (actors);
+    free (loaders);
+    s_zm_devices_rebuild_filter (self);
+}
+
+//  Apply change from journal, without journaling it again
+
+static void
+s_zm_devices_apply (void *arg, char op, zm_proto_t *device)
+{
+    zm_devices_t *self = (zm_devices_t *) arg;
+    //  Journaled device keeps version clients were told about
+    if (op == 'I')
+        zm_devices_replicate (self, device);
+    else
+        s_zm_devices_remove (self, zm_proto_device (device));
+}
+
+//  Replay changes journaled after snapshot was stored
+
+static void
+s_zm_devices_replay (zm_devices_t *self, const char *file)
+{
+    char *path = zsys_sprintf ("%s.journal", file);
+    zm_journal_t *journal = self->journal;
+    self->journal = NULL;
+    int count = zm_journal_replay (path, s_zm_devices_apply, self);
+    if (count > 0) {
+        zsys_info ("zm_devices: replayed %d changes from %s", count, path);
+        self->replayed += (uint64_t) count;
+    }
+    self->journal = journal;
+    zstr_free (&path);
+}
+
+//  Give versions to devices loaded from snapshot stored without them, so
+//  none of them is at version 0, which means no device for INSERT and
+//  DELETE. Devices are written with versions by next store.
+
+static void
+s_zm_devices_version_loaded (zm_devices_t *self)
+{
+    s_record_t *record = (s_record_t *) zm_index_first (self->devices);
+    while (record) {
+        if (!record->version) {
+            record->version = ++self->version;
+            if (record->device) {
+                s_zm_devices_unencode (self, record);
+                s_device_set_version (record->device, record->version);
+                self->memory -= record->size;
+                record->size = s_device_size (record->device);
+                self->memory += record->size;
+            }
+            record->dirty = true;
+            s_zm_devices_touch (self, record->name);
+        }
+        record = (s_record_t *) zm_index_next (self->devices);
+    }
+}
+
+//  --------------------------------------------------------------------------
+//  Load devices from ZPL file, using up to workers threads for parsing
+
+int
+zm_devices_load (zm_devices_t *self, const char *file, size_t workers)
+{
+    assert (self);
+    assert (file);
+
+    size_t shards = s_shard_files (file);
+    if (shards && zsys_file_exists (file)) {
+        char *path = s_shard_path (file, shards, 0);
+        if (zsys_file_modified (file) > zsys_file_modified (path))
+            shards = 0;
+        zstr_free (&path);
+    }
+    if (shards) {
+        s_zm_devices_set_snapshot (self, file, shards);
+        self->loading = true;
+        s_zm_devices_load_shards (self, file, shards, workers);
+        self->loading = false;
+        s_zm_devices_sort (self);
+        s_zm_devices_version_loaded (self);
+        s_zm_devices_replay (self, file);
+        return 0;
+    }
+
+    FILE *handle = fopen (file, "r");
+    if (!handle) {
+        //  Crash before the first store leaves just the journal
+        char *journal = zsys_sprintf ("%s.journal", file);
+        bool journaled = zsys_file_exists (journal);
+        zstr_free (&journal);
+        if (journaled) {
+            s_zm_devices_replay (self, file);
+            return 0;
+        }
+        zsys_error ("Fail to load file %s: %s", file, strerror (errno));
+        return -1;
+    }
+    fseek (handle, 0, SEEK_END);
+    long size = ftell (handle);
+
+    s_zm_devices_set_snapshot (self, file, 0);
+    self->loading = true;
+    if (workers > 1 && size >= ZM_DEVICES_PARALLEL_MIN) {
+        fclose (handle);
+        s_zm_devices_load_parallel (self, file, size, workers);
+    }
+    else {
+        s_zpl_reader_t reader;
+        s_zpl_reader_init (&reader, handle, 0, -1);
+        zm_proto_t *dev = s_zpl_reader_next (&reader);
+        while (dev) {
+            s_zm_devices_put (self, dev, reader.entry_offset);
+            dev = s_zpl_reader_next (&reader);
+        }
+        s_zpl_reader_destroy (&reader);
+        fclose (handle);
+        s_zm_devices_rebuild_filter (self);
+    }
+    self->loading = false;
+    s_zm_devices_sort (self);
+    s_zm_devices_version_loaded (self);
+    s_zm_devices_replay (self, file);
+    return 0;
+}
+
+//  --------------------------------------------------------------------------
+//  Create a new zm_device
+zm_devices_t *
+zm_devices_new (const char *file)
+{
+    zm_devices_t *self = (zm_devices_t *) zmalloc (sizeof (zm_devices_t));
+    assert (self);
+    //  Initialize class properties here
+    self->devices = zm_index_new ();
+    assert (self->devices);
+    zm_index_set_destructor (self->devices, (zm_index_destructor_fn *) s_record_destroy);
+    self->queue = zlistx_new ();
+    assert (self->queue);
+    self->digest = zm_digest_new (ZM_DEVICES_DIGEST_DEPTH);
+    self->filter = zm_bloom_new (0);
+    self->store_workers = 1;
+
+    if (!file)
+        return self;
+
+    //  Store stays empty if file can't be read, like the one of the actor
+    self->file = strdup (file);
+    zm_devices_load (self, file, 1);
+    return self;
+}
+
+//  --------------------------------------------------------------------------
+//  Destroy the zm_devices
+int
+zm_devices_store (zm_devices_t *self);
+
+void
+zm_devices_destroy (zm_devices_t **self_p)
+{
+    assert (self_p);
+    if (*self_p) {
+        zm_devices_t *self = *self_p;
+        //  Free class properties here
+
+        zm_journal_destroy (&self->journal);
+        zm_index_destroy (&self->devices);
+        zlistx_destroy (&self->queue);
+        zm_digest_destroy (&self->digest);
+        zm_aggregate_destroy (&self->aggregate);
+        zstr_free (&self->file);
+        s_zm_devices_close_snapshot (self);
+        zm_bloom_destroy (&self->filter);
+        //  Free object itself
+        free (self);
+        *self_p = NULL;
+    }
+}
+
+const char*
+zm_devices_file (zm_devices_t *self)
+{
+    assert (self);
+    return (const char*) self->file;
+}
+
+void
+zm_devices_set_file (zm_devices_t *self, const char *file)
+{
+    assert (self);
+    zstr_free (&self->file);
+    self->file = strdup (file);
+}
+
+void
+zm_devices_set_fsync (zm_devices_t *self, bool fsync)
+{
+    assert (self);
+    self->fsync = fsync;
+}
+
+void
+zm_devices_set_shards (zm_devices_t *self, size_t shards, size_t workers)
+{
+    assert (self);
+    self->shards = shards < ZM_DEVICES_MAX_SHARDS? shards: ZM_DEVICES_MAX_SHARDS;
+    self->store_workers = workers? workers: 1;
+}
+
+void
+zm_devices_set_budget (zm_devices_t *self, size_t entries, size_t memory, bool persisted_only)
+{
+    assert (self);
+    self->max_entries = entries;
+    self->max_memory = memory;
+    self->persisted_only = persisted_only;
+    s_zm_devices_evict (self, NULL);
+}
+
+//  Size of stdio buffer used for writing snapshot
+#define ZM_DEVICES_WRITE_BUFFER (64 * 1024)
+
+//  Complete snapshot is stored to file, remove files of the other layout
+//  and journal of changes snapshot contains now
+
+static void
+s_zm_devices_stored (zm_devices_t *self)
+{
+    size_t stale = 0;
+    if (self->shards > 1) {
+        if (zsys_file_exists (self->file))
+            zsys_file_delete (self->file);
+        stale = self->shards;
+    }
+    while (stale < ZM_DEVICES_MAX_SHARDS) {
+        char *path = s_shard_path (self->file, 1, stale++);
+        bool exists = zsys_file_exists (path);
+        if (exists)
+            zsys_file_delete (path);
+        zstr_free (&path);
+        if (!exists)
+            break;
+    }
+    s_zm_devices_evict (self, NULL);
+
+    //  Journaled changes are in snapshot now
+    self->replayed = 0;
+    if (self->journal)
+        zm_journal_truncate (self->journal);
+    else {
+        char *journal = zsys_sprintf ("%s.journal", self->file);
+        if (zsys_file_exists (journal))
+            zsys_file_delete (journal);
+        zstr_free (&journal);
+    }
+}
+
+static int
+s_zm_devices_store_file (zm_devices_t *self)
+{
+    //  Write to temporary file and rename it, so readers see either old or
+    //  new snapshot, never partially written one
+    char *tmp = zsys_sprintf ("%s.tmp", self->file);
+    FILE *handle = fopen (tmp, "w");
+    if (!handle) {
+        zsys_error ("Fail to store file %s: %s", tmp, strerror (errno));
+        zstr_free (&tmp);
+        return -1;
+    }
+    setvbuf (handle, NULL, _IOFBF, ZM_DEVICES_WRITE_BUFFER);
+
+    int rc = 0;
+    s_record_t *record = (s_record_t *) zm_index_first (self->devices);
+    while (record) {
+        //  Evicted devices are copied over from previous snapshot
+        zm_proto_t *device = record->device;
+        if (!device)
+            device = s_zm_devices_reload (self, record);
+        if (device) {
+            record->stored = ftell (handle);
+            if (s_zpl_write (handle, device) == -1)
+                rc = -1;
+            if (device != record->device)
+                zm_proto_destroy (&device);
+        }
+        else {
+            zsys_error ("Fail to copy device %s from %s",
+                zm_index_cursor (self->devices), self->snapshot);
+            rc = -1;
+        }
+        record = (s_record_t *) zm_index_next (self->devices);
+    }
 
-//  Structure of our class
+    if (fflush (handle) != 0)
+        rc = -1;
+    if (rc == 0 && self->fsync && fsync (fileno (handle)) != 0)
+        rc = -1;
+    if (fclose (handle) != 0)
+        rc = -1;
+    if (rc == 0 && rename (tmp, self->file) != 0)
+        rc = -1;
 
-struct _zm_devices_t {
-    zhashx_t *devices;
-    char *file;
-};
+    if (rc == -1) {
+        zsys_error ("Fail to store file %s: %s", self->file, strerror (errno));
+        zsys_file_delete (tmp);
+    }
+    else {
+        //  Devices can be evicted and loaded from the new snapshot now
+        s_zm_devices_close_snapshot (self);
+        self->snapshot = strdup (self->file);
+        self->snapshot_shards = 0;
+        record = (s_record_t *) zm_index_first (self->devices);
+        while (record) {
+            record->offset = record->stored;
+            record->dirty = false;
+            record->shard = 0;
+            record = (s_record_t *) zm_index_next (self->devices);
+        }
+        s_zm_devices_stored (self);
+    }
+    zstr_free (&tmp);
+    return rc;
+}
 
 
 //  --------------------------------------------------------------------------
-//  Create a new zm_device
-zm_devices_t *
-zm_devices_new (const char *file)
-{
-    zm_devices_t *self = (zm_devices_t *) zmalloc (sizeof (zm_devices_t));
-    assert (self);
-    //  Initialize class properties here
-    self->devices = zhashx_new ();
-    assert (self->devices);
-    zhashx_set_destructor (self->devices, (void(*)(void**)) zm_proto_destroy);
+//  Parallel writer, each worker writes one shard to temporary file. Workers
+//  only read the store, evicted devices are read by their own handles.
 
-    if (!file)
-        return self;
+typedef struct {
+    zm_devices_t *store;        //  Store being saved
+    char *path;                 //  Shard file
+    s_record_t **records;       //  Records of shard
+    size_t size;                //  Number of records
+    int rc;                     //  Result of write, -1 on I/O error
+} s_zpl_writer_t;
 
-    self->file = strdup (file);
-    zconfig_t *root = zconfig_load (file);
-    if (!root) {
-        zsys_error ("Fail to load file %s: %s", file, strerror (errno));
-        goto fail;
+static int
+s_zpl_writer_run (s_zpl_writer_t *self)
+{
+    zm_devices_t *store = self->store;
+    char *tmp = zsys_sprintf ("%s.tmp", self->path);
+    FILE *handle = fopen (tmp, "w");
+    if (!handle) {
+        zsys_error ("Fail to store file %s: %s", tmp, strerror (errno));
+        zstr_free (&tmp);
+        return -1;
     }
+    setvbuf (handle, NULL, _IOFBF, ZM_DEVICES_WRITE_BUFFER);
 
-    zconfig_t *item = zconfig_child (root);
-    while (item) {
-        zm_proto_t *dev = zm_proto_new_zpl (item);
-        zhashx_insert (self->devices, zm_proto_device (dev), (void*) dev);
-        item = zconfig_next (item);
+    FILE *snapshots [ZM_DEVICES_MAX_SHARDS];
+    memset (snapshots, 0, sizeof (snapshots));
+    int rc = 0;
+    size_t index;
+    for (index = 0; index != self->size; index++) {
+        s_record_t *record = self->records [index];
+        zm_proto_t *device = record->device;
+        if (!device) {
+            FILE **snapshot = &snapshots [record->shard];
+            if (!*snapshot) {
+                char *path = s_shard_path (store->snapshot, store->snapshot_shards, record->shard);
+                *snapshot = fopen (path, "r");
+                zstr_free (&path);
+            }
+            device = *snapshot? s_zpl_read_at (*snapshot, record->offset): NULL;
+        }
+        if (device) {
+            record->stored = ftell (handle);
+            if (s_zpl_write (handle, device) == -1)
+                rc = -1;
+            if (device != record->device)
+                zm_proto_destroy (&device);
+        }
+        else {
+            zsys_error ("Fail to copy device %s from %s", record->name, store->snapshot);
+            rc = -1;
+        }
     }
+    for (index = 0; index != ZM_DEVICES_MAX_SHARDS; index++)
+        if (snapshots [index])
+            fclose (snapshots [index]);
 
-    zconfig_destroy (&root);
-    return self;
-fail:
-    zconfig_destroy (&root);
-    zm_devices_destroy (&self);
-    return NULL;
+    if (fflush (handle) != 0)
+        rc = -1;
+    if (rc == 0 && store->fsync && fsync (fileno (handle)) != 0)
+        rc = -1;
+    if (fclose (handle) != 0)
+        rc = -1;
+    if (rc == -1) {
+        zsys_error ("Fail to store file %s: %s", self->path, strerror (errno));
+        zsys_file_delete (tmp);
+    }
+    zstr_free (&tmp);
+    return rc;
 }
 
-//  --------------------------------------------------------------------------
-//  Destroy the zm_devices
-int
-zm_devices_store (zm_devices_t *self);
+static void
+s_zpl_writer_actor (zsock_t *pipe, void *args)
+{
+    s_zpl_writer_t *writer = (s_zpl_writer_t *) args;
+    zsock_signal (pipe, 0);
+    writer->rc = s_zpl_writer_run (writer);
+    //  Tell the caller we are done, then wait for $TERM
+    zsock_signal (pipe, 0);
+    char *command = zstr_recv (pipe);
+    zstr_free (&command);
+}
 
-void
-zm_devices_destroy (zm_devices_t **self_p)
+//  Write changed shards by workers. Shards are renamed over old ones only
+//  when all of them were written, workers may still read old files of
+//  other shards till then.
+
+static int
+s_zm_devices_store_shards (zm_devices_t *self)
 {
-    assert (self_p);
-    if (*self_p) {
-        zm_devices_t *self = *self_p;
-        //  Free class properties here
+    size_t shards = self->shards;
+    size_t shard;
+    //  Snapshot of other file or layout is written whole
+    if (!self->snapshot || !streq (self->snapshot, self->file) || self->snapshot_shards != shards)
+        for (shard = 0; shard != shards; shard++)
+            self->changed [shard] = true;
 
-        zhashx_destroy (&self->devices);
-        zstr_free (&self->file);
-        zhashx_destroy (&self->devices);
-        //  Free object itself
-        free (self);
-        *self_p = NULL;
+    s_zpl_writer_t *writers = (s_zpl_writer_t *) zmalloc (shards * sizeof (s_zpl_writer_t));
+    zactor_t **actors = (zactor_t **) zmalloc (shards * sizeof (zactor_t *));
+    assert (writers);
+    assert (actors);
+    s_record_t *record = (s_record_t *) zm_index_first (self->devices);
+    while (record) {
+        writers [s_zm_devices_shard (self, record->name)].size++;
+        record = (s_record_t *) zm_index_next (self->devices);
+    }
+    for (shard = 0; shard != shards; shard++) {
+        writers [shard].store = self;
+        writers [shard].path = s_shard_path (self->file, shards, shard);
+        writers [shard].records = (s_record_t **) zmalloc ((writers [shard].size + 1) * sizeof (s_record_t *));
+        assert (writers [shard].records);
+        writers [shard].size = 0;
+    }
+    record = (s_record_t *) zm_index_first (self->devices);
+    while (record) {
+        s_zpl_writer_t *writer = &writers [s_zm_devices_shard (self, record->name)];
+        writer->records [writer->size++] = record;
+        record = (s_record_t *) zm_index_next (self->devices);
+    }
+
+    //  Up to store_workers shards are written at once
+    size_t first = 0;
+    while (first != shards) {
+        size_t last, running = 0;
+        for (last = first; last != shards && running < self->store_workers; last++)
+            if (self->changed [last]) {
+                actors [last] = zactor_new (s_zpl_writer_actor, &writers [last]);
+                running++;
+            }
+        for (; first != last; first++)
+            if (actors [first]) {
+                zsock_wait (actors [first]);
+                zactor_destroy (&actors [first]);
+            }
+    }
+
+    int rc = 0;
+    for (shard = 0; shard != shards; shard++)
+        if (self->changed [shard] && writers [shard].rc == -1)
+            rc = -1;
+    for (shard = 0; shard != shards; shard++) {
+        if (!self->changed [shard])
+            continue;
+        char *tmp = zsys_sprintf ("%s.tmp", writers [shard].path);
+        if (rc == -1) {
+            if (writers [shard].rc == 0)
+                zsys_file_delete (tmp);
+        }
+        else
+        if (rename (tmp, writers [shard].path) != 0) {
+            zsys_error ("Fail to store file %s: %s", writers [shard].path, strerror (errno));
+            zsys_file_delete (tmp);
+            rc = -1;
+        }
+        else {
+            size_t index;
+            for (index = 0; index != writers [shard].size; index++) {
+                record = writers [shard].records [index];
+                record->offset = record->stored;
+                record->dirty = false;
+                record->shard = (uint16_t) shard;
+            }
+            self->changed [shard] = false;
+            self->shards_written++;
+        }
+        zstr_free (&tmp);
     }
+    //  Handles may point to replaced files
+    s_zm_devices_close_handles (self);
+    if (rc == 0) {
+        zstr_free (&self->snapshot);
+        self->snapshot = strdup (self->file);
+        self->snapshot_shards = shards;
+        s_zm_devices_stored (self);
+    }
+
+    for (shard = 0; shard != shards; shard++) {
+        zstr_free (&writers [shard].path);
+        free (writers [shard].records);
+    }
+    free (actors);
+    free (writers);
+    return rc;
 }
 
-const char*
-zm_devices_file (zm_devices_t *self)
+int
+zm_devices_store (zm_devices_t *self)
 {
     assert (self);
-    return (const char*) self->file;
+    if (!self->file)
+        return 0;
+    if (self->shards > 1)
+        return s_zm_devices_store_shards (self);
+    return s_zm_devices_store_file (self);
 }
 
-void
-zm_devices_set_file (zm_devices_t *self, const char *file)
+int
+zm_devices_set_journal (zm_devices_t *self, int level, size_t ring_size)
 {
     assert (self);
-    zstr_free (&self->file);
-    self->file = strdup (file);
+    zm_journal_destroy (&self->journal);
+    if (!level)
+        return 0;
+    if (!self->file)
+        return -1;
+    char *journal = zsys_sprintf ("%s.journal", self->file);
+    self->journal = zm_journal_new (journal, level, ring_size);
+    zstr_free (&journal);
+    return self->journal? 0: -1;
 }
 
-int
-zm_devices_store (zm_devices_t *self)
+uint64_t
+zm_devices_journaled (zm_devices_t *self)
 {
     assert (self);
-    if (self->file) {
-        zconfig_t *root = zconfig_new ("root", NULL);
-        zm_proto_t *device = (zm_proto_t*) zhashx_first (self->devices);
-        while (device) {
-            zm_proto_zpl (device, root);
-            device = (zm_proto_t*) zhashx_next (self->devices);
-        }
-        zconfig_save (root, self->file);
-        zconfig_destroy (&root);
+    return self->journal? self->replayed + zm_journal_size (self->journal): 0;
+}
+
+//  Return number of attributes of ext, version is not counted
+
+static size_t
+s_ext_size (zhash_t *ext)
+{
+    if (!ext)
+        return 0;
+    return zhash_size (ext) - (zhash_lookup (ext, ZM_DEVICES_VERSION)? 1: 0);
+}
+
+//  Return true if both hashes contain the same keys and values, version is
+//  not compared
+
+static bool
+s_ext_equal (zhash_t *ext1, zhash_t *ext2)
+{
+    size_t size1 = s_ext_size (ext1);
+    if (size1 != s_ext_size (ext2))
+        return false;
+    if (size1 == 0)
+        return true;
+
+    const char *value = (const char *) zhash_first (ext1);
+    while (value) {
+        const char *key = zhash_cursor (ext1);
+        const char *other = (const char *) zhash_lookup (ext2, key);
+        if (!streq (key, ZM_DEVICES_VERSION) && (!other || !streq (value, other)))
+            return false;
+        value = (const char *) zhash_next (ext1);
     }
-    return 0;
+    return true;
+}
 
+//  Give next version of store to device
+
+static void
+s_zm_devices_stamp (zm_devices_t *self, zm_proto_t *device)
+{
+    s_device_set_version (device, ++self->version);
 }
 
-//  --------------------------------------------------------------------------
-//  Destroy the zm_devices
+//  Insert or update device, with given version or next version of store if
+//  version is 0
 
-void
-zm_devices_insert (zm_devices_t *self, zm_proto_t *msg)
+static zm_proto_t *
+s_zm_devices_insert (zm_devices_t *self, zm_proto_t *msg, uint64_t version)
 {
-    assert (self);
+    self->inserts++;
+
+    //  Most inserts are heartbeats of known device, those just refresh time
+    //  and ttl of stored device without allocation or rehashing
+    s_record_t *record = (s_record_t *) zm_index_lookup (self->devices, zm_proto_device (msg));
+    if (record && record->device
+    &&  (!version || version == record->version)
+    &&  s_ext_equal (zm_proto_ext (record->device), zm_proto_ext (msg))) {
+        zm_proto_set_time (record->device, zm_proto_time (msg));
+        zm_proto_set_ttl (record->device, zm_proto_ttl (msg));
+        s_zm_devices_unencode (self, record);
+        s_zm_devices_age (self, record, zm_proto_time (msg));
+        record->dirty = true;
+        s_zm_devices_touch (self, record->name);
+        self->refreshed++;
+        if (self->journal)
+            zm_journal_append (self->journal, 'I', record->device);
+        return record->device;
+    }
 
-    const char *device = zm_proto_device (msg);
     // zm_proto_t will be overwritten on another mlm_client_recv
     // so duplicate it
     zm_proto_t *dev = zm_proto_dup (msg);
+    self->allocations++;
+    if (version)
+        s_device_set_version (dev, version);
+    else
+        s_zm_devices_stamp (self, dev);
 
     // TODO
     // see: zm-proto issue#1, zhash inside message DOES NOT own memory
     //      we need to find a solution
     //zm_proto_aux_insert (msg, "x-zm-devices-time", "%zu", (uint64_t) zclock_mono ());
-    zhashx_update (self->devices, device, (void*)dev);
+    record = s_zm_devices_put (self, dev, -1);
+    s_zm_devices_encode (self, record);
+    if (self->journal)
+        zm_journal_append (self->journal, 'I', record->device);
+    return record->device;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Insert or update device
+
+zm_proto_t *
+zm_devices_insert (zm_devices_t *self, zm_proto_t *msg)
+{
+    assert (self);
+    return s_zm_devices_insert (self, msg, 0);
+}
+
+
+//  --------------------------------------------------------------------------
+//  Insert or update device keeping version it carries
+
+zm_proto_t *
+zm_devices_replicate (zm_devices_t *self, zm_proto_t *msg)
+{
+    assert (self);
+    return s_zm_devices_insert (self, msg, s_device_version (msg));
+}
+
+//  Find record of device, evicted device is loaded back. Returns NULL if
+//  there is no such device.
+
+static s_record_t *
+s_zm_devices_find (zm_devices_t *self, const char *name)
+{
+    //TODO:
+    //zm_devices_gc (self);
+    self->lookups++;
+    if (!zm_bloom_exists (self->filter, name)) {
+        self->filtered++;
+        return NULL;
+    }
+    s_record_t *record = (s_record_t *) zm_index_lookup (self->devices, name);
+    if (!record) {
+        self->false_positives++;
+        return NULL;
+    }
+    if (!record->device) {
+        //  Evicted device, load it back from snapshot
+        zm_proto_t *device = s_zm_devices_reload (self, record);
+        if (!device || !streq (zm_proto_device (device), name)) {
+            zsys_error ("Fail to load device %s from %s", name, self->snapshot);
+            zm_proto_destroy (&device);
+            s_zm_devices_remove (self, name);
+            return NULL;
+        }
+        s_zm_devices_attach (self, record, device);
+        self->reloads++;
+        s_zm_devices_evict (self, record);
+    }
+    self->hits++;
+    record->referenced = true;
+    return record;
 }
 
 zm_proto_t*
@@ -145,10 +1550,29 @@ zm_devices_lookup (zm_devices_t *self, const char* name)
     assert (self);
     if (!name)
         return NULL;
+    s_record_t *record = s_zm_devices_find (self, name);
+    return record? record->device: NULL;
+}
 
-    //TODO:
-    //zm_devices_gc (self);
-    return (zm_proto_t*) zhashx_lookup (self->devices, name);
+zframe_t *
+zm_devices_lookup_frame (zm_devices_t *self, const char *name)
+{
+    assert (self);
+    if (!name)
+        return NULL;
+    s_record_t *record = s_zm_devices_find (self, name);
+    if (!record)
+        return NULL;
+    s_zm_devices_encode (self, record);
+    s_encoded_t *encoded = record->encoded;
+#ifdef CZMQ_BUILD_DRAFT_API
+    __atomic_add_fetch (&encoded->references, 1, __ATOMIC_ACQ_REL);
+    return zframe_frommem (zframe_data (encoded->frame), zframe_size (encoded->frame),
+        s_encoded_free, encoded);
+#else
+    //  Without zframe_frommem the frame is copied, encoding is still saved
+    return zframe_dup (encoded->frame);
+#endif
 }
 
 void
@@ -160,9 +1584,273 @@ zm_devices_delete (zm_devices_t *self, const char* name)
 
     //TODO:
     //zm_devices_gc (self);
-    zhashx_delete (self->devices, name);
+    if (self->journal && zm_index_lookup (self->devices, name)) {
+        zm_proto_t *device = zm_proto_new ();
+        zm_proto_encode_device (device, name, 0, 0, NULL);
+        zm_journal_append (self->journal, 'D', device);
+        zm_proto_destroy (&device);
+    }
+    s_zm_devices_remove (self, name);
+}
+
+uint64_t
+zm_devices_version (zm_devices_t *self, const char *name)
+{
+    assert (self);
+    if (!name)
+        return 0;
+    s_record_t *record = (s_record_t *) zm_index_lookup (self->devices, name);
+    return record? record->version: 0;
+}
+
+zm_digest_t *
+zm_devices_digest (zm_devices_t *self)
+{
+    assert (self);
+    return self->digest;
+}
+
+void
+zm_devices_set_digest_depth (zm_devices_t *self, size_t depth)
+{
+    assert (self);
+    zm_digest_t *digest = zm_digest_new (depth);
+    if (zm_digest_depth (digest) == zm_digest_depth (self->digest)) {
+        zm_digest_destroy (&digest);
+        return;
+    }
+    s_record_t *record = (s_record_t *) zm_index_first (self->devices);
+    while (record) {
+        zm_digest_update (digest, zm_index_cursor (self->devices), 0, record->digest);
+        record = (s_record_t *) zm_index_next (self->devices);
+    }
+    zm_digest_destroy (&self->digest);
+    self->digest = digest;
+}
+
+void
+zm_devices_set_aggregate (zm_devices_t *self, const char *attributes)
+{
+    assert (self);
+    if (!attributes || !*attributes) {
+        zm_aggregate_destroy (&self->aggregate);
+        return;
+    }
+    if (self->aggregate && streq (zm_aggregate_attributes (self->aggregate), attributes))
+        return;
+    zm_aggregate_destroy (&self->aggregate);
+    zm_aggregate_t *aggregate = zm_aggregate_new (attributes);
+    s_record_t *record = (s_record_t *) zm_index_first (self->devices);
+    while (record) {
+        zm_proto_t *device = record->device? record->device: s_zm_devices_reload (self, record);
+        zm_aggregate_update (aggregate, NULL, device);
+        if (device != record->device)
+            zm_proto_destroy (&device);
+        record = (s_record_t *) zm_index_next (self->devices);
+    }
+    self->aggregate = aggregate;
+}
+
+zm_aggregate_t *
+zm_devices_aggregate (zm_devices_t *self)
+{
+    assert (self);
+    return self->aggregate;
+}
+
+zlistx_t *
+zm_devices_bucket (zm_devices_t *self, size_t bucket)
+{
+    assert (self);
+    zlistx_t *devices = zlistx_new ();
+    assert (devices);
+    zlistx_set_destructor (devices, (zlistx_destructor_fn *) zm_proto_destroy);
+    s_record_t *record = (s_record_t *) zm_index_first (self->devices);
+    while (record) {
+        const char *name = zm_index_cursor (self->devices);
+        if (zm_digest_bucket (self->digest, name) == bucket) {
+            //  Evicted devices are read, but they are not made resident
+            zm_proto_t *device = record->device?
+                zm_proto_dup (record->device): s_zm_devices_reload (self, record);
+            if (device)
+                zlistx_add_end (devices, device);
+        }
+        record = (s_record_t *) zm_index_next (self->devices);
+    }
+    return devices;
+}
+
+zlistx_t *
+zm_devices_stale (zm_devices_t *self, uint64_t before, uint64_t after_time, const char *after, size_t limit)
+{
+    assert (self);
+    zlistx_t *devices = zlistx_new ();
+    assert (devices);
+    zlistx_set_destructor (devices, (zlistx_destructor_fn *) zm_proto_destroy);
+
+    s_record_t *record = self->oldest;
+    if (after) {
+        //  Continue right after last device of previous page, unless it
+        //  was updated or deleted since, then find the place from the start
+        s_record_t *last = (s_record_t *) zm_index_lookup (self->devices, after);
+        if (last && last->time == after_time)
+            record = last->newer;
+        else
+            while (record && s_record_compare (record, after_time, after) <= 0)
+                record = record->newer;
+    }
+    while (record && record->time < before && zlistx_size (devices) < limit) {
+        zm_proto_t *device = record->device?
+            zm_proto_dup (record->device): s_zm_devices_reload (self, record);
+        if (device)
+            zlistx_add_end (devices, device);
+        record = record->newer;
+    }
+    return devices;
+}
+
+//  --------------------------------------------------------------------------
+//  Add statistics to parent
+
+void
+zm_devices_stats (zm_devices_t *self, zconfig_t *parent)
+{
+    assert (self);
+    assert (parent);
+
+    zconfig_putf (parent, "devices", "%zu", zm_index_size (self->devices));
+    zconfig_putf (parent, "resident", "%zu", zlistx_size (self->queue));
+    zconfig_putf (parent, "memory", "%zu", self->memory);
+    zconfig_putf (parent, "evictions", "%" PRIu64, self->evictions);
+    zconfig_putf (parent, "reloads", "%" PRIu64, self->reloads);
+    zconfig_putf (parent, "lookups", "%" PRIu64, self->lookups);
+    zconfig_putf (parent, "hits", "%" PRIu64, self->hits);
+    zconfig_putf (parent, "inserts", "%" PRIu64, self->inserts);
+    zconfig_putf (parent, "refreshed", "%" PRIu64, self->refreshed);
+    zconfig_putf (parent, "allocations", "%" PRIu64, self->allocations);
+    zconfig_putf (parent, "encodings", "%" PRIu64, self->encodings);
+    zconfig_putf (parent, "shards_written", "%" PRIu64, self->shards_written);
+    if (self->journal)
+        zm_journal_stats (self->journal, zconfig_new ("journal", parent));
+    zconfig_t *filter = zconfig_new ("filter", parent);
+    zconfig_putf (filter, "filtered", "%" PRIu64, self->filtered);
+    zconfig_putf (filter, "false_positives", "%" PRIu64, self->false_positives);
+    uint64_t misses = self->filtered + self->false_positives;
+    zconfig_putf (filter, "hit_rate", "%.4f", misses? (double) self->filtered / misses: 1.0);
+    zconfig_putf (filter, "fp_rate", "%.4f", zm_bloom_fp_rate (self->filter));
+}
+
+//  --------------------------------------------------------------------------
+//  Timings of store, load and LOOKUP replies of 30000 devices, run by
+//  verbose self test only
+
+static void
+s_zm_devices_benchmark (void)
+{
+    zm_devices_t *big = zm_devices_new (NULL);
+    zm_proto_t *msg = zm_proto_new ();
+    int i;
+    for (i = 0; i != 30000; i++) {
+        char name [32];
+        snprintf (name, sizeof (name), "device-%d", i);
+        zm_proto_encode_device (msg, name, zclock_mono (), 10000, NULL);
+        zm_devices_insert (big, msg);
+    }
+    zm_proto_destroy (&msg);
+    zm_devices_set_file (big, ".test/bench.zpl");
+    int64_t start = zclock_usecs ();
+    zconfig_t *root = zconfig_new ("root", NULL);
+    s_record_t *record = (s_record_t *) zm_index_first (big->devices);
+    while (record) {
+        zm_proto_zpl (record->device, root);
+        record = (s_record_t *) zm_index_next (big->devices);
+    }
+    zconfig_save (root, ".test/bench.zpl");
+    zconfig_destroy (&root);
+    int64_t tree_usecs = zclock_usecs () - start;
+    start = zclock_usecs ();
+    int r = zm_devices_store (big);
+    int64_t stream_usecs = zclock_usecs () - start;
+    assert (r == 0);
+    zsys_debug ("zm_devices: store of 30000 devices zconfig=%" PRIi64 "us, stream=%" PRIi64 "us",
+        tree_usecs, stream_usecs);
+
+    start = zclock_usecs ();
+    root = zconfig_load (".test/bench.zpl");
+    zconfig_t *item = zconfig_child (root);
+    while (item) {
+        zm_proto_t *dev = zm_proto_new_zpl (item);
+        zm_proto_destroy (&dev);
+        item = zconfig_next (item);
+    }
+    zconfig_destroy (&root);
+    tree_usecs = zclock_usecs () - start;
+    start = zclock_usecs ();
+    zm_devices_t *loaded = zm_devices_new (".test/bench.zpl");
+    stream_usecs = zclock_usecs () - start;
+    zm_devices_destroy (&loaded);
+    zm_devices_t *parallel = zm_devices_new (NULL);
+    start = zclock_usecs ();
+    r = zm_devices_load (parallel, ".test/bench.zpl", 4);
+    int64_t parallel_usecs = zclock_usecs () - start;
+    assert (r == 0);
+    zsys_debug ("zm_devices: load of 30000 devices zconfig=%" PRIi64 "us, stream=%" PRIi64 "us, 4 workers=%" PRIi64 "us",
+        tree_usecs, stream_usecs, parallel_usecs);
+
+    //  LOOKUP reply encoded on every hit versus frame encoded once
+    clock_t cpu = clock ();
+    start = zclock_usecs ();
+    for (i = 0; i != 30000; i++) {
+        char name [32];
+        snprintf (name, sizeof (name), "device-%d", i);
+        zmsg_t *reply = zmsg_new ();
+        zm_proto_send (zm_devices_lookup (parallel, name), reply);
+        zmsg_destroy (&reply);
+    }
+    int64_t encode_usecs = zclock_usecs () - start;
+    clock_t encode_cpu = clock () - cpu;
+    cpu = clock ();
+    start = zclock_usecs ();
+    for (i = 0; i != 30000; i++) {
+        char name [32];
+        snprintf (name, sizeof (name), "device-%d", i);
+        zmsg_t *reply = zmsg_new ();
+        zframe_t *frame = zm_devices_lookup_frame (parallel, name);
+        zmsg_append (reply, &frame);
+        zmsg_destroy (&reply);
+    }
+    int64_t frame_usecs = zclock_usecs () - start;
+    clock_t frame_cpu = clock () - cpu;
+    zsys_debug ("zm_devices: 30000 LOOKUP replies encoded=%" PRIi64 "us (%.3f us CPU each), shared frame=%" PRIi64 "us (%.3f us CPU each)",
+        encode_usecs, 1e6 * encode_cpu / CLOCKS_PER_SEC / 30000,
+        frame_usecs, 1e6 * frame_cpu / CLOCKS_PER_SEC / 30000);
+    zm_devices_destroy (&parallel);
+
+    zm_devices_set_shards (big, 8, 4);
+    start = zclock_usecs ();
+    r = zm_devices_store (big);
+    int64_t sharded_usecs = zclock_usecs () - start;
+    assert (r == 0);
+    zm_devices_t *sharded = zm_devices_new (NULL);
+    start = zclock_usecs ();
+    r = zm_devices_load (sharded, ".test/bench.zpl", 4);
+    parallel_usecs = zclock_usecs () - start;
+    assert (r == 0);
+    zm_devices_destroy (&sharded);
+    zsys_debug ("zm_devices: 30000 devices in 8 shards store=%" PRIi64 "us, load by 4 workers=%" PRIi64 "us",
+        sharded_usecs, parallel_usecs);
+    msg = zm_proto_new ();
+    zm_proto_encode_device (msg, "device-42", zclock_mono (), 10000, NULL);
+    zm_devices_insert (big, msg);
+    zm_proto_destroy (&msg);
+    start = zclock_usecs ();
+    r = zm_devices_store (big);
+    assert (r == 0);
+    zsys_debug ("zm_devices: store of 1 changed shard=%" PRIi64 "us", zclock_usecs () - start);
+    zm_devices_destroy (&big);
 }
 
+
 //  --------------------------------------------------------------------------
 //  Self test of this class
 
@@ -183,6 +1871,7 @@ zm_devices_test (bool verbose)
     assert (self);
 
     assert (!zm_devices_lookup (self, "some"));
+    assert (self->filtered == 1);
     zm_proto_t *dev = zm_proto_new ();
     assert (dev);
     zm_proto_encode_device (
@@ -211,10 +1900,37 @@ zm_devices_test (bool verbose)
     assert (zm_devices_lookup (self, "device1"));
     assert (zm_devices_lookup (self, "device2"));
     assert (zm_devices_lookup (self, "device3"));
+    assert (self->hits == 3);
+
+    //  Inserted device is encoded once, frame outlives change of device
+    zframe_t *frame = zm_devices_lookup_frame (self, "device1");
+    assert (frame);
+    assert (self->encodings == 3);
+    zmsg_t *encoded = zmsg_new ();
+    zm_proto_send (zm_devices_lookup (self, "device1"), encoded);
+    assert (zframe_eq (frame, zmsg_first (encoded)));
+    zmsg_destroy (&encoded);
+    dev = zm_proto_new ();
+    zm_proto_encode_device (dev, "device1", zm_proto_time (zm_devices_lookup (self, "device1")) + 1, 10000, NULL);
+    zm_devices_insert (self, dev);
+    zframe_t *refreshed = zm_devices_lookup_frame (self, "device1");
+    assert (self->encodings == 4);
+    assert (!zframe_eq (frame, refreshed));
+    zframe_destroy (&refreshed);
+    encoded = zmsg_new ();
+    zmsg_append (encoded, &frame);
+    zm_proto_recv (dev, encoded);
+    zmsg_destroy (&encoded);
+    assert (streq (zm_proto_device (dev), "device1"));
+    assert (zm_proto_time (dev) + 1 == zm_proto_time (zm_devices_lookup (self, "device1")));
+    zm_proto_destroy (&dev);
+    assert (!zm_devices_lookup_frame (self, "device4"));
 
     zm_devices_set_file (self, ".test/devices.zpl");
+    zm_devices_set_fsync (self, true);
     r = zm_devices_store (self);
     assert (r == 0);
+    assert (!zsys_file_exists (".test/devices.zpl.tmp"));
 
     zm_devices_t *devices2 = zm_devices_new (".test/devices.zpl");
     assert (devices2);
@@ -224,13 +1940,406 @@ zm_devices_test (bool verbose)
     assert (zm_devices_lookup (devices2, "device2"));
     assert (zm_devices_lookup (devices2, "device3"));
 
+    //  Changes after store are replayed from journal, store truncates it
+    assert (zm_devices_set_journal (devices2, ZM_JOURNAL_FSYNC, 1024) == 0);
+    zm_proto_t *journaled = zm_proto_new ();
+    zm_proto_encode_device (journaled, "device4", zclock_mono (), 1024, NULL);
+    zm_devices_insert (devices2, journaled);
+    zm_proto_destroy (&journaled);
+    zm_devices_delete (devices2, "device1");
+    assert (zm_devices_journaled (devices2) == 2);
+    zm_devices_set_journal (devices2, 0, 0);
+    zm_devices_t *replayed = zm_devices_new (".test/devices.zpl");
+    assert (!zm_devices_lookup (replayed, "device1"));
+    assert (zm_devices_lookup (replayed, "device2"));
+    assert (zm_devices_lookup (replayed, "device4"));
+    //  Replayed changes stay in journal until the next store
+    assert (zm_devices_set_journal (replayed, ZM_JOURNAL_ASYNC, 1024) == 0);
+    assert (zm_devices_journaled (replayed) == 2);
+    zm_devices_destroy (&replayed);
+    assert (zm_devices_store (devices2) == 0);
+    assert (!zsys_file_exists (".test/devices.zpl.journal"));
+
+    //  Devices of snapshot stored without versions get them on load
+    zconfig_t *unversioned = zconfig_new ("root", NULL);
+    journaled = zm_proto_new ();
+    zm_proto_encode_device (journaled, "device6", zclock_mono (), 1024, NULL);
+    zm_proto_zpl (journaled, unversioned);
+    zm_proto_encode_device (journaled, "device7", zclock_mono (), 1024, NULL);
+    zm_proto_zpl (journaled, unversioned);
+    zm_proto_destroy (&journaled);
+    zconfig_save (unversioned, ".test/unversioned.zpl");
+    zconfig_destroy (&unversioned);
+    replayed = zm_devices_new (".test/unversioned.zpl");
+    assert (replayed);
+    assert (zm_devices_version (replayed, "device6"));
+    assert (zm_devices_version (replayed, "device7"));
+    assert (zm_devices_version (replayed, "device6") != zm_devices_version (replayed, "device7"));
+    assert (zhash_lookup (zm_proto_ext (zm_devices_lookup (replayed, "device6")), ZM_DEVICES_VERSION));
+    zm_devices_destroy (&replayed);
+    zsys_file_delete (".test/unversioned.zpl");
+
+    //  Journal is replayed even if snapshot was never stored
+    zm_devices_t *fresh = zm_devices_new (".test/fresh.zpl");
+    assert (fresh);
+    assert (streq (zm_devices_file (fresh), ".test/fresh.zpl"));
+    assert (zm_devices_set_journal (fresh, ZM_JOURNAL_FSYNC, 1024) == 0);
+    journaled = zm_proto_new ();
+    zm_proto_encode_device (journaled, "device5", zclock_mono (), 1024, NULL);
+    zm_devices_insert (fresh, journaled);
+    zm_proto_destroy (&journaled);
+    zm_devices_set_journal (fresh, 0, 0);
+    assert (!zsys_file_exists (".test/fresh.zpl"));
+    replayed = zm_devices_new (".test/fresh.zpl");
+    assert (replayed);
+    assert (zm_devices_lookup (replayed, "device5"));
+    zm_devices_destroy (&replayed);
+    zsys_file_delete (".test/fresh.zpl.journal");
+    zm_devices_destroy (&fresh);
+
+    //  Replayed device keeps its version, even if the highest version was
+    //  deleted before store
+    zm_devices_t *restamped = zm_devices_new (NULL);
+    zm_devices_set_file (restamped, ".test/restamped.zpl");
+    journaled = zm_proto_new ();
+    zm_proto_encode_device (journaled, "device8", zclock_mono (), 1024, NULL);
+    zm_devices_insert (restamped, journaled);
+    zm_proto_encode_device (journaled, "device9", zclock_mono (), 1024, NULL);
+    zm_devices_insert (restamped, journaled);
+    zm_devices_delete (restamped, "device9");
+    assert (zm_devices_store (restamped) == 0);
+    assert (zm_devices_set_journal (restamped, ZM_JOURNAL_FSYNC, 1024) == 0);
+    zm_proto_encode_device (journaled, "device5", zclock_mono (), 1024, NULL);
+    zm_devices_insert (restamped, journaled);
+    zm_proto_destroy (&journaled);
+    zm_devices_set_journal (restamped, 0, 0);
+    replayed = zm_devices_new (".test/restamped.zpl");
+    assert (zm_devices_version (replayed, "device5") == zm_devices_version (restamped, "device5"));
+    zm_devices_destroy (&replayed);
+    zm_devices_destroy (&restamped);
+
+    //  Parallel load must give the same result as sequential one
+    int big_count = 3000;
+    zm_devices_t *big = zm_devices_new (NULL);
+    zm_proto_t *msg = zm_proto_new ();
+    int i;
+    for (i = 0; i != big_count; i++) {
+        char name [32];
+        snprintf (name, sizeof (name), "device-%d", i);
+        zm_proto_encode_device (msg, name, zclock_mono (), 10000, NULL);
+        zm_devices_insert (big, msg);
+    }
+    zm_proto_destroy (&msg);
+    zm_devices_set_file (big, ".test/big.zpl");
+    r = zm_devices_store (big);
+    assert (r == 0);
+    zm_devices_t *loaded = zm_devices_new (".test/big.zpl");
+    assert (loaded);
+    zm_devices_t *parallel = zm_devices_new (NULL);
+    r = zm_devices_load (parallel, ".test/big.zpl", 4);
+    assert (r == 0);
+    for (i = 0; i != big_count; i++) {
+        char name [32];
+        snprintf (name, sizeof (name), "device-%d", i);
+        assert (zm_devices_lookup (loaded, name));
+        assert (zm_devices_lookup (parallel, name));
+    }
+    assert (zm_devices_load (parallel, ".test/does-not-exist.zpl", 1) == -1);
+
+    //  Filter is rebuilt on load and answers almost all misses
+    for (i = 0; i != big_count; i++) {
+        char name [32];
+        snprintf (name, sizeof (name), "missing-%d", i);
+        assert (!zm_devices_lookup (parallel, name));
+    }
+    assert (parallel->false_positives < (uint64_t) big_count / 50);
+    for (i = 0; i != big_count; i++) {
+        char name [32];
+        snprintf (name, sizeof (name), "device-%d", i);
+        zm_devices_delete (parallel, name);
+        assert (!zm_devices_lookup (parallel, name));
+    }
+    zconfig_t *stats = zconfig_new ("stats", NULL);
+    zm_devices_stats (parallel, stats);
+    assert (streq (zconfig_get (stats, "devices", ""), "0"));
+    zconfig_destroy (&stats);
+    zm_devices_destroy (&parallel);
+
+    //  Stored devices are evicted and loaded back on lookup
+    zm_devices_set_budget (loaded, 1000, 0, true);
+    zconfig_t *budget = zconfig_new ("stats", NULL);
+    zm_devices_stats (loaded, budget);
+    assert (atoi (zconfig_get (budget, "devices", "")) == big_count);
+    assert (streq (zconfig_get (budget, "resident", ""), "1000"));
+    zconfig_destroy (&budget);
+    for (i = 0; i != big_count; i++) {
+        char name [32];
+        snprintf (name, sizeof (name), "device-%d", i);
+        dev = zm_devices_lookup (loaded, name);
+        assert (dev);
+        assert (streq (zm_proto_device (dev), name));
+    }
+    assert (loaded->reloads > 0);
+    assert (zlistx_size (loaded->queue) <= 1000);
+
+    //  Snapshot written with evicted devices still contains all of them
+    zm_devices_set_file (loaded, ".test/big2.zpl");
+    r = zm_devices_store (loaded);
+    assert (r == 0);
+    zm_devices_t *copy = zm_devices_new (".test/big2.zpl");
+    assert (zm_index_size (copy->devices) == (size_t) big_count);
+    zm_devices_destroy (&copy);
+
+    //  Devices which are not stored can be evicted only if allowed
+    msg = zm_proto_new ();
+    zm_proto_encode_device (msg, "new-device", zclock_mono (), 10000, NULL);
+    zm_devices_insert (loaded, msg);
+    zm_proto_destroy (&msg);
+    zm_devices_set_budget (loaded, 1, 0, true);
+    assert (zm_devices_lookup (loaded, "new-device"));
+    zm_devices_set_budget (loaded, 0, 1, false);
+    assert (zlistx_size (loaded->queue) == 0);
+    assert (!zm_devices_lookup (loaded, "new-device"));
+    assert (zm_devices_lookup (loaded, "device-42"));
+    assert (zlistx_size (loaded->queue) == 1);
+    zm_devices_destroy (&loaded);
+
+    //  Sharded snapshot is written and loaded by workers, only shards with
+    //  changed devices are written again
+    zm_devices_set_shards (big, 8, 4);
+    r = zm_devices_store (big);
+    assert (r == 0);
+    assert (big->shards_written == 8);
+    assert (zsys_file_exists (".test/big.zpl.7"));
+    assert (!zsys_file_exists (".test/big.zpl.8"));
+    assert (!zsys_file_exists (".test/big.zpl"));
+    zm_devices_t *sharded = zm_devices_new (NULL);
+    r = zm_devices_load (sharded, ".test/big.zpl", 4);
+    assert (r == 0);
+    assert (zm_index_size (sharded->devices) == (size_t) big_count);
+
+    msg = zm_proto_new ();
+    zm_proto_encode_device (msg, "device-42", zclock_mono (), 10000, NULL);
+    zm_devices_insert (big, msg);
+    zm_proto_destroy (&msg);
+    assert (zm_devices_store (big) == 0);
+    assert (big->shards_written == 9);
+    assert (zm_devices_store (big) == 0);
+    assert (big->shards_written == 9);
+
+    //  Evicted devices are loaded back from their shards
+    zm_devices_set_budget (sharded, 100, 0, true);
+    for (i = 0; i != big_count; i += 7) {
+        char name [32];
+        snprintf (name, sizeof (name), "device-%d", i);
+        dev = zm_devices_lookup (sharded, name);
+        assert (dev);
+        assert (streq (zm_proto_device (dev), name));
+    }
+    zm_devices_destroy (&sharded);
+
+    //  Back to single file, shards are removed
+    zm_devices_set_shards (big, 0, 0);
+    assert (zm_devices_store (big) == 0);
+    assert (zsys_file_exists (".test/big.zpl"));
+    assert (!zsys_file_exists (".test/big.zpl.0"));
+
+    //  Digest does not depend on order of inserts nor on heartbeats
+    zm_devices_t *reversed = zm_devices_new (NULL);
+    msg = zm_proto_new ();
+    for (i = big_count - 1; i >= 0; i--) {
+        char name [32];
+        snprintf (name, sizeof (name), "device-%d", i);
+        zm_proto_encode_device (msg, name, 42, 10000, NULL);
+        zm_devices_insert (reversed, msg);
+    }
+    zm_proto_destroy (&msg);
+    zm_digest_t *digest = zm_devices_digest (big);
+    assert (zm_digest_node (digest, 0, 0) != 0);
+    assert (zm_digest_node (digest, 0, 0) == zm_digest_node (zm_devices_digest (reversed), 0, 0));
+    size_t bucket = zm_digest_bucket (digest, "device-42");
+    zlistx_t *devices = zm_devices_bucket (big, bucket);
+    assert (zlistx_size (devices) > 0);
+    assert (zlistx_size (devices) < 100);
+    dev = (zm_proto_t *) zlistx_first (devices);
+    while (dev) {
+        assert (zm_digest_bucket (digest, zm_proto_device (dev)) == bucket);
+        dev = (zm_proto_t *) zlistx_next (devices);
+    }
+    zlistx_destroy (&devices);
+    zm_devices_set_digest_depth (reversed, 4);
+    assert (zm_digest_depth (zm_devices_digest (reversed)) == 4);
+    zm_devices_set_digest_depth (reversed, 10);
+    assert (zm_digest_node (zm_devices_digest (reversed), 0, 0) == zm_digest_node (digest, 0, 0));
+    zm_devices_delete (reversed, "device-42");
+    assert (zm_digest_node (zm_devices_digest (reversed), 0, 0) != zm_digest_node (digest, 0, 0));
+    zm_devices_destroy (&reversed);
+    zm_devices_destroy (&big);
+
+    //  Devices not updated since time are listed oldest first by pages
+    zm_devices_t *aged = zm_devices_new (NULL);
+    msg = zm_proto_new ();
+    for (i = 0; i != 1000; i++) {
+        char name [32];
+        int age = (i * 7) % 1000;
+        snprintf (name, sizeof (name), "device-%d", age);
+        zm_proto_encode_device (msg, name, age, 10000, NULL);
+        zm_devices_insert (aged, msg);
+    }
+    zm_proto_encode_device (msg, "device-0", 2000, 10000, NULL);
+    zm_devices_insert (aged, msg);
+    zm_proto_destroy (&msg);
+    zm_devices_delete (aged, "device-1");
+    zm_devices_set_file (aged, ".test/aged.zpl");
+    assert (zm_devices_store (aged) == 0);
+    zm_devices_t *sorted = zm_devices_new (".test/aged.zpl");
+    zm_devices_destroy (&aged);
+
+    uint64_t after_time = 0;
+    char *after = NULL;
+    size_t count = 0;
+    while (true) {
+        devices = zm_devices_stale (sorted, 500, after_time, after, 64);
+        dev = (zm_proto_t *) zlistx_first (devices);
+        while (dev) {
+            assert (zm_proto_time (dev) == count + 2);
+            count++;
+            zstr_free (&after);
+            after = strdup (zm_proto_device (dev));
+            after_time = zm_proto_time (dev);
+            dev = (zm_proto_t *) zlistx_next (devices);
+        }
+        size_t page = zlistx_size (devices);
+        zlistx_destroy (&devices);
+        if (page < 64)
+            break;
+        //  Refreshed device moves out of the listing
+        msg = zm_proto_new ();
+        zm_proto_encode_device (msg, after, 3000, 10000, NULL);
+        zm_devices_insert (sorted, msg);
+        zm_proto_destroy (&msg);
+    }
+    assert (count == 498);
+    zstr_free (&after);
+    devices = zm_devices_stale (sorted, 4000, 0, NULL, 2000);
+    assert (zlistx_size (devices) == 999);
+    assert (zm_proto_time ((zm_proto_t *) zlistx_last (devices)) == 3000);
+    zlistx_destroy (&devices);
+    zm_devices_destroy (&sorted);
+
+    //  Counts by attributes follow inserts and deletes, even of evicted devices
+    zm_devices_t *counted = zm_devices_new (NULL);
+    msg = zm_proto_new ();
+    zhash_t *attrs = zhash_new ();
+    for (i = 0; i != 100; i++) {
+        char name [32];
+        snprintf (name, sizeof (name), "device-%d", i);
+        zhash_update (attrs, "site", i % 2? "prague": "brno");
+        zm_proto_encode_device (msg, name, i, 10000, attrs);
+        zm_devices_insert (counted, msg);
+    }
+    zm_devices_set_aggregate (counted, "site,model");
+    zm_aggregate_t *aggregate = zm_devices_aggregate (counted);
+    assert (zm_aggregate_count (aggregate, "site", "prague") == 50);
+    zm_devices_set_file (counted, ".test/counted.zpl");
+    assert (zm_devices_store (counted) == 0);
+    zm_devices_set_budget (counted, 1, 0, true);
+    zm_devices_delete (counted, "device-1");
+    zhash_update (attrs, "site", "brno");
+    zhash_update (attrs, "model", "X1");
+    zm_proto_encode_device (msg, "device-3", 3, 10000, attrs);
+    zm_devices_insert (counted, msg);
+    zm_devices_insert (counted, msg);
+    assert (zm_aggregate_count (aggregate, "site", "prague") == 48);
+    assert (zm_aggregate_count (aggregate, "site", "brno") == 51);
+    assert (zm_aggregate_count (aggregate, "model", "X1") == 1);
+    zm_devices_set_aggregate (counted, NULL);
+    assert (!zm_devices_aggregate (counted));
+    zhash_destroy (&attrs);
+    zm_proto_destroy (&msg);
+    zm_devices_destroy (&counted);
+
+    //  Versions change with content, not with heartbeats, and survive store
+    zm_devices_t *versioned = zm_devices_new (NULL);
+    zm_devices_set_file (versioned, ".test/versioned.zpl");
+    msg = zm_proto_new ();
+    zm_proto_encode_device (msg, "device-1", 1, 10000, NULL);
+    zm_devices_insert (versioned, msg);
+    zm_proto_encode_device (msg, "device-2", 1, 10000, NULL);
+    zm_devices_insert (versioned, msg);
+    assert (zm_devices_version (versioned, "device-1") == 1);
+    assert (zm_devices_version (versioned, "device-2") == 2);
+    assert (zm_devices_version (versioned, "device-3") == 0);
+    zm_proto_encode_device (msg, "device-1", 2, 10000, NULL);
+    zm_devices_insert (versioned, msg);
+    assert (zm_devices_version (versioned, "device-1") == 1);
+    attrs = zhash_new ();
+    zhash_insert (attrs, "model", "X1");
+    zm_proto_encode_device (msg, "device-1", 3, 10000, attrs);
+    zhash_destroy (&attrs);
+    zm_devices_insert (versioned, msg);
+    assert (zm_devices_version (versioned, "device-1") == 3);
+    dev = zm_devices_lookup (versioned, "device-1");
+    assert (streq ((char *) zhash_lookup (zm_proto_ext (dev), ZM_DEVICES_VERSION), "3"));
+    assert (zm_proto_time (dev) == 3);
+    assert (zm_devices_store (versioned) == 0);
+    zm_devices_delete (versioned, "device-1");
+    assert (zm_devices_version (versioned, "device-1") == 0);
+    zm_proto_destroy (&msg);
+    zm_devices_destroy (&versioned);
+    versioned = zm_devices_new (".test/versioned.zpl");
+    assert (zm_devices_version (versioned, "device-1") == 3);
+    assert (versioned->version == 3);
+
+    //  Replicated device keeps its version, later inserts go above it
+    attrs = zhash_new ();
+    zhash_insert (attrs, ZM_DEVICES_VERSION, "42");
+    msg = zm_proto_new ();
+    zm_proto_encode_device (msg, "device-4", 1, 10000, attrs);
+    zhash_destroy (&attrs);
+    zm_devices_replicate (versioned, msg);
+    assert (zm_devices_version (versioned, "device-4") == 42);
+    zm_devices_replicate (versioned, msg);
+    assert (zm_devices_version (versioned, "device-4") == 42);
+    zm_proto_encode_device (msg, "device-5", 1, 10000, NULL);
+    zm_devices_replicate (versioned, msg);
+    assert (zm_devices_version (versioned, "device-5") == 43);
+    zm_proto_destroy (&msg);
+    zm_devices_destroy (&versioned);
+
+    //  Heartbeat refreshes stored device in place
     zm_proto_t *device3_old = zm_devices_lookup (self, "device3");
+    dev = zm_proto_new ();
+    zm_proto_encode_device (dev, "device3", 42, 4242, NULL);
+    uint64_t allocations = self->allocations;
+    for (i = 0; i != 100000; i++)
+        zm_devices_insert (self, dev);
+    assert (self->allocations == allocations);
+    assert (self->refreshed == 100000);
     zm_proto_t *device3_new = zm_devices_lookup (self, "device3");
-    assert (streq (zm_proto_device (device3_old), zm_proto_device (device3_new)));
+    assert (device3_old == device3_new);
+    assert (zm_proto_time (device3_new) == 42);
+    assert (zm_proto_ttl (device3_new) == 4242);
+
+    //  Change of ext replaces the device
+    zhash_t *ext = zhash_new ();
+    zhash_insert (ext, "model", "X1");
+    zm_proto_encode_device (dev, "device3", 43, 4242, ext);
+    zm_devices_insert (self, dev);
+    assert (self->allocations == allocations + 1);
+    assert (zm_proto_time (zm_devices_lookup (self, "device3")) == 43);
+    zm_proto_destroy (&dev);
+    zhash_destroy (&ext);
+    if (verbose)
+        zsys_debug ("zm_devices: 100000 heartbeats done with %" PRIu64 " allocations",
+            self->allocations - allocations - 1);
 
     zm_devices_destroy (&self);
     zm_devices_destroy (&devices2);
 
+    if (verbose)
+        s_zm_devices_benchmark ();
+
     zdir_remove (dir, true);
     zdir_destroy (&dir);
 
@@ -18,10 +18,24 @@ extern "C" {
 #endif
 
 //  @interface
-//  Create a new zm_devices - if file is not NULL, it loads devices from it
+//  Ext attribute with version of stored device. Version is given to device
+//  when it is created or its ext changes, heartbeats keep it. Versions are
+//  unique and increasing within the store.
+#define ZM_DEVICES_VERSION "x-zm-version"
+
+//  Create a new zm_devices - if file is not NULL, it loads devices from it,
+//  store is empty if file can't be read
 ZM_ASSET_PRIVATE zm_devices_t *
     zm_devices_new (const char *file);
 
+//  Load devices from ZPL file and add them to zm_devices. Entries are parsed
+//  one by one, if workers > 1, large files are split to ranges parsed in
+//  parallel. Changes journaled since last store are replayed then, even if
+//  file was never stored. Returns 0 on success, -1 if there is neither file
+//  nor its journal.
+ZM_ASSET_PRIVATE int
+    zm_devices_load (zm_devices_t *self, const char *file, size_t workers);
+
 //  Destroy the zm_devices
 ZM_ASSET_PRIVATE void
     zm_devices_destroy (zm_devices_t **self_p);
@@ -34,19 +48,104 @@ zm_devices_file (zm_devices_t *self);
 ZM_ASSET_PRIVATE void
 zm_devices_set_file (zm_devices_t *self, const char *file);
 
-//  Store devices
+//  Set whether store shall fsync the file before it replaces the old one
+ZM_ASSET_PRIVATE void
+zm_devices_set_fsync (zm_devices_t *self, bool fsync);
+
+//  Split snapshot to shard files file.0 ... file.N-1 by hash of device
+//  name, 0 or 1 means single file. Store writes only shards with changed
+//  devices, up to workers of them at once. Load finds out layout itself.
+ZM_ASSET_PRIVATE void
+zm_devices_set_shards (zm_devices_t *self, size_t shards, size_t workers);
+
+//  Limit number of devices and estimated memory kept in memory, 0 means no
+//  limit. Least recently looked up devices are evicted first; stored ones
+//  are loaded back from file on lookup, others are dropped. If
+//  persisted_only is true, only stored devices are evicted.
+ZM_ASSET_PRIVATE void
+    zm_devices_set_budget (zm_devices_t *self, size_t entries, size_t memory, bool persisted_only);
+
+//  Journal changes to file.journal, so changes made after last store are
+//  not lost. Journal is written by persistence thread, level is one of
+//  ZM_JOURNAL_* levels, 0 closes the journal. Journal is replayed on load
+//  and truncated by store. Returns -1 if there is no file or journal
+//  can't be opened.
+ZM_ASSET_PRIVATE int
+    zm_devices_set_journal (zm_devices_t *self, int level, size_t ring_size);
+
+//  Return number of changes in journal, replayed on load or journaled since,
+//  0 without journal. Store truncates journal.
+ZM_ASSET_PRIVATE uint64_t
+    zm_devices_journaled (zm_devices_t *self);
+
+//  Store devices, file is written to temporary file and renamed over the
+//  old one. Returns 0 on success, -1 on I/O error.
 ZM_ASSET_PRIVATE int
 zm_devices_store (zm_devices_t *self);
 
-ZM_ASSET_PRIVATE void
+//  Insert or update device. Returns stored device, which has new version
+//  in its ext. It is owned by the store.
+ZM_ASSET_PRIVATE zm_proto_t *
 zm_devices_insert (zm_devices_t *self, zm_proto_t *msg);
 
+//  Insert or update device copied from other store, it keeps version it
+//  carries in ext and the next versions of store are higher. Device without
+//  version is inserted as by zm_devices_insert. Returns stored device, it
+//  is owned by the store.
+ZM_ASSET_PRIVATE zm_proto_t *
+zm_devices_replicate (zm_devices_t *self, zm_proto_t *msg);
+
 ZM_ASSET_PRIVATE zm_proto_t*
 zm_devices_lookup (zm_devices_t *self, const char* name);
 
 ZM_ASSET_PRIVATE void
 zm_devices_delete (zm_devices_t *self, const char* name);
 
+//  Return device encoded by zm_proto_send as frame sharing buffer with the
+//  store, so LOOKUP reply is sent without encoding or copying it. Device is
+//  encoded once when it is inserted or first looked up after change. NULL
+//  if there is no such device. Caller destroys the frame.
+ZM_ASSET_PRIVATE zframe_t *
+    zm_devices_lookup_frame (zm_devices_t *self, const char *name);
+
+//  Return version of device, 0 if there is no such device
+ZM_ASSET_PRIVATE uint64_t
+    zm_devices_version (zm_devices_t *self, const char *name);
+
+//  Return hash tree over devices, it is updated by every change
+ZM_ASSET_PRIVATE zm_digest_t *
+    zm_devices_digest (zm_devices_t *self);
+
+//  Rebuild hash tree with 2^depth buckets
+ZM_ASSET_PRIVATE void
+    zm_devices_set_digest_depth (zm_devices_t *self, size_t depth);
+
+//  Count devices by comma separated list of ext attributes, NULL or empty
+//  list stops counting. Counts are built from devices in the store and then
+//  kept up to date by every change.
+ZM_ASSET_PRIVATE void
+    zm_devices_set_aggregate (zm_devices_t *self, const char *attributes);
+
+//  Return counts of devices by attributes, NULL if devices are not counted
+ZM_ASSET_PRIVATE zm_aggregate_t *
+    zm_devices_aggregate (zm_devices_t *self);
+
+//  Return copies of devices falling to bucket of digest. Caller destroys
+//  the list.
+ZM_ASSET_PRIVATE zlistx_t *
+    zm_devices_bucket (zm_devices_t *self, size_t bucket);
+
+//  Return copies of devices last updated before time, oldest first, at most
+//  limit of them. Listing starts after device after updated at after_time,
+//  which is the last device of previous page, NULL starts from the oldest
+//  device. Caller destroys the list.
+ZM_ASSET_PRIVATE zlistx_t *
+    zm_devices_stale (zm_devices_t *self, uint64_t before, uint64_t after_time, const char *after, size_t limit);
+
+//  Add statistics of lookups, evictions and of negative lookup filter to parent
+ZM_ASSET_PRIVATE void
+zm_devices_stats (zm_devices_t *self, zconfig_t *parent);
+
 //  Self test of this class
 ZM_ASSET_PRIVATE void
     zm_devices_test (bool verbose);
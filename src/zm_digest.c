@@ -0,0 +1,211 @@
+/*  =========================================================================
+    zm_digest - Hash tree over device buckets
+
+    Copyright (c) the Contributors as noted in the AUTHORS file.  This file is part
+    of zmon.it, the fast and scalable monitoring system.                           
+                                                                                   
+    This Source Code Form is subject to the terms of the Mozilla Public License, v.
+    2.0. If a copy of the MPL was not distributed with this file, You can obtain   
+    one at http://mozilla.org/MPL/2.0/.                                            
+    =========================================================================
+*/
+
+/*
+@header
+    zm_digest - Hash tree over device buckets
+@discuss
+    Devices are split to 2^depth buckets by top depth bits of 64-bit FNV-1a
+    hash of their name. Leaf hash is XOR of content hashes of devices in the
+    bucket, so it does not depend on order of inserts. Inner node hashes
+    both its children. Two stores with the same devices have the same root,
+    consumer which differs compares nodes level by level down to buckets
+    and fetches just those.
+
+    Tree is kept in an array, node i has children 2i and 2i+1 and root is
+    node 1. Update touches depth + 1 nodes.
+@end
+*/
+
+#include "zm_asset_classes.h"
+
+//  Structure of our class
+
+struct _zm_digest_t {
+    size_t depth;               //  Levels below root
+    uint64_t *nodes;            //  2^(depth+1) nodes, node 0 is unused
+};
+
+#define ZM_DIGEST_MAX_DEPTH 20
+
+
+//  --------------------------------------------------------------------------
+//  Create a new zm_digest
+
+zm_digest_t *
+zm_digest_new (size_t depth)
+{
+    zm_digest_t *self = (zm_digest_t *) zmalloc (sizeof (zm_digest_t));
+    assert (self);
+    if (depth < 1)
+        depth = 1;
+    if (depth > ZM_DIGEST_MAX_DEPTH)
+        depth = ZM_DIGEST_MAX_DEPTH;
+    self->depth = depth;
+    self->nodes = (uint64_t *) zmalloc (sizeof (uint64_t) << (depth + 1));
+    assert (self->nodes);
+    return self;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Destroy the zm_digest
+
+void
+zm_digest_destroy (zm_digest_t **self_p)
+{
+    assert (self_p);
+    if (*self_p) {
+        zm_digest_t *self = *self_p;
+        free (self->nodes);
+        free (self);
+        *self_p = NULL;
+    }
+}
+
+uint64_t
+zm_digest_hash (zm_proto_t *device)
+{
+    assert (device);
+    //  Attributes are combined by XOR, zhash iterates in arbitrary order
+    uint64_t attrs = 0;
+    zhash_t *ext = zm_proto_ext (device);
+    if (ext) {
+        const char *value = (const char *) zhash_first (ext);
+        while (value) {
+            //  Version is local to store, copies of device differ in it
+            if (!streq (zhash_cursor (ext), ZM_DEVICES_VERSION)) {
+                uint64_t hash = zm_hash_fnv (ZM_HASH_FNV_BASIS, zhash_cursor (ext));
+                hash = zm_hash_fnv (hash * ZM_HASH_FNV_PRIME, value);
+                attrs ^= zm_hash_mix (hash);
+            }
+            value = (const char *) zhash_next (ext);
+        }
+    }
+    uint64_t hash = zm_hash_mix (zm_hash_fnv (ZM_HASH_FNV_BASIS, zm_proto_device (device)) ^ zm_hash_mix (attrs + 1));
+    return hash? hash: 1;
+}
+
+void
+zm_digest_update (zm_digest_t *self, const char *name, uint64_t old_hash, uint64_t new_hash)
+{
+    assert (self);
+    assert (name);
+    if (old_hash == new_hash)
+        return;
+    size_t node = ((size_t) 1 << self->depth) + zm_digest_bucket (self, name);
+    self->nodes [node] ^= old_hash ^ new_hash;
+    while (node > 1) {
+        node /= 2;
+        uint64_t left = self->nodes [2 * node];
+        uint64_t right = self->nodes [2 * node + 1];
+        //  Empty subtree keeps zero hash
+        self->nodes [node] = left || right? zm_hash_mix (left ^ zm_hash_mix (right + 0x9e3779b97f4a7c15ULL)): 0;
+    }
+}
+
+size_t
+zm_digest_bucket (zm_digest_t *self, const char *name)
+{
+    assert (self);
+    assert (name);
+    return (size_t) (zm_hash_fnv (ZM_HASH_FNV_BASIS, name) >> (64 - self->depth));
+}
+
+size_t
+zm_digest_depth (zm_digest_t *self)
+{
+    assert (self);
+    return self->depth;
+}
+
+uint64_t
+zm_digest_node (zm_digest_t *self, size_t level, size_t index)
+{
+    assert (self);
+    assert (level <= self->depth);
+    assert (index < (size_t) 1 << level);
+    return self->nodes [((size_t) 1 << level) + index];
+}
+
+
+//  --------------------------------------------------------------------------
+//  Self test of this class
+
+void
+zm_digest_test (bool verbose)
+{
+    printf (" * zm_digest: ");
+
+    //  @selftest
+    zm_digest_t *self = zm_digest_new (8);
+    zm_digest_t *other = zm_digest_new (8);
+    assert (zm_digest_depth (self) == 8);
+    assert (zm_digest_node (self, 0, 0) == 0);
+
+    zm_proto_t *device = zm_proto_new ();
+    zhash_t *ext = zhash_new ();
+    zhash_insert (ext, "model", "X1");
+    zhash_insert (ext, "site", "prague");
+    zm_proto_encode_device (device, "device1", 1, 1000, ext);
+    uint64_t hash1 = zm_digest_hash (device);
+    zm_proto_encode_device (device, "device1", 2, 2000, ext);
+    assert (zm_digest_hash (device) == hash1);
+    zhash_destroy (&ext);
+    zm_proto_encode_device (device, "device1", 2, 2000, NULL);
+    assert (zm_digest_hash (device) != hash1);
+
+    //  Same devices inserted in different order give the same tree
+    char name [32];
+    int i;
+    for (i = 0; i != 1000; i++) {
+        snprintf (name, sizeof (name), "device%d", i);
+        zm_proto_encode_device (device, name, 0, 0, NULL);
+        zm_digest_update (self, name, 0, zm_digest_hash (device));
+        snprintf (name, sizeof (name), "device%d", 999 - i);
+        zm_proto_encode_device (device, name, 0, 0, NULL);
+        zm_digest_update (other, name, 0, zm_digest_hash (device));
+    }
+    assert (zm_digest_node (self, 0, 0) == zm_digest_node (other, 0, 0));
+
+    //  Changed device is found by descending differing nodes
+    zm_proto_encode_device (device, "device42", 0, 0, NULL);
+    uint64_t old_hash = zm_digest_hash (device);
+    ext = zhash_new ();
+    zhash_insert (ext, "model", "X2");
+    zm_proto_encode_device (device, "device42", 0, 0, ext);
+    zhash_destroy (&ext);
+    zm_digest_update (other, "device42", old_hash, zm_digest_hash (device));
+    assert (zm_digest_node (self, 0, 0) != zm_digest_node (other, 0, 0));
+    size_t level, index = 0;
+    for (level = 1; level <= 8; level++) {
+        index *= 2;
+        if (zm_digest_node (self, level, index) == zm_digest_node (other, level, index))
+            index++;
+        assert (zm_digest_node (self, level, index) != zm_digest_node (other, level, index));
+    }
+    assert (index == zm_digest_bucket (self, "device42"));
+
+    //  Removing all devices gives empty tree
+    for (i = 0; i != 1000; i++) {
+        snprintf (name, sizeof (name), "device%d", i);
+        zm_proto_encode_device (device, name, 0, 0, NULL);
+        zm_digest_update (self, name, zm_digest_hash (device), 0);
+    }
+    assert (zm_digest_node (self, 0, 0) == 0);
+
+    zm_proto_destroy (&device);
+    zm_digest_destroy (&other);
+    zm_digest_destroy (&self);
+    //  @end
+    printf ("OK\n");
+}
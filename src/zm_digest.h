@@ -0,0 +1,62 @@
+/*  =========================================================================
+    zm_digest - Hash tree over device buckets
+
+    Copyright (c) the Contributors as noted in the AUTHORS file.  This file is part
+    of zmon.it, the fast and scalable monitoring system.                           
+                                                                                   
+    This Source Code Form is subject to the terms of the Mozilla Public License, v.
+    2.0. If a copy of the MPL was not distributed with this file, You can obtain   
+    one at http://mozilla.org/MPL/2.0/.                                            
+    =========================================================================
+*/
+
+#ifndef ZM_DIGEST_H_INCLUDED
+#define ZM_DIGEST_H_INCLUDED
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//  @interface
+//  Create a new zm_digest with 2^depth buckets, depth is limited to 1..20
+ZM_ASSET_PRIVATE zm_digest_t *
+    zm_digest_new (size_t depth);
+
+//  Destroy the zm_digest
+ZM_ASSET_PRIVATE void
+    zm_digest_destroy (zm_digest_t **self_p);
+
+//  Return hash of device content, its name and ext attributes. Time, ttl
+//  and version are not part of it, so heartbeats do not change digest and
+//  copies of device in different stores have the same hash.
+ZM_ASSET_PRIVATE uint64_t
+    zm_digest_hash (zm_proto_t *device);
+
+//  Replace content hash of device name, 0 means device is not present. Only
+//  path from bucket of name to root is recomputed.
+ZM_ASSET_PRIVATE void
+    zm_digest_update (zm_digest_t *self, const char *name, uint64_t old_hash, uint64_t new_hash);
+
+//  Return bucket device name falls to
+ZM_ASSET_PRIVATE size_t
+    zm_digest_bucket (zm_digest_t *self, const char *name);
+
+//  Return depth of tree, leaves are on level depth and root on level 0
+ZM_ASSET_PRIVATE size_t
+    zm_digest_depth (zm_digest_t *self);
+
+//  Return hash of index-th node on level, level has 2^level nodes
+ZM_ASSET_PRIVATE uint64_t
+    zm_digest_node (zm_digest_t *self, size_t level, size_t index);
+
+//  Self test of this class
+ZM_ASSET_PRIVATE void
+    zm_digest_test (bool verbose);
+
+//  @end
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
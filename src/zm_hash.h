@@ -0,0 +1,59 @@
+/*  =========================================================================
+    zm_hash - Hashes of device names shared by private classes
+
+    Copyright (c) the Contributors as noted in the AUTHORS file.  This file is part
+    of zmon.it, the fast and scalable monitoring system.                           
+                                                                                   
+    This Source Code Form is subject to the terms of the Mozilla Public License, v.
+    2.0. If a copy of the MPL was not distributed with this file, You can obtain   
+    one at http://mozilla.org/MPL/2.0/.                                            
+    =========================================================================
+*/
+
+#ifndef ZM_HASH_H_INCLUDED
+#define ZM_HASH_H_INCLUDED
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//  Offset basis and prime of 64-bit FNV-1a
+#define ZM_HASH_FNV_BASIS 14695981039346656037ULL
+#define ZM_HASH_FNV_PRIME 1099511628211ULL
+
+//  Continue FNV-1a hash with bytes of key
+static inline uint64_t
+zm_hash_fnv (uint64_t hash, const char *key)
+{
+    while (*key) {
+        hash ^= (unsigned char) *key++;
+        hash *= ZM_HASH_FNV_PRIME;
+    }
+    return hash;
+}
+
+//  Finalizer of MurmurHash3, spreads bits of value over whole hash
+static inline uint64_t
+zm_hash_mix (uint64_t hash)
+{
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53ULL;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+//  FNV-1a of key followed by finalizer, so both low and high bits are well
+//  mixed
+static inline uint64_t
+zm_hash_string (const char *key)
+{
+    return zm_hash_mix (zm_hash_fnv (ZM_HASH_FNV_BASIS, key));
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,460 @@
+/*  =========================================================================
+    zm_index - Open addressing index of devices
+
+    Copyright (c) the Contributors as noted in the AUTHORS file.  This file is part
+    of zmon.it, the fast and scalable monitoring system.                           
+                                                                                   
+    This Source Code Form is subject to the terms of the Mozilla Public License, v.
+    2.0. If a copy of the MPL was not distributed with this file, You can obtain   
+    one at http://mozilla.org/MPL/2.0/.                                            
+    =========================================================================
+*/
+
+/*
+@header
+    zm_index - Open addressing index of devices
+@discuss
+    Hash table in style of Swiss table. Slots are kept in one array with
+    stored hash, key and item, there is one control byte per slot: empty,
+    deleted or 7 bits of the hash. Lookup probes group of 16 control bytes
+    at once (by SSE2 when available) and compares keys only for slots with
+    matching bits, so a miss rarely touches slots at all and a hit usually
+    touches just one. Groups are probed in triangular sequence which visits
+    all of them. Table grows at 7/8 load, stored hashes make rehash cheap.
+@end
+*/
+
+#include "zm_asset_classes.h"
+
+#if defined (__SSE2__)
+#include <emmintrin.h>
+#endif
+
+//  Item with its key and hash
+
+typedef struct {
+    uint64_t hash;              //  Hash of key
+    char *key;                  //  Owned copy of key
+    void *item;                 //  Item, owned if there is destructor
+} s_slot_t;
+
+//  Structure of our class
+
+struct _zm_index_t {
+    int8_t *ctrl;               //  Control bytes, one per slot
+    s_slot_t *slots;            //  Slots
+    size_t capacity;            //  Number of slots, power of two
+    size_t size;                //  Items in index
+    size_t growth_left;         //  Empty slots which can be used before rehash
+    size_t keys_memory;         //  Memory used by copies of keys
+    size_t cursor;              //  Slot of iterator
+    zm_index_destructor_fn *destructor;
+};
+
+#define ZM_INDEX_GROUP 16
+#define ZM_INDEX_EMPTY ((int8_t) -128)
+#define ZM_INDEX_DELETED ((int8_t) -2)
+#define ZM_INDEX_NONE ((size_t) -1)
+
+static int8_t
+s_index_h2 (uint64_t hash)
+{
+    return (int8_t) (hash >> 57);
+}
+
+//  Return bit mask of control bytes of group equal to byte
+static uint32_t
+s_group_match (const int8_t *ctrl, int8_t byte)
+{
+#if defined (__SSE2__)
+    __m128i group = _mm_loadu_si128 ((const __m128i *) ctrl);
+    return (uint32_t) _mm_movemask_epi8 (_mm_cmpeq_epi8 (group, _mm_set1_epi8 (byte)));
+#else
+    uint32_t mask = 0;
+    int i;
+    for (i = 0; i != ZM_INDEX_GROUP; i++)
+        if (ctrl [i] == byte)
+            mask |= 1u << i;
+    return mask;
+#endif
+}
+
+//  Return bit mask of empty or deleted control bytes of group, they are the
+//  only ones with the highest bit set
+static uint32_t
+s_group_match_free (const int8_t *ctrl)
+{
+#if defined (__SSE2__)
+    return (uint32_t) _mm_movemask_epi8 (_mm_loadu_si128 ((const __m128i *) ctrl));
+#else
+    uint32_t mask = 0;
+    int i;
+    for (i = 0; i != ZM_INDEX_GROUP; i++)
+        if (ctrl [i] < 0)
+            mask |= 1u << i;
+    return mask;
+#endif
+}
+
+//  Allocate empty table of capacity slots
+static void
+s_index_alloc (zm_index_t *self, size_t capacity)
+{
+    self->capacity = capacity;
+    self->ctrl = (int8_t *) malloc (capacity);
+    assert (self->ctrl);
+    memset (self->ctrl, ZM_INDEX_EMPTY, capacity);
+    self->slots = (s_slot_t *) zmalloc (capacity * sizeof (s_slot_t));
+    assert (self->slots);
+    self->growth_left = capacity / 8 * 7 - self->size;
+}
+
+//  Return slot of key, ZM_INDEX_NONE if there is no such key
+static size_t
+s_index_find (zm_index_t *self, const char *key, uint64_t hash)
+{
+    size_t mask = self->capacity / ZM_INDEX_GROUP - 1;
+    size_t group = (size_t) hash & mask;
+    int8_t h2 = s_index_h2 (hash);
+    size_t probe;
+    for (probe = 1; ; probe++) {
+        const int8_t *ctrl = self->ctrl + group * ZM_INDEX_GROUP;
+        uint32_t match = s_group_match (ctrl, h2);
+        while (match) {
+            size_t slot = group * ZM_INDEX_GROUP + __builtin_ctz (match);
+            if (self->slots [slot].hash == hash && streq (self->slots [slot].key, key))
+                return slot;
+            match &= match - 1;
+        }
+        if (s_group_match (ctrl, ZM_INDEX_EMPTY))
+            return ZM_INDEX_NONE;
+        group = (group + probe) & mask;
+    }
+}
+
+//  Return first empty or deleted slot in probe sequence of hash
+static size_t
+s_index_free_slot (zm_index_t *self, uint64_t hash)
+{
+    size_t mask = self->capacity / ZM_INDEX_GROUP - 1;
+    size_t group = (size_t) hash & mask;
+    size_t probe;
+    for (probe = 1; ; probe++) {
+        uint32_t match = s_group_match_free (self->ctrl + group * ZM_INDEX_GROUP);
+        if (match)
+            return group * ZM_INDEX_GROUP + __builtin_ctz (match);
+        group = (group + probe) & mask;
+    }
+}
+
+//  Move items to new table, twice as big if index is more than half full,
+//  otherwise of the same size just without deleted slots
+static void
+s_index_rehash (zm_index_t *self)
+{
+    int8_t *ctrl = self->ctrl;
+    s_slot_t *slots = self->slots;
+    size_t capacity = self->capacity;
+    s_index_alloc (self, self->size >= capacity / 16 * 7? capacity * 2: capacity);
+
+    size_t slot;
+    for (slot = 0; slot != capacity; slot++) {
+        if (ctrl [slot] < 0)
+            continue;
+        size_t target = s_index_free_slot (self, slots [slot].hash);
+        self->ctrl [target] = ctrl [slot];
+        self->slots [target] = slots [slot];
+    }
+    free (ctrl);
+    free (slots);
+}
+
+
+//  --------------------------------------------------------------------------
+//  Create a new zm_index
+
+zm_index_t *
+zm_index_new (void)
+{
+    zm_index_t *self = (zm_index_t *) zmalloc (sizeof (zm_index_t));
+    assert (self);
+    s_index_alloc (self, ZM_INDEX_GROUP);
+    self->cursor = ZM_INDEX_NONE;
+    return self;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Destroy the zm_index
+
+void
+zm_index_destroy (zm_index_t **self_p)
+{
+    assert (self_p);
+    if (*self_p) {
+        zm_index_t *self = *self_p;
+        size_t slot;
+        for (slot = 0; slot != self->capacity; slot++) {
+            if (self->ctrl [slot] < 0)
+                continue;
+            if (self->destructor)
+                self->destructor (&self->slots [slot].item);
+            free (self->slots [slot].key);
+        }
+        free (self->ctrl);
+        free (self->slots);
+        free (self);
+        *self_p = NULL;
+    }
+}
+
+void
+zm_index_set_destructor (zm_index_t *self, zm_index_destructor_fn destructor)
+{
+    assert (self);
+    self->destructor = destructor;
+}
+
+int
+zm_index_insert (zm_index_t *self, const char *key, void *item)
+{
+    assert (self);
+    assert (key);
+    uint64_t hash = zm_hash_string (key);
+    if (s_index_find (self, key, hash) != ZM_INDEX_NONE)
+        return -1;
+    if (!self->growth_left)
+        s_index_rehash (self);
+
+    size_t slot = s_index_free_slot (self, hash);
+    if (self->ctrl [slot] == ZM_INDEX_EMPTY)
+        self->growth_left--;
+    self->ctrl [slot] = s_index_h2 (hash);
+    self->slots [slot].hash = hash;
+    self->slots [slot].key = strdup (key);
+    self->slots [slot].item = item;
+    self->keys_memory += strlen (key) + 1;
+    self->size++;
+    return 0;
+}
+
+void *
+zm_index_lookup (zm_index_t *self, const char *key)
+{
+    assert (self);
+    assert (key);
+    size_t slot = s_index_find (self, key, zm_hash_string (key));
+    return slot == ZM_INDEX_NONE? NULL: self->slots [slot].item;
+}
+
+const char *
+zm_index_key (zm_index_t *self, const char *key)
+{
+    assert (self);
+    assert (key);
+    size_t slot = s_index_find (self, key, zm_hash_string (key));
+    return slot == ZM_INDEX_NONE? NULL: self->slots [slot].key;
+}
+
+void
+zm_index_delete (zm_index_t *self, const char *key)
+{
+    assert (self);
+    assert (key);
+    size_t slot = s_index_find (self, key, zm_hash_string (key));
+    if (slot == ZM_INDEX_NONE)
+        return;
+
+    s_slot_t *victim = &self->slots [slot];
+    if (self->destructor)
+        self->destructor (&victim->item);
+    self->keys_memory -= strlen (victim->key) + 1;
+    free (victim->key);
+    memset (victim, 0, sizeof (s_slot_t));
+    self->size--;
+    //  Probe never went past group which still has an empty slot, so the
+    //  slot can be empty again instead of deleted
+    int8_t *group = self->ctrl + slot / ZM_INDEX_GROUP * ZM_INDEX_GROUP;
+    if (s_group_match (group, ZM_INDEX_EMPTY)) {
+        self->ctrl [slot] = ZM_INDEX_EMPTY;
+        self->growth_left++;
+    }
+    else
+        self->ctrl [slot] = ZM_INDEX_DELETED;
+}
+
+size_t
+zm_index_size (zm_index_t *self)
+{
+    assert (self);
+    return self->size;
+}
+
+void *
+zm_index_first (zm_index_t *self)
+{
+    assert (self);
+    self->cursor = ZM_INDEX_NONE;
+    return zm_index_next (self);
+}
+
+void *
+zm_index_next (zm_index_t *self)
+{
+    assert (self);
+    size_t slot = self->cursor == ZM_INDEX_NONE? 0: self->cursor + 1;
+    while (slot < self->capacity && self->ctrl [slot] < 0)
+        slot++;
+    if (slot >= self->capacity) {
+        self->cursor = self->capacity;
+        return NULL;
+    }
+    self->cursor = slot;
+    return self->slots [slot].item;
+}
+
+const char *
+zm_index_cursor (zm_index_t *self)
+{
+    assert (self);
+    if (self->cursor >= self->capacity)
+        return NULL;
+    return self->slots [self->cursor].key;
+}
+
+size_t
+zm_index_memory (zm_index_t *self)
+{
+    assert (self);
+    return sizeof (zm_index_t)
+         + self->capacity * (1 + sizeof (s_slot_t))
+         + self->keys_memory;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Self test of this class
+
+void
+zm_index_test (bool verbose)
+{
+    printf (" * zm_index: ");
+
+    //  @selftest
+    zm_index_t *self = zm_index_new ();
+    assert (self);
+    assert (zm_index_size (self) == 0);
+    assert (!zm_index_first (self));
+    assert (!zm_index_lookup (self, "device1"));
+
+    assert (zm_index_insert (self, "device1", "one") == 0);
+    assert (zm_index_insert (self, "device1", "two") == -1);
+    assert (streq ((char *) zm_index_lookup (self, "device1"), "one"));
+    assert (streq ((char *) zm_index_first (self), "one"));
+    assert (streq (zm_index_cursor (self), "device1"));
+    assert (zm_index_key (self, "device1") == zm_index_cursor (self));
+    assert (!zm_index_key (self, "device2"));
+    assert (!zm_index_next (self));
+    zm_index_delete (self, "device1");
+    zm_index_delete (self, "device1");
+    assert (zm_index_size (self) == 0);
+    assert (!zm_index_lookup (self, "device1"));
+    zm_index_destroy (&self);
+
+    //  Items are destroyed by destructor
+    self = zm_index_new ();
+    zm_index_set_destructor (self, (zm_index_destructor_fn *) zstr_free);
+    char name [32];
+    int i;
+    for (i = 0; i != 10000; i++) {
+        snprintf (name, sizeof (name), "device%d", i);
+        assert (zm_index_insert (self, name, strdup (name)) == 0);
+    }
+    assert (zm_index_size (self) == 10000);
+    //  Deletes leave tombstones, inserts reuse them
+    for (i = 0; i != 10000; i += 2) {
+        snprintf (name, sizeof (name), "device%d", i);
+        zm_index_delete (self, name);
+    }
+    for (i = 0; i != 10000; i++) {
+        snprintf (name, sizeof (name), "device%d", i);
+        char *item = (char *) zm_index_lookup (self, name);
+        assert (i % 2? item && streq (item, name): !item);
+    }
+    for (i = 0; i != 100000; i++) {
+        snprintf (name, sizeof (name), "other%d", i % 5000);
+        zm_index_insert (self, name, strdup (name));
+        zm_index_delete (self, name);
+    }
+    assert (zm_index_size (self) == 5000);
+    size_t count = 0;
+    char *item = (char *) zm_index_first (self);
+    while (item) {
+        assert (streq (item, zm_index_cursor (self)));
+        count++;
+        item = (char *) zm_index_next (self);
+    }
+    assert (count == 5000);
+    zm_index_destroy (&self);
+
+    //  Benchmark against zhashx, 1M of keys in verbose mode
+    size_t keys = verbose? 1000000: 100000;
+    char **names = (char **) zmalloc (keys * sizeof (char *));
+    size_t keys_memory = 0;
+    for (i = 0; i != (int) keys; i++) {
+        names [i] = zsys_sprintf ("device-%d.example.com", i);
+        keys_memory += strlen (names [i]) + 1;
+    }
+    self = zm_index_new ();
+    zhashx_t *hash = zhashx_new ();
+
+    int64_t start = zclock_usecs ();
+    for (i = 0; i != (int) keys; i++)
+        zm_index_insert (self, names [i], names [i]);
+    int64_t index_insert = zclock_usecs () - start;
+    start = zclock_usecs ();
+    for (i = 0; i != (int) keys; i++)
+        zhashx_insert (hash, names [i], names [i]);
+    int64_t hash_insert = zclock_usecs () - start;
+
+    start = zclock_usecs ();
+    for (i = 0; i != (int) keys; i++)
+        assert (zm_index_lookup (self, names [(i * 7919) % keys]));
+    int64_t index_lookup = zclock_usecs () - start;
+    start = zclock_usecs ();
+    for (i = 0; i != (int) keys; i++)
+        assert (zhashx_lookup (hash, names [(i * 7919) % keys]));
+    int64_t hash_lookup = zclock_usecs () - start;
+
+    start = zclock_usecs ();
+    for (i = 0; i != (int) keys; i++)
+        assert (!zm_index_lookup (self, "missing-device"));
+    int64_t index_miss = zclock_usecs () - start;
+    start = zclock_usecs ();
+    for (i = 0; i != (int) keys; i++)
+        assert (!zhashx_lookup (hash, "missing-device"));
+    int64_t hash_miss = zclock_usecs () - start;
+
+    if (verbose) {
+        //  zhashx item has value, next, index, key and free_fn, each is
+        //  allocated on its own, buckets are array of pointers
+        size_t hash_memory = keys * (5 * sizeof (void *) + 16) + keys_memory
+                           + zhashx_size (hash) * sizeof (void *);
+        zsys_debug ("zm_index: %zu keys, insert index=%" PRIi64 "us zhashx=%" PRIi64 "us, "
+            "lookup index=%" PRIi64 "us zhashx=%" PRIi64 "us, "
+            "miss index=%" PRIi64 "us zhashx=%" PRIi64 "us",
+            keys, index_insert, hash_insert, index_lookup, hash_lookup, index_miss, hash_miss);
+        zsys_debug ("zm_index: memory index=%zu bytes, zhashx=~%zu bytes",
+            zm_index_memory (self), hash_memory);
+    }
+    assert (zm_index_size (self) == keys);
+    assert (zm_index_memory (self) < keys * 64 + keys_memory);
+
+    zhashx_destroy (&hash);
+    zm_index_destroy (&self);
+    for (i = 0; i != (int) keys; i++)
+        zstr_free (&names [i]);
+    free (names);
+    //  @end
+    printf ("OK\n");
+}
@@ -0,0 +1,84 @@
+/*  =========================================================================
+    zm_index - Open addressing index of devices
+
+    Copyright (c) the Contributors as noted in the AUTHORS file.  This file is part
+    of zmon.it, the fast and scalable monitoring system.                           
+                                                                                   
+    This Source Code Form is subject to the terms of the Mozilla Public License, v.
+    2.0. If a copy of the MPL was not distributed with this file, You can obtain   
+    one at http://mozilla.org/MPL/2.0/.                                            
+    =========================================================================
+*/
+
+#ifndef ZM_INDEX_H_INCLUDED
+#define ZM_INDEX_H_INCLUDED
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//  @interface
+//  Destroys item of index
+typedef void (zm_index_destructor_fn) (void **item);
+
+//  Create a new, empty zm_index
+ZM_ASSET_PRIVATE zm_index_t *
+    zm_index_new (void);
+
+//  Destroy the zm_index and its items
+ZM_ASSET_PRIVATE void
+    zm_index_destroy (zm_index_t **self_p);
+
+//  Set destructor of items, it is called by delete and destroy
+ZM_ASSET_PRIVATE void
+    zm_index_set_destructor (zm_index_t *self, zm_index_destructor_fn destructor);
+
+//  Insert item under key, key is copied. Returns -1 if key already exists.
+ZM_ASSET_PRIVATE int
+    zm_index_insert (zm_index_t *self, const char *key, void *item);
+
+//  Return item of key, NULL if there is no such key
+ZM_ASSET_PRIVATE void *
+    zm_index_lookup (zm_index_t *self, const char *key);
+
+//  Return copy of key owned by index, NULL if there is no such key. It is
+//  valid until key is deleted.
+ZM_ASSET_PRIVATE const char *
+    zm_index_key (zm_index_t *self, const char *key);
+
+//  Delete key and destroy its item, if key exists
+ZM_ASSET_PRIVATE void
+    zm_index_delete (zm_index_t *self, const char *key);
+
+//  Return number of items
+ZM_ASSET_PRIVATE size_t
+    zm_index_size (zm_index_t *self);
+
+//  Return first item, NULL if index is empty. Index must not be changed
+//  while it is iterated.
+ZM_ASSET_PRIVATE void *
+    zm_index_first (zm_index_t *self);
+
+//  Return next item, NULL if there are no more items
+ZM_ASSET_PRIVATE void *
+    zm_index_next (zm_index_t *self);
+
+//  Return key of item last returned by first or next
+ZM_ASSET_PRIVATE const char *
+    zm_index_cursor (zm_index_t *self);
+
+//  Return memory used by index and its keys, bytes
+ZM_ASSET_PRIVATE size_t
+    zm_index_memory (zm_index_t *self);
+
+//  Self test of this class
+ZM_ASSET_PRIVATE void
+    zm_index_test (bool verbose);
+
+//  @end
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,463 @@
+/*  =========================================================================
+    zm_journal - Journal of device changes written by persistence thread
+
+    Copyright (c) the Contributors as noted in the AUTHORS file.  This file is part
+    of zmon.it, the fast and scalable monitoring system.                           
+                                                                                   
+    This Source Code Form is subject to the terms of the Mozilla Public License, v.
+    2.0. If a copy of the MPL was not distributed with this file, You can obtain   
+    one at http://mozilla.org/MPL/2.0/.                                            
+    =========================================================================
+*/
+
+/*
+@header
+    zm_journal - Journal of device changes written by persistence thread
+@discuss
+    Actor thread appends changes to a single-producer/single-consumer ring,
+    persistence thread takes all waiting changes at once, writes them and
+    with FSYNC level calls one fsync for the whole batch (group commit), so
+    actor does not wait for disk. Ring indexes are only ever written by one
+    side each and published by release stores, no lock is taken.
+
+    Idle persistence thread sleeps on its pipe. Producer sends it WAKE only
+    when it appends to ring thread may be sleeping on, changes appended
+    while thread writes are taken by its next batch. Producer which has to
+    wait, for SYNC level or for room in full ring, sends SYNC and waits
+    for signal thread sends when ring is written.
+
+    Journal file is a sequence of records: 4 bytes of length in network
+    order, op byte ('I' or 'D') and zm_proto message encoded by zmsg_encode.
+@end
+*/
+
+#include "zm_asset_classes.h"
+
+//  Change waiting in ring
+
+typedef struct {
+    char op;                    //  'I', 'D' or 'T' to truncate journal
+    zframe_t *frame;            //  Encoded device, NULL for truncate
+} s_entry_t;
+
+static s_entry_t *
+s_entry_new (char op, zm_proto_t *device)
+{
+    s_entry_t *self = (s_entry_t *) zmalloc (sizeof (s_entry_t));
+    assert (self);
+    self->op = op;
+    if (device) {
+        zmsg_t *msg = zmsg_new ();
+        zm_proto_send (device, msg);
+        self->frame = zmsg_encode (msg);
+        zmsg_destroy (&msg);
+    }
+    return self;
+}
+
+static void
+s_entry_destroy (s_entry_t **self_p)
+{
+    assert (self_p);
+    if (*self_p) {
+        s_entry_t *self = *self_p;
+        zframe_destroy (&self->frame);
+        free (self);
+        *self_p = NULL;
+    }
+}
+
+//  Structure of our class
+
+struct _zm_journal_t {
+    char *file;                 //  Journal file
+    int level;                  //  Durability level
+    FILE *handle;               //  Journal file, used by persistence thread
+    s_entry_t **ring;           //  Changes passed to persistence thread
+    uint64_t ring_size;         //  Slots in ring
+    uint64_t head;              //  Next slot to take, written by consumer
+    uint64_t tail;              //  Next slot to fill, written by producer
+    zactor_t *writer;           //  Persistence thread
+    bool idle;                  //  Persistence thread may sleep, wake it up
+    //  Written by producer
+    uint64_t appended;          //  Changes appended
+    uint64_t truncated;         //  Changes appended before last truncate
+    uint64_t full;              //  Appends which waited for free slot
+    uint64_t max_depth;         //  Most changes waiting in ring
+    //  Written by consumer
+    uint64_t committed;         //  Changes written, and fsynced if required
+    uint64_t batches;           //  Batches written
+    uint64_t fsyncs;            //  Calls of fsync
+    uint64_t errors;            //  Failed writes
+};
+
+//  Longest sleep of idle persistence thread, msec
+#define ZM_JOURNAL_IDLE_TIMEOUT 1000
+
+//  Write one change to journal file
+static int
+s_journal_write (zm_journal_t *self, s_entry_t *entry)
+{
+    if (entry->op == 'T') {
+        fflush (self->handle);
+        return ftruncate (fileno (self->handle), 0);
+    }
+    size_t size = zframe_size (entry->frame) + 1;
+    byte header [5] = {
+        (byte) (size >> 24), (byte) (size >> 16), (byte) (size >> 8), (byte) size,
+        (byte) entry->op
+    };
+    if (fwrite (header, 1, sizeof (header), self->handle) != sizeof (header)
+    ||  fwrite (zframe_data (entry->frame), 1, size - 1, self->handle) != size - 1)
+        return -1;
+    return 0;
+}
+
+//  Write all changes waiting in ring as one batch
+static void
+s_journal_commit (zm_journal_t *self)
+{
+    uint64_t head = self->head;
+    uint64_t tail = __atomic_load_n (&self->tail, __ATOMIC_ACQUIRE);
+    if (head == tail)
+        return;
+
+    int rc = 0;
+    uint64_t count = tail - head;
+    while (head != tail) {
+        s_entry_t *entry = self->ring [head % self->ring_size];
+        if (s_journal_write (self, entry) == -1)
+            rc = -1;
+        s_entry_destroy (&entry);
+        head++;
+    }
+    //  Slots are free again, changes are copied out
+    __atomic_store_n (&self->head, head, __ATOMIC_RELEASE);
+
+    if (fflush (self->handle) != 0)
+        rc = -1;
+    if (self->level >= ZM_JOURNAL_FSYNC) {
+        if (fsync (fileno (self->handle)) != 0)
+            rc = -1;
+        __atomic_add_fetch (&self->fsyncs, 1, __ATOMIC_RELAXED);
+    }
+    if (rc == -1) {
+        if (__atomic_add_fetch (&self->errors, 1, __ATOMIC_RELAXED) == 1)
+            zsys_error ("zm_journal: can't write %s: %s", self->file, strerror (errno));
+    }
+    __atomic_add_fetch (&self->batches, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch (&self->committed, count, __ATOMIC_RELEASE);
+}
+
+//  Persistence thread, it writes ring until it is empty and then sleeps
+//  until it is woken up by WAKE or SYNC
+
+static void
+s_journal_writer (zsock_t *pipe, void *args)
+{
+    zm_journal_t *self = (zm_journal_t *) args;
+    zpoller_t *poller = zpoller_new (pipe, NULL);
+    zsock_signal (pipe, 0);
+
+    bool terminated = false;
+    while (!terminated) {
+        //  Producer stores tail and then looks at idle, we do it the other
+        //  way round, so either it wakes us up or we see its change
+        __atomic_store_n (&self->idle, true, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n (&self->tail, __ATOMIC_SEQ_CST) != self->head) {
+            __atomic_store_n (&self->idle, false, __ATOMIC_SEQ_CST);
+            s_journal_commit (self);
+            continue;
+        }
+        zsock_t *which = (zsock_t *) zpoller_wait (poller, ZM_JOURNAL_IDLE_TIMEOUT);
+        if (which == pipe) {
+            char *command = zstr_recv (pipe);
+            s_journal_commit (self);
+            if (!command || streq (command, "$TERM"))
+                terminated = true;
+            else
+            if (streq (command, "SYNC"))
+                zsock_signal (pipe, 0);
+            zstr_free (&command);
+        }
+        else
+        if (zpoller_terminated (poller)) {
+            s_journal_commit (self);
+            terminated = true;
+        }
+    }
+    zpoller_destroy (&poller);
+}
+
+
+//  --------------------------------------------------------------------------
+//  Create a new zm_journal
+
+zm_journal_t *
+zm_journal_new (const char *file, int level, size_t ring_size)
+{
+    assert (file);
+    zm_journal_t *self = (zm_journal_t *) zmalloc (sizeof (zm_journal_t));
+    assert (self);
+    self->handle = fopen (file, "ab");
+    if (!self->handle) {
+        zsys_error ("zm_journal: can't open %s: %s", file, strerror (errno));
+        free (self);
+        return NULL;
+    }
+    self->file = strdup (file);
+    self->level = level;
+    self->ring_size = ring_size? ring_size: 1;
+    self->ring = (s_entry_t **) zmalloc (self->ring_size * sizeof (s_entry_t *));
+    assert (self->ring);
+    self->writer = zactor_new (s_journal_writer, self);
+    assert (self->writer);
+    return self;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Destroy the zm_journal
+
+void
+zm_journal_destroy (zm_journal_t **self_p)
+{
+    assert (self_p);
+    if (*self_p) {
+        zm_journal_t *self = *self_p;
+        //  Writer commits what is left in ring before it ends
+        zactor_destroy (&self->writer);
+        fclose (self->handle);
+        free (self->ring);
+        zstr_free (&self->file);
+        free (self);
+        *self_p = NULL;
+    }
+}
+
+static void
+s_journal_push (zm_journal_t *self, s_entry_t *entry)
+{
+    uint64_t tail = self->tail;
+    if (tail - __atomic_load_n (&self->head, __ATOMIC_ACQUIRE) == self->ring_size) {
+        //  Backpressure, wait for persistence thread to make room
+        self->full++;
+        zm_journal_sync (self);
+    }
+    self->ring [tail % self->ring_size] = entry;
+    __atomic_store_n (&self->tail, tail + 1, __ATOMIC_SEQ_CST);
+    self->appended++;
+    uint64_t depth = tail + 1 - __atomic_load_n (&self->head, __ATOMIC_ACQUIRE);
+    if (depth > self->max_depth)
+        self->max_depth = depth;
+    if (self->level == ZM_JOURNAL_SYNC)
+        zm_journal_sync (self);
+    else
+    if (__atomic_exchange_n (&self->idle, false, __ATOMIC_SEQ_CST))
+        zstr_send (self->writer, "WAKE");
+}
+
+void
+zm_journal_append (zm_journal_t *self, char op, zm_proto_t *device)
+{
+    assert (self);
+    assert (op == 'I' || op == 'D');
+    assert (device);
+    s_journal_push (self, s_entry_new (op, device));
+}
+
+void
+zm_journal_truncate (zm_journal_t *self)
+{
+    assert (self);
+    s_journal_push (self, s_entry_new ('T', NULL));
+    self->truncated = self->appended;
+}
+
+uint64_t
+zm_journal_size (zm_journal_t *self)
+{
+    assert (self);
+    return self->appended - self->truncated;
+}
+
+void
+zm_journal_sync (zm_journal_t *self)
+{
+    assert (self);
+    if (__atomic_load_n (&self->committed, __ATOMIC_ACQUIRE) < self->appended) {
+        zstr_send (self->writer, "SYNC");
+        zsock_wait (self->writer);
+    }
+}
+
+int
+zm_journal_replay (const char *file, zm_journal_fn *fn, void *arg)
+{
+    assert (file);
+    assert (fn);
+    FILE *handle = fopen (file, "rb");
+    if (!handle)
+        return -1;
+
+    int count = 0;
+    byte header [4];
+    byte *buffer = NULL;
+    size_t buffer_size = 0;
+    zm_proto_t *device = zm_proto_new ();
+    while (fread (header, 1, sizeof (header), handle) == sizeof (header)) {
+        size_t size = (size_t) header [0] << 24 | (size_t) header [1] << 16
+                    | (size_t) header [2] << 8 | (size_t) header [3];
+        if (size < 1)
+            break;
+        if (size > buffer_size) {
+            buffer_size = size;
+            buffer = (byte *) realloc (buffer, buffer_size);
+            assert (buffer);
+        }
+        if (fread (buffer, 1, size, handle) != size)
+            break;          //  Record was not written completely
+
+        zframe_t *frame = zframe_new (buffer + 1, size - 1);
+        zmsg_t *msg = zmsg_decode (frame);
+        zframe_destroy (&frame);
+        if (msg && zm_proto_recv (device, msg) == 0
+        &&  (buffer [0] == 'I' || buffer [0] == 'D')) {
+            fn (arg, (char) buffer [0], device);
+            count++;
+        }
+        else
+            zsys_warning ("zm_journal: skipping malformed record in %s", file);
+        zmsg_destroy (&msg);
+    }
+    zm_proto_destroy (&device);
+    free (buffer);
+    fclose (handle);
+    return count;
+}
+
+void
+zm_journal_stats (zm_journal_t *self, zconfig_t *parent)
+{
+    assert (self);
+    assert (parent);
+    uint64_t committed = __atomic_load_n (&self->committed, __ATOMIC_ACQUIRE);
+    zconfig_putf (parent, "level", "%d", self->level);
+    zconfig_putf (parent, "appended", "%" PRIu64, self->appended);
+    zconfig_putf (parent, "size", "%" PRIu64, zm_journal_size (self));
+    zconfig_putf (parent, "committed", "%" PRIu64, committed);
+    zconfig_putf (parent, "pending", "%" PRIu64, self->appended - committed);
+    zconfig_putf (parent, "batches", "%" PRIu64, __atomic_load_n (&self->batches, __ATOMIC_RELAXED));
+    zconfig_putf (parent, "fsyncs", "%" PRIu64, __atomic_load_n (&self->fsyncs, __ATOMIC_RELAXED));
+    zconfig_putf (parent, "errors", "%" PRIu64, __atomic_load_n (&self->errors, __ATOMIC_RELAXED));
+    zconfig_putf (parent, "full", "%" PRIu64, self->full);
+    zconfig_putf (parent, "max_depth", "%" PRIu64, self->max_depth);
+}
+
+
+//  --------------------------------------------------------------------------
+//  Self test of this class
+
+static void
+s_test_replay (void *arg, char op, zm_proto_t *device)
+{
+    zhashx_t *devices = (zhashx_t *) arg;
+    if (op == 'I')
+        zhashx_update (devices, zm_proto_device (device), (void *) "I");
+    else
+        zhashx_delete (devices, zm_proto_device (device));
+}
+
+void
+zm_journal_test (bool verbose)
+{
+    printf (" * zm_journal: ");
+
+    //  @selftest
+    const char *file = ".zm_journal_test";
+    zsys_file_delete (file);
+
+    //  Small ring makes producer wait for persistence thread
+    zm_journal_t *self = zm_journal_new (file, ZM_JOURNAL_FSYNC, 16);
+    assert (self);
+    zm_proto_t *device = zm_proto_new ();
+    char name [32];
+    int i;
+    int64_t start = zclock_usecs ();
+    for (i = 0; i != 10000; i++) {
+        snprintf (name, sizeof (name), "device%d", i % 100);
+        zm_proto_encode_device (device, name, i, 1000, NULL);
+        zm_journal_append (self, i % 10 == 9? 'D': 'I', device);
+    }
+    zm_journal_sync (self);
+    int64_t usecs = zclock_usecs () - start;
+
+    zconfig_t *stats = zconfig_new ("stats", NULL);
+    zm_journal_stats (self, stats);
+    assert (streq (zconfig_get (stats, "committed", ""), "10000"));
+    assert (streq (zconfig_get (stats, "pending", ""), "0"));
+    assert (atoi (zconfig_get (stats, "max_depth", "0")) <= 16);
+    //  Group commit, much less fsyncs than changes
+    assert (atoi (zconfig_get (stats, "fsyncs", "0")) < 10000);
+    if (verbose)
+        zsys_debug ("zm_journal: 10000 changes in %" PRIi64 "us, %s batches, ring full %s times",
+            usecs, zconfig_get (stats, "batches", ""), zconfig_get (stats, "full", ""));
+    zconfig_destroy (&stats);
+
+    zhashx_t *devices = zhashx_new ();
+    assert (zm_journal_replay (file, s_test_replay, devices) == 10000);
+    //  Last change of device%d with d % 10 == 9 is delete
+    assert (zhashx_size (devices) == 90);
+    assert (!zhashx_lookup (devices, "device9"));
+    zhashx_purge (devices);
+
+    //  Truncated journal replays only later changes
+    assert (zm_journal_size (self) == 10000);
+    zm_journal_truncate (self);
+    assert (zm_journal_size (self) == 0);
+    zm_proto_encode_device (device, "device1", 0, 1000, NULL);
+    zm_journal_append (self, 'I', device);
+    assert (zm_journal_size (self) == 1);
+    zm_journal_destroy (&self);
+    assert (zm_journal_replay (file, s_test_replay, devices) == 1);
+    assert (zhashx_lookup (devices, "device1"));
+
+    //  Idle persistence thread is woken up by append
+    self = zm_journal_new (file, ZM_JOURNAL_ASYNC, 16);
+    zm_proto_encode_device (device, "device2", 0, 1000, NULL);
+    zm_journal_append (self, 'I', device);
+    start = zclock_mono ();
+    stats = zconfig_new ("stats", NULL);
+    zm_journal_stats (self, stats);
+    while (!streq (zconfig_get (stats, "pending", ""), "0")) {
+        assert (zclock_mono () - start < ZM_JOURNAL_IDLE_TIMEOUT / 2);
+        zclock_sleep (1);
+        zconfig_destroy (&stats);
+        stats = zconfig_new ("stats", NULL);
+        zm_journal_stats (self, stats);
+    }
+    zconfig_destroy (&stats);
+    zm_journal_destroy (&self);
+    zhashx_purge (devices);
+    assert (zm_journal_replay (file, s_test_replay, devices) == 2);
+    assert (zhashx_lookup (devices, "device2"));
+
+    //  Synchronous level returns when change is written
+    self = zm_journal_new (file, ZM_JOURNAL_SYNC, 16);
+    zm_journal_append (self, 'D', device);
+    stats = zconfig_new ("stats", NULL);
+    zm_journal_stats (self, stats);
+    assert (streq (zconfig_get (stats, "pending", ""), "0"));
+    zconfig_destroy (&stats);
+    zm_journal_destroy (&self);
+    zhashx_purge (devices);
+    assert (zm_journal_replay (file, s_test_replay, devices) == 3);
+    assert (zhashx_size (devices) == 1);
+    zhashx_destroy (&devices);
+
+    assert (zm_journal_replay (".does-not-exist", s_test_replay, NULL) == -1);
+    zm_proto_destroy (&device);
+    zsys_file_delete (file);
+    //  @end
+    printf ("OK\n");
+}
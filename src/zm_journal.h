@@ -0,0 +1,76 @@
+/*  =========================================================================
+    zm_journal - Journal of device changes written by persistence thread
+
+    Copyright (c) the Contributors as noted in the AUTHORS file.  This file is part
+    of zmon.it, the fast and scalable monitoring system.                           
+                                                                                   
+    This Source Code Form is subject to the terms of the Mozilla Public License, v.
+    2.0. If a copy of the MPL was not distributed with this file, You can obtain   
+    one at http://mozilla.org/MPL/2.0/.                                            
+    =========================================================================
+*/
+
+#ifndef ZM_JOURNAL_H_INCLUDED
+#define ZM_JOURNAL_H_INCLUDED
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//  @interface
+//  Durability levels
+#define ZM_JOURNAL_ASYNC 1          //  Changes are written, never fsynced
+#define ZM_JOURNAL_FSYNC 2          //  Every batch of changes is fsynced
+#define ZM_JOURNAL_SYNC 3           //  As FSYNC, append waits for fsync
+
+//  Callback of replay, op is 'I' for insert and 'D' for delete
+typedef void (zm_journal_fn) (void *arg, char op, zm_proto_t *device);
+
+//  Create a new zm_journal appending to file, changes are passed to
+//  persistence thread through ring of ring_size entries. Returns NULL if
+//  file can't be opened.
+ZM_ASSET_PRIVATE zm_journal_t *
+    zm_journal_new (const char *file, int level, size_t ring_size);
+
+//  Destroy the zm_journal, changes in ring are written first
+ZM_ASSET_PRIVATE void
+    zm_journal_destroy (zm_journal_t **self_p);
+
+//  Append change of device, op is 'I' for insert and 'D' for delete. When
+//  ring is full, caller waits for persistence thread.
+ZM_ASSET_PRIVATE void
+    zm_journal_append (zm_journal_t *self, char op, zm_proto_t *device);
+
+//  Drop changes appended so far, call it once they are stored in snapshot
+ZM_ASSET_PRIVATE void
+    zm_journal_truncate (zm_journal_t *self);
+
+//  Return number of changes appended since journal was opened or last
+//  truncated
+ZM_ASSET_PRIVATE uint64_t
+    zm_journal_size (zm_journal_t *self);
+
+//  Wait until all appended changes are written
+ZM_ASSET_PRIVATE void
+    zm_journal_sync (zm_journal_t *self);
+
+//  Call fn for every change in journal file, in order. Incomplete record at
+//  the end is ignored. Returns number of changes, -1 if file can't be read.
+ZM_ASSET_PRIVATE int
+    zm_journal_replay (const char *file, zm_journal_fn *fn, void *arg);
+
+//  Add statistics of journal to parent
+ZM_ASSET_PRIVATE void
+    zm_journal_stats (zm_journal_t *self, zconfig_t *parent);
+
+//  Self test of this class
+ZM_ASSET_PRIVATE void
+    zm_journal_test (bool verbose);
+
+//  @end
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,322 @@
+/*  =========================================================================
+    zm_watches - Watchers of devices
+
+    Copyright (c) the Contributors as noted in the AUTHORS file.  This file is part
+    of zmon.it, the fast and scalable monitoring system.                           
+                                                                                   
+    This Source Code Form is subject to the terms of the Mozilla Public License, v.
+    2.0. If a copy of the MPL was not distributed with this file, You can obtain   
+    one at http://mozilla.org/MPL/2.0/.                                            
+    =========================================================================
+*/
+
+/*
+@header
+    zm_watches - Watchers of devices
+@discuss
+    Reverse index from device names and name prefixes to watchers. Exact
+    names and prefixes are kept in separate hashes, for a name of length L
+    only prefix lengths which are actually watched are looked up, so match
+    costs at most L hash lookups regardless of number of watchers.
+
+    Each watch has a lease, watchers which stop renewing it are forgotten.
+@end
+*/
+
+#include "zm_asset_classes.h"
+
+//  Longest prefix which can be watched
+#define ZM_WATCHES_PREFIX_MAX 256
+
+//  Structure of our class
+
+struct _zm_watches_t {
+    zhashx_t *names;            //  Device name -> hash of watcher -> expiry
+    zhashx_t *prefixes;         //  Name prefix -> hash of watcher -> expiry
+    size_t lengths [ZM_WATCHES_PREFIX_MAX + 1];  //  Prefixes of given length
+    size_t size;                //  Number of watches
+};
+
+static void
+s_watchers_destroy (zhashx_t **self_p)
+{
+    zhashx_destroy (self_p);
+}
+
+//  --------------------------------------------------------------------------
+//  Create a new zm_watches
+
+zm_watches_t *
+zm_watches_new (void)
+{
+    zm_watches_t *self = (zm_watches_t *) zmalloc (sizeof (zm_watches_t));
+    assert (self);
+    self->names = zhashx_new ();
+    assert (self->names);
+    zhashx_set_destructor (self->names, (zhashx_destructor_fn *) s_watchers_destroy);
+    self->prefixes = zhashx_new ();
+    assert (self->prefixes);
+    zhashx_set_destructor (self->prefixes, (zhashx_destructor_fn *) s_watchers_destroy);
+    return self;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Destroy the zm_watches
+
+void
+zm_watches_destroy (zm_watches_t **self_p)
+{
+    assert (self_p);
+    if (*self_p) {
+        zm_watches_t *self = *self_p;
+        zhashx_destroy (&self->names);
+        zhashx_destroy (&self->prefixes);
+        free (self);
+        *self_p = NULL;
+    }
+}
+
+//  Split pattern to key and map it belongs to, caller frees key
+static zhashx_t *
+s_watches_map (zm_watches_t *self, const char *pattern, char **key_p)
+{
+    size_t len = strlen (pattern);
+    if (len && pattern [len - 1] == '*') {
+        if (len - 1 > ZM_WATCHES_PREFIX_MAX)
+            return NULL;
+        *key_p = strndup (pattern, len - 1);
+        return self->prefixes;
+    }
+    if (!len)
+        return NULL;
+    *key_p = strdup (pattern);
+    return self->names;
+}
+
+//  Remove watcher of key, drop key if nobody watches it anymore
+static void
+s_watches_remove (zm_watches_t *self, zhashx_t *map, const char *key, const char *watcher)
+{
+    zhashx_t *watchers = (zhashx_t *) zhashx_lookup (map, key);
+    if (!watchers || !zhashx_lookup (watchers, watcher))
+        return;
+    zhashx_delete (watchers, watcher);
+    self->size--;
+    if (zhashx_size (watchers) == 0) {
+        if (map == self->prefixes)
+            self->lengths [strlen (key)]--;
+        zhashx_delete (map, key);
+    }
+}
+
+int
+zm_watches_insert (zm_watches_t *self, const char *watcher, const char *pattern, int64_t lease)
+{
+    assert (self);
+    assert (watcher);
+    assert (pattern);
+
+    char *key = NULL;
+    zhashx_t *map = s_watches_map (self, pattern, &key);
+    if (!map)
+        return -1;
+
+    zhashx_t *watchers = (zhashx_t *) zhashx_lookup (map, key);
+    if (!watchers) {
+        watchers = zhashx_new ();
+        assert (watchers);
+        zhashx_set_destructor (watchers, (zhashx_destructor_fn *) zstr_free);
+        zhashx_insert (map, key, watchers);
+        if (map == self->prefixes)
+            self->lengths [strlen (key)]++;
+    }
+    if (!zhashx_lookup (watchers, watcher))
+        self->size++;
+
+    //  Expiry is stored as decimal string to keep hash values uniform
+    zhashx_update (watchers, watcher, zsys_sprintf ("%" PRIi64, zclock_mono () + lease));
+    zstr_free (&key);
+    return 0;
+}
+
+void
+zm_watches_delete (zm_watches_t *self, const char *watcher, const char *pattern)
+{
+    assert (self);
+    assert (watcher);
+    assert (pattern);
+
+    char *key = NULL;
+    zhashx_t *map = s_watches_map (self, pattern, &key);
+    if (map)
+        s_watches_remove (self, map, key, watcher);
+    zstr_free (&key);
+}
+
+//  Remove watches of watcher, or expired ones if watcher is NULL
+static size_t
+s_watches_sweep (zm_watches_t *self, zhashx_t *map, const char *watcher, int64_t now)
+{
+    zlistx_t *keys = zlistx_new ();
+    zlistx_t *victims = zlistx_new ();
+    zlistx_set_destructor (keys, (zlistx_destructor_fn *) zstr_free);
+    zlistx_set_destructor (victims, (zlistx_destructor_fn *) zstr_free);
+
+    zhashx_t *watchers = (zhashx_t *) zhashx_first (map);
+    while (watchers) {
+        char *expires = (char *) zhashx_first (watchers);
+        while (expires) {
+            const char *cursor = (const char *) zhashx_cursor (watchers);
+            if (watcher? streq (cursor, watcher): atoll (expires) <= now) {
+                zlistx_add_end (keys, strdup ((const char *) zhashx_cursor (map)));
+                zlistx_add_end (victims, strdup (cursor));
+            }
+            expires = (char *) zhashx_next (watchers);
+        }
+        watchers = (zhashx_t *) zhashx_next (map);
+    }
+
+    size_t removed = zlistx_size (victims);
+    const char *key = (const char *) zlistx_first (keys);
+    const char *victim = (const char *) zlistx_first (victims);
+    while (key) {
+        s_watches_remove (self, map, key, victim);
+        key = (const char *) zlistx_next (keys);
+        victim = (const char *) zlistx_next (victims);
+    }
+    zlistx_destroy (&keys);
+    zlistx_destroy (&victims);
+    return removed;
+}
+
+void
+zm_watches_purge (zm_watches_t *self, const char *watcher)
+{
+    assert (self);
+    assert (watcher);
+    s_watches_sweep (self, self->names, watcher, 0);
+    s_watches_sweep (self, self->prefixes, watcher, 0);
+}
+
+size_t
+zm_watches_expire (zm_watches_t *self)
+{
+    assert (self);
+    int64_t now = zclock_mono ();
+    return s_watches_sweep (self, self->names, NULL, now)
+         + s_watches_sweep (self, self->prefixes, NULL, now);
+}
+
+//  Add live watchers from hash to result, skip those already there
+static void
+s_watches_collect (zhashx_t *watchers, zlistx_t **result_p, int64_t now)
+{
+    if (!watchers)
+        return;
+    char *expires = (char *) zhashx_first (watchers);
+    while (expires) {
+        if (atoll (expires) > now) {
+            const char *watcher = (const char *) zhashx_cursor (watchers);
+            if (!*result_p) {
+                *result_p = zlistx_new ();
+                zlistx_set_destructor (*result_p, (zlistx_destructor_fn *) zstr_free);
+                zlistx_set_comparator (*result_p, (zlistx_comparator_fn *) strcmp);
+            }
+            if (!zlistx_find (*result_p, (void *) watcher))
+                zlistx_add_end (*result_p, strdup (watcher));
+        }
+        expires = (char *) zhashx_next (watchers);
+    }
+}
+
+zlistx_t *
+zm_watches_match (zm_watches_t *self, const char *name)
+{
+    assert (self);
+    assert (name);
+
+    zlistx_t *result = NULL;
+    int64_t now = zclock_mono ();
+    s_watches_collect ((zhashx_t *) zhashx_lookup (self->names, name), &result, now);
+
+    size_t len = strlen (name);
+    if (len > ZM_WATCHES_PREFIX_MAX)
+        len = ZM_WATCHES_PREFIX_MAX;
+    char prefix [ZM_WATCHES_PREFIX_MAX + 1];
+    size_t i;
+    for (i = 0; i <= len; i++) {
+        if (!self->lengths [i])
+            continue;
+        memcpy (prefix, name, i);
+        prefix [i] = 0;
+        s_watches_collect ((zhashx_t *) zhashx_lookup (self->prefixes, prefix), &result, now);
+    }
+    return result;
+}
+
+size_t
+zm_watches_size (zm_watches_t *self)
+{
+    assert (self);
+    return self->size;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Self test of this class
+
+void
+zm_watches_test (bool verbose)
+{
+    printf (" * zm_watches: ");
+
+    //  @selftest
+    zm_watches_t *self = zm_watches_new ();
+    assert (self);
+    assert (!zm_watches_match (self, "device1"));
+
+    int r = zm_watches_insert (self, "ui", "device1", 60000);
+    assert (r == 0);
+    r = zm_watches_insert (self, "ui", "dev*", 60000);
+    assert (r == 0);
+    r = zm_watches_insert (self, "agent", "*", 60000);
+    assert (r == 0);
+    r = zm_watches_insert (self, "short", "device2", 0);
+    assert (r == 0);
+    assert (zm_watches_insert (self, "ui", "", 60000) == -1);
+    assert (zm_watches_size (self) == 4);
+
+    //  Watcher matching by name and prefix is listed once
+    zlistx_t *watchers = zm_watches_match (self, "device1");
+    assert (watchers);
+    assert (zlistx_size (watchers) == 2);
+    zlistx_destroy (&watchers);
+
+    watchers = zm_watches_match (self, "host1");
+    assert (watchers);
+    assert (zlistx_size (watchers) == 1);
+    assert (streq ((char *) zlistx_first (watchers), "agent"));
+    zlistx_destroy (&watchers);
+
+    //  Expired lease does not match and it is swept away
+    watchers = zm_watches_match (self, "device2");
+    assert (zlistx_size (watchers) == 2);
+    zlistx_destroy (&watchers);
+    assert (zm_watches_expire (self) == 1);
+    assert (zm_watches_size (self) == 3);
+
+    zm_watches_delete (self, "ui", "dev*");
+    watchers = zm_watches_match (self, "device3");
+    assert (zlistx_size (watchers) == 1);
+    zlistx_destroy (&watchers);
+
+    zm_watches_purge (self, "agent");
+    zm_watches_purge (self, "ui");
+    assert (zm_watches_size (self) == 0);
+    assert (!zm_watches_match (self, "device1"));
+
+    zm_watches_destroy (&self);
+    //  @end
+    printf ("OK\n");
+}
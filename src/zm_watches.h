@@ -0,0 +1,66 @@
+/*  =========================================================================
+    zm_watches - Watchers of devices
+
+    Copyright (c) the Contributors as noted in the AUTHORS file.  This file is part
+    of zmon.it, the fast and scalable monitoring system.                           
+                                                                                   
+    This Source Code Form is subject to the terms of the Mozilla Public License, v.
+    2.0. If a copy of the MPL was not distributed with this file, You can obtain   
+    one at http://mozilla.org/MPL/2.0/.                                            
+    =========================================================================
+*/
+
+#ifndef ZM_WATCHES_H_INCLUDED
+#define ZM_WATCHES_H_INCLUDED
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//  @interface
+//  Create a new zm_watches
+ZM_ASSET_PRIVATE zm_watches_t *
+    zm_watches_new (void);
+
+//  Destroy the zm_watches
+ZM_ASSET_PRIVATE void
+    zm_watches_destroy (zm_watches_t **self_p);
+
+//  Register interest of watcher in pattern for lease msecs. Pattern is
+//  device name, or prefix of name when it ends by '*'. Watching the same
+//  pattern again renews the lease. Returns 0 if OK, -1 if pattern is invalid.
+ZM_ASSET_PRIVATE int
+    zm_watches_insert (zm_watches_t *self, const char *watcher, const char *pattern, int64_t lease);
+
+//  Remove interest of watcher in pattern
+ZM_ASSET_PRIVATE void
+    zm_watches_delete (zm_watches_t *self, const char *watcher, const char *pattern);
+
+//  Remove all watches of watcher, i.e. when it is known to be gone
+ZM_ASSET_PRIVATE void
+    zm_watches_purge (zm_watches_t *self, const char *watcher);
+
+//  Return list of watchers interested in device name, each watcher is
+//  listed once. Caller owns returned list, NULL if there are no watchers.
+ZM_ASSET_PRIVATE zlistx_t *
+    zm_watches_match (zm_watches_t *self, const char *name);
+
+//  Remove watches with expired lease, return number of removed watches
+ZM_ASSET_PRIVATE size_t
+    zm_watches_expire (zm_watches_t *self);
+
+//  Return number of active watches
+ZM_ASSET_PRIVATE size_t
+    zm_watches_size (zm_watches_t *self);
+
+//  Self test of this class
+ZM_ASSET_PRIVATE void
+    zm_watches_test (bool verbose);
+
+//  @end
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif